@@ -1,5 +1,6 @@
 #include "Playground.hpp"
 
+#include <CEngine/IO/FileStream.hpp>
 #include <CEngine/Math/Matrices.hpp>
 #include <CEngine/GL/GeometryBufferView.hpp>
 #include <CEngine/Resources/Image.hpp>
@@ -13,6 +14,8 @@
 using namespace PyEngine;
 using namespace PyEngine::UI;
 
+static const char *const input_recording_filename = "playground.mlir";
+
 
 /* PlaygroundScene */
 
@@ -227,6 +230,12 @@ void PlaygroundMode::disable()
     _emission_indicies = nullptr;
     _atlas_geometry = nullptr;
     _object_geometry = nullptr;
+
+    _level->finish_input_recording();
+    StreamHandle recording_file(new FileStream(
+        input_recording_filename, OM_WRITE, WM_OVERWRITE));
+    _input_recording.save(*recording_file);
+
     _level = nullptr;
     glDeleteTextures(1, &_debug_tex);
     glDeleteTextures(1, &_texatlas);
@@ -278,7 +287,7 @@ void PlaygroundMode::enable(Application *root)
     setup_textures();
     setup_materials();
 
-    _player = new PlayerObject(_level.get());
+    _player = _level->create_object<PlayerObject>();
     _level->place_player(
         _player,
         7, 48);
@@ -287,7 +296,7 @@ void PlaygroundMode::enable(Application *root)
 
     for (CoordInt x = 0; x < 50; x++) {
         for (CoordInt y = 49; y >= (x == 10 || x == 8 ? 30 : 49); y--) {
-            obj = new SafeWallObject(_level.get());
+            obj = _level->create_object<SafeWallObject>();
             _level->place_object(
                 obj,
                 x, y);
@@ -298,12 +307,14 @@ void PlaygroundMode::enable(Application *root)
         if (y == 45) {
             continue;
         }
-        obj = new BombObject(_level.get());
+        obj = _level->create_object<BombObject>();
         _level->place_object(
             obj,
             9, y);
     }
 
+    _level->record_input(&_input_recording);
+
     glGenTextures(1, &_debug_tex);
     glBindTexture(GL_TEXTURE_2D, _debug_tex);
     glTexImage2D(GL_TEXTURE_2D,
@@ -416,9 +427,11 @@ void PlaygroundMode::frame_unsynced(TimeFloat deltaT)
         ++cell;
     }
 
-    size_t i = 0;
-    for (auto &part: _level->particles())
+    const ParticleSystem &particles = _level->particles();
+    for (size_t i = 0; i < particles.active_size(); i++)
     {
+        const PhysicsParticle part = particles.get(i);
+
         if (_particle_verticies.size() == i) {
             _particle_verticies.push_back(
                 _object_geometry->allocateVertices(4));
@@ -428,13 +441,13 @@ void PlaygroundMode::frame_unsynced(TimeFloat deltaT)
             _object_geometry,
             _particle_verticies[i]);
 
-        const PyEngine::GL::GLVertexFloat age = part->age / part->lifetime;
+        const PyEngine::GL::GLVertexFloat age = part.age / part.lifetime;
         const PyEngine::GL::GLVertexFloat size = age * 0.8 + 0.2;
         const PyEngine::GL::GLVertexFloat halfsize = size/2;
-        const PyEngine::GL::GLVertexFloat x0 = part->x;
-        const PyEngine::GL::GLVertexFloat y0 = part->y;
+        const PyEngine::GL::GLVertexFloat x0 = part.x;
+        const PyEngine::GL::GLVertexFloat y0 = part.y;
 
-        const Matrix3f rotmat = rotation3(eZ, part->phi);
+        const Matrix3f rotmat = rotation3(eZ, part.phi);
 
         const Vector3f offset = Vector3f(x0, y0, 0);
 
@@ -450,7 +463,7 @@ void PlaygroundMode::frame_unsynced(TimeFloat deltaT)
 
         buffer.getPositionView()->set(&position_data.front()[0]);
 
-        switch (part->type)
+        switch (part.type)
         {
         case ParticleType::FIRE:
         {
@@ -492,8 +505,6 @@ void PlaygroundMode::frame_unsynced(TimeFloat deltaT)
             break;
         }
         }
-
-        ++i;
     }
 
 
@@ -543,7 +554,6 @@ void PlaygroundMode::frame_unsynced(TimeFloat deltaT)
     // glEnable(GL_TEXTURE_2D);
     // glEnable(GL_BLEND);
 
-    // _level->physics().wait_for();
     // _level->physics().to_gl_texture(0.0, 2.0, false);
 
     // glColor4f(1, 1, 1, 0.5);
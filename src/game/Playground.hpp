@@ -6,6 +6,7 @@
 
 #include "Mode.hpp"
 
+#include "logic/InputRecording.hpp"
 #include "logic/Particles.hpp"
 #include "logic/Level.hpp"
 #include "logic/PlayerObject.hpp"
@@ -47,6 +48,9 @@ private:
 
     PlayerObject *_player;
 
+    /* saved when the mode is disabled, see disable() */
+    InputRecording _input_recording;
+
 protected:
     void setup_texture(
         const MaterialKey &key,
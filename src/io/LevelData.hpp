@@ -184,6 +184,11 @@ public:
         return _display_name;
     }
 
+    inline const PhysicsInitialValue &get_physics_initial_background() const
+    {
+        return _physics_initial_background;
+    }
+
     inline const PyEngine::UUID &get_uuid() const
     {
         return _uuid;
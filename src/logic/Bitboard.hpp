@@ -0,0 +1,122 @@
+#ifndef _ML_BITBOARD_H
+#define _ML_BITBOARD_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "Types.hpp"
+
+/**
+ * A two-dimensional bit set with one bit per cell. Each row starts at a
+ * new 64 bit word; bit (x & 63) of word (x >> 6) of a row corresponds to
+ * column x. Padding bits at the end of each row are always zero.
+ *
+ * A column-major board is simply a Bitboard with width and height
+ * swapped, addressed as (y, x).
+ *
+ * test(), set(), reset() and assign() access the words atomically (with
+ * relaxed ordering), so that threads may concurrently change different
+ * bits of the same word. The bulk accessors are not synchronized.
+ */
+class Bitboard
+{
+public:
+    Bitboard(CoordInt width, CoordInt height):
+        _width(width),
+        _height(height),
+        _row_words((width + 63) / 64),
+        _words(_row_words * height, 0)
+    {
+
+    }
+
+private:
+    CoordInt _width, _height;
+    CoordInt _row_words;
+    std::vector<uint64_t> _words;
+
+public:
+    inline CoordInt width() const
+    {
+        return _width;
+    }
+
+    inline CoordInt height() const
+    {
+        return _height;
+    }
+
+    inline CoordInt row_words() const
+    {
+        return _row_words;
+    }
+
+    inline uint64_t *row(CoordInt y)
+    {
+        return &_words[y*_row_words];
+    }
+
+    inline const uint64_t *row(CoordInt y) const
+    {
+        return &_words[y*_row_words];
+    }
+
+    inline bool test(CoordInt x, CoordInt y) const
+    {
+        return (__atomic_load_n(&row(y)[x >> 6], __ATOMIC_RELAXED)
+                >> (x & 63)) & 1;
+    }
+
+    inline void set(CoordInt x, CoordInt y)
+    {
+        __atomic_fetch_or(&row(y)[x >> 6],
+                          uint64_t(1) << (x & 63),
+                          __ATOMIC_RELAXED);
+    }
+
+    inline void reset(CoordInt x, CoordInt y)
+    {
+        __atomic_fetch_and(&row(y)[x >> 6],
+                           ~(uint64_t(1) << (x & 63)),
+                           __ATOMIC_RELAXED);
+    }
+
+    inline void assign(CoordInt x, CoordInt y, bool value)
+    {
+        if (value) {
+            set(x, y);
+        } else {
+            reset(x, y);
+        }
+    }
+
+    /**
+     * Return the word of row *y* which contains column *x*, shifted so
+     * that column *x* is in bit 0. Columns beyond the word boundary are
+     * not included.
+     */
+    inline uint64_t bits_from(CoordInt x, CoordInt y) const
+    {
+        return row(y)[x >> 6] >> (x & 63);
+    }
+
+    /**
+     * Mask of the valid bits in word *word* of a row.
+     */
+    inline uint64_t word_mask(CoordInt word) const
+    {
+        const CoordInt remaining = _width - word*64;
+        return (remaining >= 64
+                ? ~uint64_t(0)
+                : (uint64_t(1) << remaining) - 1);
+    }
+
+    void clear()
+    {
+        std::fill(_words.begin(), _words.end(), 0);
+    }
+
+};
+
+#endif
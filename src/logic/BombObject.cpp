@@ -1,5 +1,7 @@
 #include "BombObject.hpp"
 
+#include "Level.hpp"
+
 static const CellStamp bomb_object_stamp(
     {
         false, true, true, true, false,
@@ -51,6 +53,8 @@ void BombObject::headache(GameObject *from_object)
 
 void BombObject::explode()
 {
+    // the blast wave; the fire follows with the explosion
+    level->add_impulse(cell.x, cell.y, cell.x, cell.y, BOMB_PRESSURE_RISE, 0);
     level->add_large_explosion(cell.x, cell.y, 1, 1);
     destruct_self();
 }
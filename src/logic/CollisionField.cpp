@@ -0,0 +1,113 @@
+#include "CollisionField.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Physics.hpp"
+
+/* CollisionField */
+
+constexpr CoordInt CollisionField::reach;
+
+CollisionField::CollisionField(CoordInt width, CoordInt height):
+    _width(width),
+    _height(height),
+    _cells(width*height, CollisionCell{0, 0, 0, 0, 0}),
+    _dirty_blocks((width + subdivision_count - 1) / subdivision_count,
+                  (height + subdivision_count - 1) / subdivision_count)
+{
+
+}
+
+void CollisionField::update_cell(const CellMetadata *metadata,
+                                 CoordInt x, CoordInt y)
+{
+    CollisionCell &result = _cells[x+_width*y];
+    if (!metadata[x+_width*y].blocked) {
+        result = CollisionCell{0, 0, 0, 0, 0};
+        return;
+    }
+
+    // search square rings of growing radius; a ring of radius r can only
+    // contain cells at a distance of at least r, so the search ends as
+    // soon as such a ring cannot beat the best cell found
+    CoordInt best_dx = 0, best_dy = 0;
+    CoordInt best_dist2 = reach*reach + 1;
+    for (CoordInt r = 1; r <= reach && r*r < best_dist2; r++) {
+        for (CoordInt oy = -r; oy <= r; oy++) {
+            const CoordInt ny = y + oy;
+            if (ny < 0 || ny >= _height) {
+                continue;
+            }
+            const CoordInt step = (oy == -r || oy == r ? 1 : 2*r);
+            for (CoordInt ox = -r; ox <= r; ox += step) {
+                const CoordInt nx = x + ox;
+                const CoordInt dist2 = ox*ox + oy*oy;
+                if (nx < 0 || nx >= _width || dist2 >= best_dist2
+                    || metadata[nx+_width*ny].blocked)
+                {
+                    continue;
+                }
+                best_dx = ox;
+                best_dy = oy;
+                best_dist2 = dist2;
+            }
+        }
+    }
+
+    if (best_dx == 0 && best_dy == 0) {
+        result = CollisionCell{0, 0, float(reach + 1), 0, 0};
+        return;
+    }
+
+    const float depth = std::sqrt(float(best_dist2));
+    result = CollisionCell{int8_t(best_dx), int8_t(best_dy), depth,
+                           best_dx / depth, best_dy / depth};
+}
+
+void CollisionField::invalidate(CoordInt x0, CoordInt y0,
+                                CoordInt x1, CoordInt y1)
+{
+    // the way out of a cell depends on all cells within reach
+    const CoordInt bx0 = std::max(x0 - reach, CoordInt(0)) / subdivision_count;
+    const CoordInt by0 = std::max(y0 - reach, CoordInt(0)) / subdivision_count;
+    const CoordInt bx1 = std::min(x1 + reach, _width - 1) / subdivision_count;
+    const CoordInt by1 = std::min(y1 + reach, _height - 1) / subdivision_count;
+    for (CoordInt by = by0; by <= by1; by++) {
+        for (CoordInt bx = bx0; bx <= bx1; bx++) {
+            _dirty_blocks.set(bx, by);
+        }
+    }
+}
+
+void CollisionField::invalidate_all()
+{
+    invalidate(0, 0, _width - 1, _height - 1);
+}
+
+void CollisionField::update(const CellMetadata *metadata,
+                            CoordInt y0, CoordInt y1)
+{
+    const CoordInt by0 = (y0 + subdivision_count - 1) / subdivision_count;
+    const CoordInt by1 = std::min(y1 / subdivision_count,
+                                  _dirty_blocks.height() - 1);
+    for (CoordInt by = by0; by <= by1; by++) {
+        uint64_t *const words = _dirty_blocks.row(by);
+        for (CoordInt w = 0; w < _dirty_blocks.row_words(); w++) {
+            while (words[w]) {
+                const CoordInt bx = w*64 + __builtin_ctzll(words[w]);
+                words[w] &= words[w] - 1;
+
+                const CoordInt x0 = bx * subdivision_count;
+                const CoordInt y0 = by * subdivision_count;
+                const CoordInt x1 = std::min(x0 + subdivision_count, _width);
+                const CoordInt y1 = std::min(y0 + subdivision_count, _height);
+                for (CoordInt y = y0; y < y1; y++) {
+                    for (CoordInt x = x0; x < x1; x++) {
+                        update_cell(metadata, x, y);
+                    }
+                }
+            }
+        }
+    }
+}
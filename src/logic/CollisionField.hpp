@@ -0,0 +1,87 @@
+#ifndef _ML_COLLISION_FIELD_H
+#define _ML_COLLISION_FIELD_H
+
+#include <cstdint>
+#include <vector>
+
+#include "Bitboard.hpp"
+#include "PhysicsConfig.hpp"
+#include "Types.hpp"
+
+struct CellMetadata;
+
+/**
+ * Way out of a blocked cell. For unblocked cells, all fields are zero.
+ *
+ * (dx, dy) is the offset to the nearest unblocked cell, *depth* its
+ * length and (nx, ny) the offset normalized, i.e. the surface normal
+ * pointing out of the blocked area. If there is no unblocked cell within
+ * CollisionField::reach, the offset and the normal are zero and *depth*
+ * is larger than the reach.
+ */
+struct CollisionCell {
+    int8_t dx, dy;
+    float depth;
+    float nx, ny;
+};
+
+/**
+ * The CollisionCell of each cell of an Automaton, derived from the
+ * blocked flags of the metadata.
+ *
+ * Changes to the blocked flags have to be announced with invalidate().
+ * update() then recomputes the cells which may be affected, in blocks of
+ * subdivision_count x subdivision_count cells, so that moving a stamp
+ * only costs work around the stamp. As the blocks are marked atomically,
+ * stamps in disjoint regions may still be placed concurrently. Updates
+ * of disjoint row ranges may run concurrently as well, which lets the
+ * workers of the automaton update their slices.
+ */
+class CollisionField
+{
+public:
+    CollisionField(CoordInt width, CoordInt height);
+
+public:
+    /**
+     * Maximum distance (in cells) searched for an unblocked cell.
+     */
+    static constexpr CoordInt reach = 2*subdivision_count;
+
+private:
+    CoordInt _width, _height;
+    std::vector<CollisionCell> _cells;
+    Bitboard _dirty_blocks;
+
+private:
+    void update_cell(const CellMetadata *metadata, CoordInt x, CoordInt y);
+
+public:
+    inline const CollisionCell *cells() const
+    {
+        return _cells.data();
+    }
+
+    inline const CollisionCell &at(CoordInt x, CoordInt y) const
+    {
+        return _cells[x+_width*y];
+    }
+
+    /**
+     * Announce that the blocked flags in [x0, x1] x [y0, y1] may have
+     * changed.
+     */
+    void invalidate(CoordInt x0, CoordInt y0, CoordInt x1, CoordInt y1);
+
+    void invalidate_all();
+
+    /**
+     * Recompute the cells affected by the changes announced since they
+     * were last recomputed, from the *metadata* of the automaton. Only the
+     * blocks whose top row lies in [y0, y1] are handled.
+     */
+    void update(const CellMetadata *metadata, CoordInt y0, CoordInt y1);
+
+};
+
+#endif
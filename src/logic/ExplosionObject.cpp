@@ -1,5 +1,8 @@
 #include "ExplosionObject.hpp"
 
+#include "Level.hpp"
+#include "LevelState.hpp"
+
 static const CellStamp explosion_object_stamp(
     {
         false, false, false, false, false,
@@ -34,15 +37,24 @@ ExplosionView::ExplosionView():
 /* ExplosionObject */
 
 ExplosionObject::ExplosionObject(Level *level):
-    GameObject(explosion_object_info, level)
+    GameObject(explosion_object_info, level),
+    destruct_timer()
 {
-    die_at = level->get_ticks() + EXPLOSION_BLOCK_LIFETIME;
+
 }
 
-void ExplosionObject::update()
+ExplosionObject::~ExplosionObject()
 {
-    GameObject::update();
-    if (ticks >= die_at) {
-        destruct_self();
-    }
+    level->cancel_timer(destruct_timer);
+}
+
+void ExplosionObject::restore_state(StateReader &reader)
+{
+    // handles stay valid, as the timers are restored exactly
+    reader.read(destruct_timer);
+}
+
+void ExplosionObject::save_state(StateWriter &writer) const
+{
+    writer.write(destruct_timer);
 }
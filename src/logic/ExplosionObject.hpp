@@ -2,6 +2,7 @@
 #define _ML_EXPLOSION_OBJECT_H
 
 #include "GameObject.hpp"
+#include "TimerWheel.hpp"
 
 struct ExplosionView: public ObjectView
 {
@@ -14,12 +15,15 @@ struct ExplosionObject: public GameObject
 {
 public:
     ExplosionObject(Level *level);
+    ~ExplosionObject() override;
 
-private:
-    TickCounter die_at;
+public:
+    /* removes the explosion from the level at the end of its lifetime */
+    TimerHandle destruct_timer;
 
 public:
-    void update() override;
+    void restore_state(StateReader &reader) override;
+    void save_state(StateWriter &writer) const override;
 
 };
 
@@ -25,6 +25,7 @@ authors named in the AUTHORS file.
 #include "GameObject.hpp"
 
 #include "Errors.hpp"
+#include "Level.hpp"
 #include "Physics.hpp"
 
 /* FrameState */
@@ -143,14 +144,22 @@ GameObject::GameObject(const ObjectInfo &info,
     phi(0),
     movement(nullptr),
     phy(),
-    ticks(0)
+    ticks(0),
+    pool(nullptr)
 {
 
 }
 
+GameObject::~GameObject()
+{
+    if (movement) {
+        level->cancel_movement(this);
+    }
+}
+
 void GameObject::destruct_self()
 {
-    // cleanup_cell calls delete
+    // cleanup_cell destroys the object
     level->cleanup_cell(level->get_cell(cell.x, cell.y));
 }
 
@@ -162,52 +171,43 @@ bool GameObject::handle_gravity()
 
     assert(!movement);
 
-    LevelCell *my_cell = level->get_cell(cell.x, cell.y);
     LevelCell *below = level->get_cell(cell.x, cell.y+1);
-    if (!below->here && !below->reserved_by) {
-        movement = std::unique_ptr<Movement>(
-            new MovementStraight(my_cell, below, 0, 1));
+    if (level->is_cell_free(cell.x, cell.y+1)) {
+        level->start_movement(MovementKind::STRAIGHT, this, 0, 1);
         return true;
     }
 
     if (info.is_rollable && below->here && below->here->info.is_rollable)
     {
-        LevelCell *left = 0, *left_below = 0;
-        LevelCell *right = 0, *right_below = 0;
+        LevelCell *left = 0;
+        LevelCell *right = 0;
         if (cell.x > 0) {
-            level->get_fall_channel(cell.x-1, cell.y, left, left_below);
+            left = level->get_fall_channel(cell.x-1, cell.y);
         }
         if (cell.x < level->get_width() - 1) {
-            level->get_fall_channel(cell.x+1, cell.y, right, right_below);
+            right = level->get_fall_channel(cell.x+1, cell.y);
         }
 
         if (left && right) {
-            if ((float)rand() / RAND_MAX >= 0.5) {
+            if (level->coin_flip(cell.x, cell.y)) {
                 left = nullptr;
             } else {
                 right = nullptr;
             }
         }
 
-        LevelCell *selected = 0, *selected_below = 0;
+        LevelCell *selected = 0;
         CoordInt xoffset = 0;
         if (left) {
             selected = left;
-            selected_below = left_below;
             xoffset = -1;
         } else {
             selected = right;
-            selected_below = right_below;
             xoffset = 1;
         }
 
         if (selected) {
-            movement = std::unique_ptr<Movement>(
-                new MovementRoll(
-                    my_cell,
-                    selected,
-                    selected_below,
-                    xoffset, 1));
+            level->start_movement(MovementKind::ROLL, this, xoffset, 1);
         }
         return true;
     }
@@ -215,7 +215,7 @@ bool GameObject::handle_gravity()
     return true;
 }
 
-bool GameObject::after_movement(Movement *prev_movement)
+bool GameObject::after_movement(const Movement *prev_movement)
 {
     if (!info.is_gravity_affected) {
         return true;
@@ -244,7 +244,7 @@ bool GameObject::after_movement(Movement *prev_movement)
     return true;
 }
 
-void GameObject::before_movement(Movement *movement)
+void GameObject::before_movement(const Movement *movement)
 {
 
 }
@@ -287,6 +287,11 @@ bool GameObject::impact(GameObject *on_object)
     return true;
 }
 
+bool GameObject::is_awake() const
+{
+    return bool(movement);
+}
+
 bool GameObject::move(MoveDirection dir, bool chain_move)
 {
     if (!info.is_movable || movement) {
@@ -326,15 +331,12 @@ bool GameObject::move(MoveDirection dir, bool chain_move)
         && neighy >= 0 && neighy < level->get_height())
     {
         LevelCell *neighbour = level->get_cell(neighx, neighy);
-        if (!neighbour->reserved_by
+        if (!level->is_cell_reserved(neighx, neighy)
             && (!neighbour->here || (chain_move
                                      && neighbour->here->move(dir, false))))
         {
-            movement = std::unique_ptr<Movement>(
-                new MovementStraight(
-                    level->get_cell(cell.x, cell.y),
-                    neighbour,
-                    offsx, offsy));
+            level->start_movement(MovementKind::STRAIGHT, this,
+                                  offsx, offsy);
             return true;
         }
     }
@@ -347,6 +349,16 @@ bool GameObject::projectile_impact()
     return false;
 }
 
+void GameObject::restore_state(StateReader&)
+{
+
+}
+
+void GameObject::save_state(StateWriter&) const
+{
+
+}
+
 void GameObject::update()
 {
     if (ticks == level->get_ticks()) {
@@ -355,7 +367,7 @@ void GameObject::update()
     ticks = level->get_ticks();
 
     if (movement) {
-        if (!movement->update()) {
+        if (!level->advance_movement(this)) {
             return;
         }
     }
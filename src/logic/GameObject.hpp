@@ -26,6 +26,7 @@ authors named in the AUTHORS file.
 #define _ML_GAME_OBJECT_H
 
 #include <CEngine/IO/Stream.hpp>
+#include <CEngine/IO/Time.hpp>
 #include <CEngine/Misc/Exception.hpp>
 #include <CEngine/GL/GeometryBuffer.hpp>
 
@@ -37,7 +38,10 @@ authors named in the AUTHORS file.
 
 struct Cell;
 class Level;
-class Movement;
+struct Movement;
+class ObjectPoolBase;
+class StateReader;
+class StateWriter;
 
 /**
  * The FrameState holds a set of flags and values which are calculated for each
@@ -174,6 +178,7 @@ public:
     explicit GameObject(const ObjectInfo &info,
                         Level *level);
     GameObject(const GameObject &ref) = delete;
+    ~GameObject() override;
     GameObject& operator=(const GameObject &ref) = delete;
 
 public:
@@ -182,7 +187,13 @@ public:
     const ObjectInfo &info;
     CoordPair cell;
     double x, y, phi;
-    std::unique_ptr<Movement> movement;
+
+    /**
+     * The movement of the object, or nullptr if it is not moving. The
+     * record is owned by the level.
+     */
+    Movement *movement;
+
     CoordPair phy;
 
     /**
@@ -191,6 +202,12 @@ public:
      */
     TickCounter ticks;
 
+    /**
+     * The pool which owns the storage of this object, or nullptr if the
+     * object has been allocated with new.
+     */
+    ObjectPoolBase *pool;
+
 protected:
     /**
      * Destruct this object.
@@ -216,14 +233,14 @@ public:
      * @return true if further handlers (to be specified) shall be called, false
      * otherwise.
      */
-    virtual bool after_movement(Movement *prev_movement);
+    virtual bool after_movement(const Movement *prev_movement);
 
     /**
      * Notify the object of a movement which is about to start.
      *
      * @param movement The movement which is going to happen.
      */
-    virtual void before_movement(Movement *movement);
+    virtual void before_movement(const Movement *movement);
 
     /**
      * Notify the object that it has been touched by an explosion.
@@ -255,6 +272,12 @@ public:
     /**
      * Notify the object that it has been touched by igniting particles (sparks
      * etc.).
+     *
+     * Particles are updated while the automaton is running, so this must
+     * not modify the physics (e.g. by moving or destroying the object);
+     * the modifying calls of Automaton assert that it is stopped. Queue
+     * such changes through the level instead, e.g. with add_explosion()
+     * or add_impulse().
      */
     virtual void ignition_touch();
 
@@ -271,6 +294,17 @@ public:
      */
     virtual bool impact(GameObject *on_object);
 
+    /**
+     * Return whether the object has to be updated in the next tick, even
+     * if nothing changes around it.
+     *
+     * Objects which return false are only updated again once a cell in
+     * their neighbourhood changes (see Level::set_cell_here()). The default
+     * implementation keeps moving objects awake; objects which act on
+     * their own (e.g. controlled by the player) must override this.
+     */
+    virtual bool is_awake() const;
+
     /**
      * Instruct the object to move into the given direction. Return whether
      * movement initiation worked.
@@ -292,6 +326,21 @@ public:
      */
     virtual bool projectile_impact();
 
+    /**
+     * Restore the state written by save_state().
+     */
+    virtual void restore_state(StateReader &reader);
+
+    /**
+     * Write the state specific to the type of the object, which is not
+     * covered by the members of GameObject, for Level::save_state().
+     * References to other objects or to the level must not be written as
+     * pointers.
+     *
+     * The default implementation writes nothing.
+     */
+    virtual void save_state(StateWriter &writer) const;
+
     /**
      * Update the objects state by advancing by one tick.
      *
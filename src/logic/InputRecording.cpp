@@ -0,0 +1,221 @@
+#include "InputRecording.hpp"
+
+#include <cstring>
+
+#include "io/Common.hpp"
+
+static const char recording_magic[4] = {'M', 'L', 'I', 'R'};
+static constexpr uint16_t recording_version = 1;
+static constexpr size_t header_size = 40;
+
+/* free functions */
+
+static inline void put_uint(std::vector<uint8_t> &buf,
+                            uint64_t value,
+                            unsigned int bytes)
+{
+    for (unsigned int i = 0; i < bytes; i++) {
+        buf.push_back(value & 0xff);
+        value >>= 8;
+    }
+}
+
+static inline void put_varint(std::vector<uint8_t> &buf, uint32_t value)
+{
+    while (value >= 0x80) {
+        buf.push_back((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    buf.push_back(value);
+}
+
+static inline uint64_t get_uint(const uint8_t *&pos, unsigned int bytes)
+{
+    uint64_t result = 0;
+    for (unsigned int i = 0; i < bytes; i++) {
+        result |= uint64_t(*pos++) << (8*i);
+    }
+    return result;
+}
+
+static inline uint32_t get_varint(const uint8_t *&pos, const uint8_t *end)
+{
+    uint32_t result = 0;
+    unsigned int shift = 0;
+    while (true) {
+        if (pos == end || shift > 28) {
+            throw LevelIOError("Malformed varint in input recording.");
+        }
+        const uint8_t byte = *pos++;
+        result |= uint32_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return result;
+        }
+        shift += 7;
+    }
+}
+
+/* PlayerInput */
+
+PlayerInput::PlayerInput():
+    action(ACTION_NONE),
+    move_direction(MOVE_LEFT),
+    flamethrower(false)
+{
+
+}
+
+PlayerInput PlayerInput::capture(const PlayerObject &player)
+{
+    PlayerInput result;
+    result.action = player.action;
+    result.move_direction = player.move_direction;
+    result.flamethrower = (player.active_weapon == &player.flamethrower);
+    return result;
+}
+
+void PlayerInput::apply(PlayerObject &player) const
+{
+    player.action = action;
+    player.move_direction = move_direction;
+    player.active_weapon = (flamethrower ? &player.flamethrower : nullptr);
+}
+
+uint8_t PlayerInput::pack() const
+{
+    return uint8_t(action)
+        | (uint8_t(move_direction) << 2)
+        | (uint8_t(flamethrower) << 4);
+}
+
+PlayerInput PlayerInput::unpack(uint8_t packed)
+{
+    if ((packed & 0x3) > ACTION_FIRE_WEAPON || (packed & 0xe0)) {
+        throw LevelIOError("Invalid input in input recording.");
+    }
+
+    PlayerInput result;
+    result.action = static_cast<Action>(packed & 0x3);
+    result.move_direction = static_cast<MoveDirection>((packed >> 2) & 0x3);
+    result.flamethrower = (packed >> 4) & 0x1;
+    return result;
+}
+
+/* InputRecording */
+
+InputRecording::InputRecording():
+    _seed(0),
+    _player_x(-1),
+    _player_y(-1),
+    _length(0),
+    _final_digest(0),
+    _events()
+{
+
+}
+
+void InputRecording::start(uint64_t seed,
+                           CoordInt player_x,
+                           CoordInt player_y)
+{
+    _seed = seed;
+    _player_x = player_x;
+    _player_y = player_y;
+    _length = 0;
+    _final_digest = 0;
+    _events.clear();
+}
+
+void InputRecording::record(TickCounter tick, const PlayerInput &input)
+{
+    const PlayerInput &previous = (_events.empty()
+                                   ? PlayerInput()
+                                   : _events.back().input);
+    if (input != previous) {
+        _events.push_back(Event{tick, input});
+    }
+    _length = tick;
+}
+
+void InputRecording::finish(TickCounter length, uint64_t final_digest)
+{
+    _length = length;
+    _final_digest = final_digest;
+}
+
+void InputRecording::load(PyEngine::Stream &stream)
+{
+    uint8_t header[header_size];
+    if (stream.read(header, sizeof(header)) != sizeof(header)) {
+        throw LevelIOError("Unexpected end of input recording.");
+    }
+    if (memcmp(header, recording_magic, 4) != 0) {
+        throw LevelIOError("Not an input recording.");
+    }
+
+    const uint8_t *pos = &header[4];
+    if (get_uint(pos, 2) != recording_version) {
+        throw LevelIOError("Unsupported input recording version.");
+    }
+    get_uint(pos, 2);
+
+    _seed = get_uint(pos, 8);
+    _player_x = int32_t(get_uint(pos, 4));
+    _player_y = int32_t(get_uint(pos, 4));
+    _length = get_uint(pos, 4);
+    _final_digest = get_uint(pos, 8);
+    const uint32_t event_count = get_uint(pos, 4);
+
+    // the events extend up to the end of the stream
+    std::vector<uint8_t> payload;
+    uint8_t buf[4096];
+    uint64_t read;
+    while ((read = stream.read(buf, sizeof(buf))) > 0) {
+        payload.insert(payload.end(), buf, buf + read);
+    }
+
+    _events.clear();
+    _events.reserve(event_count);
+    pos = payload.data();
+    const uint8_t *const end = pos + payload.size();
+    TickCounter tick = 0;
+    for (uint32_t i = 0; i < event_count; i++) {
+        tick += get_varint(pos, end);
+        if (pos == end) {
+            throw LevelIOError("Unexpected end of input recording.");
+        }
+        _events.push_back(Event{tick, PlayerInput::unpack(*pos++)});
+    }
+
+    if (tick > _length) {
+        throw LevelIOError("Input recording events exceed its length.");
+    }
+}
+
+void InputRecording::save(PyEngine::Stream &stream) const
+{
+    std::vector<uint8_t> buf;
+    buf.reserve(header_size + _events.size() * 2);
+
+    buf.insert(buf.end(), recording_magic, recording_magic + 4);
+    put_uint(buf, recording_version, 2);
+    put_uint(buf, 0, 2);
+    put_uint(buf, _seed, 8);
+    put_uint(buf, uint32_t(_player_x), 4);
+    put_uint(buf, uint32_t(_player_y), 4);
+    put_uint(buf, _length, 4);
+    put_uint(buf, _final_digest, 8);
+    put_uint(buf, _events.size(), 4);
+
+    TickCounter previous = 0;
+    for (const Event &event: _events) {
+        put_varint(buf, event.tick - previous);
+        buf.push_back(event.input.pack());
+        previous = event.tick;
+    }
+
+    if (stream.write(buf.data(), buf.size()) != buf.size()) {
+        throw LevelIOError("Could not write input recording.");
+    }
+    stream.flush();
+}
@@ -0,0 +1,156 @@
+#ifndef _ML_INPUT_RECORDING_H
+#define _ML_INPUT_RECORDING_H
+
+#include <cstdint>
+#include <vector>
+
+#include <CEngine/IO/Stream.hpp>
+
+#include "PlayerObject.hpp"
+
+/* The recording is a little endian binary file. It starts with a header:
+ *
+ *   char[4]  magic "MLIR"
+ *   uint16   version
+ *   uint16   reserved (0)
+ *   uint64   seed of the level (see Level::seed())
+ *   int32    x, y of the player when the recording was started, or -1
+ *            if the level had no player
+ *   uint32   length of the recording in ticks
+ *   uint64   state digest of the level at the end of the recording
+ *   uint32   event count
+ *
+ * followed by one event for each tick in which the input changed:
+ *
+ *   varint   ticks since the previous event (since the start of the
+ *            recording for the first event)
+ *   uint8    input, as returned by PlayerInput::pack()
+ */
+
+/**
+ * The controls of a player in a single tick.
+ */
+struct PlayerInput
+{
+    /**
+     * The input of a freshly constructed PlayerObject.
+     */
+    PlayerInput();
+
+    Action action;
+    MoveDirection move_direction;
+    bool flamethrower;
+
+    inline bool operator==(const PlayerInput &other) const
+    {
+        return action == other.action
+            && move_direction == other.move_direction
+            && flamethrower == other.flamethrower;
+    }
+
+    inline bool operator!=(const PlayerInput &other) const
+    {
+        return !(*this == other);
+    }
+
+    static PlayerInput capture(const PlayerObject &player);
+    void apply(PlayerObject &player) const;
+
+    /**
+     * Encode the input in a byte: the action in bits 0-1, the direction in
+     * bits 2-3 and the weapon in bit 4.
+     */
+    uint8_t pack() const;
+    static PlayerInput unpack(uint8_t packed);
+};
+
+/**
+ * The input of a player over a span of ticks, together with what is needed
+ * to reproduce the run: the seed of the level and the position of the
+ * player. Only the ticks in which the input changed are stored.
+ *
+ * Recordings are fed by Level::record_input() and played back with
+ * Level::replay_input(). A replay of the recording on the level it was
+ * recorded on ends in the same state digest, which is stored with the
+ * recording. Like the digests themselves, this only holds within the same
+ * build.
+ */
+class InputRecording
+{
+public:
+    InputRecording();
+
+public:
+    struct Event {
+        /* ticks since the start of the recording, starting at 1 for the
+         * first update */
+        TickCounter tick;
+        PlayerInput input;
+    };
+
+private:
+    uint64_t _seed;
+    CoordInt _player_x, _player_y;
+    TickCounter _length;
+    uint64_t _final_digest;
+    std::vector<Event> _events;
+
+public:
+    /**
+     * Discard all events and start a new recording.
+     */
+    void start(uint64_t seed, CoordInt player_x, CoordInt player_y);
+
+    /**
+     * Record the input of tick *tick*. Ticks must be passed in increasing
+     * order; an event is only stored if the input differs from that of the
+     * previous tick.
+     */
+    void record(TickCounter tick, const PlayerInput &input);
+
+    /**
+     * Set the length of the recording and the state digest the level
+     * reached.
+     */
+    void finish(TickCounter length, uint64_t final_digest);
+
+    inline uint64_t seed() const
+    {
+        return _seed;
+    }
+
+    inline CoordInt player_x() const
+    {
+        return _player_x;
+    }
+
+    inline CoordInt player_y() const
+    {
+        return _player_y;
+    }
+
+    inline TickCounter length() const
+    {
+        return _length;
+    }
+
+    inline uint64_t final_digest() const
+    {
+        return _final_digest;
+    }
+
+    inline const std::vector<Event> &events() const
+    {
+        return _events;
+    }
+
+    /**
+     * Replace the recording with the one read from *stream*. Throws
+     * LevelIOError if the stream does not contain an input recording.
+     */
+    void load(PyEngine::Stream &stream);
+    void save(PyEngine::Stream &stream) const;
+
+};
+
+#endif
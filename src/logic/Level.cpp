@@ -24,55 +24,115 @@ authors named in the AUTHORS file.
 **********************************************************************/
 #include "Level.hpp"
 
+#include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <typeinfo>
+#include <unordered_map>
 
 #include "CEngine/Misc/Exception.hpp"
 
+#include "Errors.hpp"
 #include "ExplosionObject.hpp"
+#include "InputRecording.hpp"
+#include "LevelState.hpp"
+#include "PhysicsRecorder.hpp"
+#include "PlayerObject.hpp"
+#include "WorkerPool.hpp"
 
-/* Timer */
+/* free functions */
 
-Timer::Timer(const TickCounter trigger_at,
-             const CoordInt cellx,
-             const CoordInt celly,
-             TimerFunc func):
-    trigger_at(trigger_at),
-    x(cellx),
-    y(celly),
-    func(func)
+static inline uint64_t digest_mix(uint64_t h, uint64_t value)
 {
-    // std::cout << "+1 [con]" << std::endl;
+    h ^= value + UINT64_C(0x9e3779b97f4a7c15) + (h << 6) + (h >> 2);
+    return h;
 }
 
-Timer::Timer(Timer &&ref):
-    trigger_at(ref.trigger_at),
-    x(ref.x),
-    y(ref.y),
-    func(std::move(ref.func))
+static inline uint64_t digest_double(uint64_t h, double value)
 {
-    // std::cout << " 0 [movecon]" << std::endl;
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return digest_mix(h, bits);
 }
 
-Timer &Timer::operator=(Timer &&ref)
+/**
+ * Spread the bits of *seed* through the runs of set bits in *free*, towards
+ * higher bit indices (Kogge-Stone occluded fill).
+ */
+static inline uint64_t fill_up(uint64_t seed, uint64_t free)
 {
-    // std::cout << " 0 [moveassign]" << std::endl;
-    trigger_at = ref.trigger_at;
-    x = ref.x;
-    y = ref.y;
-    func = std::move(ref.func);
-    return *this;
+    seed |= free & (seed << 1);
+    free &= free << 1;
+    seed |= free & (seed << 2);
+    free &= free << 2;
+    seed |= free & (seed << 4);
+    free &= free << 4;
+    seed |= free & (seed << 8);
+    free &= free << 8;
+    seed |= free & (seed << 16);
+    free &= free << 16;
+    seed |= free & (seed << 32);
+    return seed;
 }
 
-Timer::~Timer()
+static inline uint64_t fill_down(uint64_t seed, uint64_t free)
 {
-//     std::cout << "-1 [dest]" << std::endl;
+    seed |= free & (seed >> 1);
+    free &= free >> 1;
+    seed |= free & (seed >> 2);
+    free &= free >> 2;
+    seed |= free & (seed >> 4);
+    free &= free >> 4;
+    seed |= free & (seed >> 8);
+    free &= free >> 8;
+    seed |= free & (seed >> 16);
+    free &= free >> 16;
+    seed |= free & (seed >> 32);
+    return seed;
+}
+
+/**
+ * Extend the set bits of *row* through the runs of set bits in *free*,
+ * across word boundaries. The bits of *row* must be a subset of *free*.
+ */
+static void fill_row(uint64_t *row, const uint64_t *free, const CoordInt words)
+{
+    for (CoordInt w = 0; w < words; w++) {
+        uint64_t seed = row[w];
+        if (w > 0) {
+            seed |= (row[w-1] >> 63) & free[w];
+        }
+        row[w] = fill_down(fill_up(seed, free[w]), free[w]);
+    }
+    for (CoordInt w = words-2; w >= 0; w--) {
+        const uint64_t carry = (row[w+1] << 63) & free[w];
+        if (carry & ~row[w]) {
+            row[w] = fill_down(row[w] | carry, free[w]);
+        }
+    }
+}
+
+/* ExplosionBatch */
+
+ExplosionBatch::ExplosionBatch(CoordInt width, CoordInt height):
+    cells(width, height),
+    x0(width),
+    y0(height),
+    x1(-1),
+    y1(-1)
+{
+
 }
 
 /* Level */
 
 #define WALL_CENTER_X 45
 
+thread_local Level::ObjectBand *Level::_current_band = nullptr;
+
 Level::Level(CoordInt width, CoordInt height, bool mp):
     _width(width),
     _height(height),
@@ -90,15 +150,40 @@ Level::Level(CoordInt width, CoordInt height, bool mp):
         mp
     ),
     _objects(),
+    _object_pools(),
+    _object_infos(),
     _player(nullptr),
     _physics_particles(*this),
-    _ticks(0)
+    _seed(0),
+    _rng(0, 0),
+    _ticks(0),
+    _timers(),
+    _explosion_batches(EXPLOSION_TRIGGER_TIMEOUT + 1,
+                       ExplosionBatch(width, height)),
+    _awake_row_words((width + 63) / 64),
+    _awake(_awake_row_words * height, 0),
+    _occupied(width, height),
+    _reserved(width, height),
+    _occupied_columns(height, width),
+    _reserved_columns(height, width),
+    _movements(width*height),
+    _object_workers(nullptr),
+    _object_bands(),
+    _physics_recorder(nullptr),
+    _input_recording(nullptr),
+    _input_replay(nullptr),
+    _input_replay_pos(0),
+    _input_start(0)
 {
     init_cells();
 }
 
 Level::~Level()
 {
+    // the automaton refers to the objects through the cell metadata, and
+    // destructors of objects may still refer to the cells and timers
+    _physics.wait_for();
+    _object_pools.clear();
     delete[] _cells;
 }
 
@@ -112,49 +197,200 @@ void Level::init_cells()
     }
 }
 
+void Level::fire_timer(const LevelTimer &timer)
+{
+    switch (timer.action) {
+    case TimerAction::EXPLOSION_BATCH:
+    {
+        fire_explosion_batch(_explosion_batches[timer.x]);
+        break;
+    }
+    case TimerAction::DESTRUCT_OBJECT:
+    {
+        LevelCell *const cell = get_cell(timer.x, timer.y);
+        if (cell->here == timer.obj) {
+            cleanup_cell(cell);
+        }
+        break;
+    }
+    }
+}
+
+void Level::fire_explosion_batch(ExplosionBatch &batch)
+{
+    const CoordInt w0 = batch.x0 >> 6;
+    const CoordInt w1 = batch.x1 >> 6;
+
+    // touching objects may add explosions, but those always go into
+    // another batch
+    for (CoordInt y = batch.y0; y <= batch.y1; y++) {
+        const uint64_t *const row = batch.cells.row(y);
+        for (CoordInt w = w0; w <= w1; w++) {
+            uint64_t bits = row[w];
+            while (bits) {
+                const CoordInt x = w*64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+
+                LevelCell *const cell = get_cell(x, y);
+                if (cell->here) {
+                    cell->here->explosion_touch();
+                }
+                if (!cell->here) {
+                    ExplosionObject *obj = create_object<ExplosionObject>();
+                    place_object(obj, x, y);
+                    obj->destruct_timer = add_timer(
+                        _ticks + EXPLOSION_BLOCK_LIFETIME,
+                        TimerAction::DESTRUCT_OBJECT,
+                        x, y,
+                        obj);
+                }
+            }
+        }
+    }
+
+    // the automaton deposits heat and pressure in its next step, once
+    // per run of exploding cells in a row
+    for (CoordInt y = batch.y0; y <= batch.y1; y++) {
+        uint64_t *const row = batch.cells.row(y);
+        CoordInt run_start = -1;
+        for (CoordInt x = batch.x0; x <= batch.x1 + 1; x++) {
+            const bool set = x <= batch.x1 && ((row[x >> 6] >> (x & 63)) & 1);
+            if (set && run_start < 0) {
+                run_start = x;
+            } else if (!set && run_start >= 0) {
+                add_impulse(run_start, y, x - 1, y,
+                            EXPLOSION_PRESSURE_RISE,
+                            EXPLOSION_TEMPERATURE_RISE);
+                run_start = -1;
+            }
+        }
+        for (CoordInt w = w0; w <= w1; w++) {
+            row[w] = 0;
+        }
+    }
+
+    batch.x0 = _width;
+    batch.y0 = _height;
+    batch.x1 = -1;
+    batch.y1 = -1;
+}
+
+void Level::spawn_explosion_particles(const CoordInt x, const CoordInt y)
+{
+    _physics_particles.emit(6, [this, x, y](size_t, PhysicsParticle &part) {
+        float r[4];
+        _rng.fill_uniform(r, 4);
+
+        part.type = ParticleType::FIRE;
+        part.age = 0;
+        part.ctr = 0;
+        const float offsx = r[0]*0.5-0.25;
+        const float offsy = r[1]*0.5-0.25;
+        part.x = x + 0.5 + offsx;
+        part.y = y + 0.5 + offsy;
+        part.vx = offsx / 2;
+        part.vy = offsy / 2;
+        part.ax = 0;
+        part.ay = 0;
+        part.phi = r[2]*2*3.14159;
+        part.vphi = (r[3]-0.5)*3.14159/5.0;
+        part.aphi = 0;
+        part.lifetime = (EXPLOSION_BLOCK_LIFETIME +
+                          EXPLOSION_TRIGGER_TIMEOUT) / 100.;
+    });
+}
+
+const ObjectInfo &Level::adopt_object_info(std::unique_ptr<ObjectInfo> info)
+{
+    _object_infos.push_back(std::move(info));
+    return *_object_infos.back();
+}
+
 void Level::add_explosion(const CoordInt x,
                           const CoordInt y)
 {
-    LevelCell *const cell = get_cell(x, y);
-    if (cell->here && !cell->here->info.is_destructible) {
+    add_explosion_region(x, y, x, y);
+}
+
+void Level::add_explosion_region(CoordInt x0, CoordInt y0,
+                                 CoordInt x1, CoordInt y1)
+{
+    x0 = std::max(x0, CoordInt(0));
+    y0 = std::max(y0, CoordInt(0));
+    x1 = std::min(x1, _width - 1);
+    y1 = std::min(y1, _height - 1);
+    if (x0 > x1 || y0 > y1) {
         return;
     }
 
-    _timers.emplace(
-        _ticks + EXPLOSION_TRIGGER_TIMEOUT,
-        x, y,
-        [x, y](Level &level, LevelCell *cell) {
-            if (cell->here) {
-                cell->here->explosion_touch();
-            }
-            if (!cell->here) {
-                ExplosionObject *obj = new ExplosionObject(&level);
-                level.place_object(
-                    obj,
-                    x, y);
+    // the cells are looked at now, while the batch is shared, see
+    // run_shared()
+    std::vector<CoordPair> cells;
+    for (CoordInt y = y0; y <= y1; y++) {
+        for (CoordInt x = x0; x <= x1; x++) {
+            const LevelCell *const cell = get_cell(x, y);
+            if (cell->here && !cell->here->info.is_destructible) {
+                continue;
             }
+            cells.emplace_back(x, y);
+        }
+    }
 
+    if (_current_band) {
+        run_shared([this, cells]() {
+            add_explosion_cells(cells);
         });
+    } else {
+        add_explosion_cells(cells);
+    }
+}
 
-    _physics_particles.spawn_generator(
-        6,
-        [x, y](PhysicsParticle *part) {
-            part->type = ParticleType::FIRE;
-            const float offsx = ((float)rand() / RAND_MAX)*0.5-0.25;
-            const float offsy = ((float)rand() / RAND_MAX)*0.5-0.25;
-            part->x = x + 0.5 + offsx;
-            part->y = y + 0.5 + offsy;
-            part->vx = offsx / 2;
-            part->vy = offsy / 2;
-            part->ax = 0;
-            part->ay = 0;
-            part->phi = ((float)rand() / RAND_MAX)*2*3.14159;
-            part->vphi = (((float)rand() / RAND_MAX)-0.5)*3.14159/5.0;
-            part->aphi = 0;
-            part->lifetime = (EXPLOSION_BLOCK_LIFETIME +
-                              EXPLOSION_TRIGGER_TIMEOUT) / 100.;
-        });
+void Level::add_explosion_cells(const std::vector<CoordPair> &cells)
+{
+    const TickCounter trigger_at = _ticks + EXPLOSION_TRIGGER_TIMEOUT;
+    const CoordInt index = trigger_at % _explosion_batches.size();
+    ExplosionBatch &batch = _explosion_batches[index];
+    const bool was_empty = batch.empty();
+
+    for (const CoordPair &cell: cells) {
+        if (batch.cells.test(cell.x, cell.y)) {
+            continue;
+        }
+
+        batch.cells.set(cell.x, cell.y);
+        batch.x0 = std::min(batch.x0, cell.x);
+        batch.y0 = std::min(batch.y0, cell.y);
+        batch.x1 = std::max(batch.x1, cell.x);
+        batch.y1 = std::max(batch.y1, cell.y);
+        spawn_explosion_particles(cell.x, cell.y);
+    }
+
+    if (was_empty && !batch.empty()) {
+        add_timer(trigger_at, TimerAction::EXPLOSION_BATCH, index, 0);
+    }
+}
 
+void Level::add_impulse(const CoordInt x0,
+                        const CoordInt y0,
+                        const CoordInt x1,
+                        const CoordInt y1,
+                        const double pressure,
+                        const double temperature,
+                        const FogDensity fog)
+{
+    const PhysicsImpulse impulse{
+        x0*subdivision_count,
+        y0*subdivision_count,
+        (x1+1)*subdivision_count - 1,
+        (y1+1)*subdivision_count - 1,
+        pressure, temperature, fog};
+    if (_current_band) {
+        run_shared([this, impulse]() {
+            _physics.push_impulse(impulse);
+        });
+    } else {
+        _physics.push_impulse(impulse);
+    }
 }
 
 void Level::add_large_explosion(const CoordInt x0,
@@ -167,12 +403,117 @@ void Level::add_large_explosion(const CoordInt x0,
     const CoordInt maxx = x0 < _width - xradius ? x0 + xradius : x0;
     const CoordInt maxy = y0 < _height - yradius ? y0 + yradius : y0;
 
-    for (CoordInt x = minx; x <= maxx; x++) {
-        for (CoordInt y = miny; y <= maxy; y++) {
-            add_explosion(x, y);
+    add_explosion_region(minx, miny, maxx, maxy);
+}
+
+TimerHandle Level::add_timer(
+    const TickCounter trigger_at,
+    const TimerAction action,
+    const CoordInt x,
+    const CoordInt y,
+    GameObject *obj)
+{
+    if (in_object_band()) {
+        throw ProgrammingError(
+            "Cannot schedule timers from the parallel object update; "
+            "use run_shared().");
+    }
+    return _timers.schedule(trigger_at, LevelTimer{action, x, y, obj});
+}
+
+bool Level::advance_movement(GameObject *obj)
+{
+    Movement &movement = *obj->movement;
+    movement.time += 1;
+    const TickCounter time = movement.time;
+
+    switch (movement.kind) {
+    case MovementKind::STRAIGHT:
+    {
+        LevelCell *const to = get_cell(obj->cell.x, obj->cell.y);
+        if (to->reserved_by) {
+            // if another object is currently moving out ouf the cell we’re
+            // moving in, we have to make sure it gets updated before us, to
+            // avoid collisions.
+            to->reserved_by->update();
+        }
+
+        if (obj->info.is_rollable)
+        {
+            if (movement.offset_x != 0) {
+                obj->phi += time_slice / obj->info.roll_radius
+                    * movement.offset_x;
+            } else {
+                obj->phi += sin(time * time_slice * 2*3.14159) / 100;
+            }
+        }
+
+        if (time >= Movement::duration) {
+            break;
+        }
+
+        obj->x = movement.start_x + movement.offset_x * (time * time_slice);
+        obj->y = movement.start_y + movement.offset_y * (time * time_slice);
+        obj->invalidate_view();
+        return true;
+    }
+    case MovementKind::ROLL:
+    {
+        if (time >= Movement::duration) {
+            break;
+        }
+
+        if (time >= Movement::duration / 2) {
+            obj->x = movement.start_x + movement.offset_x;
+            obj->y = movement.start_y + movement.offset_y
+                * ((time - Movement::duration / 2) * time_slice * 2);
+            if (!movement.cleared_from) {
+                movement.cleared_from = true;
+                set_cell_reserved_by(
+                    get_cell(movement.start_x, movement.start_y),
+                    nullptr);
+            }
+        } else {
+            obj->x = movement.start_x
+                + movement.offset_x * (time * time_slice * 2);
+            obj->y = movement.start_y;
         }
+
+        obj->invalidate_view();
+        return true;
+    }
     }
 
+    obj->x = movement.start_x + movement.offset_x;
+    obj->y = movement.start_y + movement.offset_y;
+    obj->invalidate_view();
+    return finish_movement(obj);
+}
+
+size_t Level::awake_objects() const
+{
+    size_t result = 0;
+    for (const uint64_t word: _awake) {
+        result += __builtin_popcountll(word);
+    }
+    return result;
+}
+
+void Level::cancel_timer(const TimerHandle &handle)
+{
+    if (in_object_band()) {
+        throw ProgrammingError(
+            "Cannot cancel timers from the parallel object update; "
+            "use run_shared().");
+    }
+    _timers.cancel(handle);
+}
+
+void Level::cancel_movement(GameObject *obj)
+{
+    const Movement movement = *obj->movement;
+    obj->movement = nullptr;
+    release_movement(movement);
 }
 
 void Level::cleanup_cell(LevelCell *cell)
@@ -181,15 +522,35 @@ void Level::cleanup_cell(LevelCell *cell)
     if (obj)
     {
         if (obj == _player) {
-            _on_player_death(this, obj);
-            _player = nullptr;
+            run_shared([this, obj]() {
+                _on_player_death(this, obj);
+                _player = nullptr;
+            });
         }
         _physics.clear_cells(
             obj->phy.x, obj->phy.y,
             obj->info.stamp);
-        delete obj;
+        destroy_object(obj);
+    }
+    set_cell_here(cell, nullptr);
+}
+
+uint64_t Level::column_fall_mask(const CoordInt x, const CoordInt word) const
+{
+    const CoordInt words = _occupied_columns.row_words();
+    const uint64_t *const occupied = _occupied_columns.row(x);
+    const uint64_t *const reserved = _reserved_columns.row(x);
+
+    uint64_t blocked_below = (occupied[word] | reserved[word]) >> 1;
+    if (word + 1 < words) {
+        blocked_below |= (occupied[word+1] | reserved[word+1]) << 63;
+    } else {
+        // nothing can fall out of the bottom row
+        blocked_below |= (uint64_t(1) << 63)
+            | (~_occupied_columns.word_mask(word) >> 1);
     }
-    cell->here = nullptr;
+
+    return occupied[word] & ~blocked_below;
 }
 
 void Level::debug_test_stamp(const double x, const double y)
@@ -202,7 +563,7 @@ void Level::debug_test_stamp(const double x, const double y)
             info->meta.blocked = false;
             info->meta.obj = nullptr;
             info->phys.air_pressure = 1.0;
-            info->phys.fog = 10.;
+            info->fog = 10.;
             info->phys.heat_energy = 1.0;
             info->phys.flow[0] = 0;
             info->phys.flow[1] = 0;
@@ -221,22 +582,23 @@ void Level::debug_output(const double x, const double y)
         {0, -1}, {-1, 0}, {0, 0}, {1, 0}, {0, 1}
     };
 
-    _physics.wait_for();
+    const PhysicsSnapshot view = _physics.snapshot();
 
     const CoordPair phys = get_physics_coords(x, y);
-    std::cout << "DEBUG: center at x = " << phys.x << "; y = " << phys.y << std::endl;
+    std::cout << "DEBUG: center at x = " << phys.x << "; y = " << phys.y
+              << " (epoch " << view.epoch << ")" << std::endl;
     for (int i = 0; i < 5; i++) {
         std::cout << "offs: " << offs[i][0] << ", " << offs[i][1] << std::endl;
 
         const CoordInt cx = phys.x + offs[i][0];
         const CoordInt cy = phys.y + offs[i][1];
 
-        Cell *cell = _physics.safe_cell_at(cx, cy);
+        const Cell *cell = view.safe_cell_at(cx, cy);
         if (!cell) {
             std::cout << "  out of range" << std::endl;
             continue;
         }
-        CellMetadata *meta = _physics.meta_at(cx, cy);
+        const CellMetadata *meta = view.meta_at(cx, cy);
 
         const double tc = (meta->blocked
                            ? meta->obj->info.temp_coefficient
@@ -248,33 +610,51 @@ void Level::debug_output(const double x, const double y)
         std::cout << "  p     = " << cell->air_pressure << std::endl;
         std::cout << "  U     = " << cell->heat_energy << std::endl;
         std::cout << "  T     = " << cell->heat_energy / tc << std::endl;
-        std::cout << "  f     = " << cell->fog << std::endl;
+        std::cout << "  f     = " << view.fog_at(cx, cy) << std::endl;
         std::cout << "  f[-x] = " << cell->flow[0] << std::endl;
         std::cout << "  f[-y] = " << cell->flow[1] << std::endl;
     }
 }
 
-void Level::get_fall_channel(
-    const CoordInt x,
-    const CoordInt y,
-    LevelCell *&aside,
-    LevelCell *&asidebelow)
+void Level::destroy_object(GameObject *obj)
 {
-    aside = &_cells[x+y*_width];
-    if (aside->here || aside->reserved_by)
-    {
-        aside = nullptr;
-        asidebelow = nullptr;
+    if (_current_band) {
+        // the cells are released now, like the serial update would; the
+        // pools (and destructors, which may cancel timers) are shared
+        if (obj->movement) {
+            cancel_movement(obj);
+        }
+        run_shared([this, obj]() {
+            destroy_object(obj);
+        });
         return;
+    }
+
+    if (obj->pool) {
+        obj->pool->destroy(obj);
     } else {
-        asidebelow = &_cells[x+(y+1)*_width];
+        delete obj;
     }
+}
 
-    if (asidebelow->here || asidebelow->reserved_by)
-    {
-        aside = nullptr;
-        asidebelow = nullptr;
+bool Level::finish_movement(GameObject *obj)
+{
+    // the handler may start a new movement or destroy the object, so the
+    // cells are released from a copy afterwards
+    const Movement movement = *obj->movement;
+    obj->movement = nullptr;
+    const bool result = obj->after_movement(&movement);
+    release_movement(movement);
+    return result;
+}
+
+LevelCell *Level::get_fall_channel(const CoordInt x, const CoordInt y)
+{
+    if (!is_cell_free(x, y) || !is_cell_free(x, y+1)) {
+        return nullptr;
     }
+
+    return &_cells[x+y*_width];
 }
 
 CoordPair Level::get_physics_coords(const double x, const double y)
@@ -285,9 +665,36 @@ CoordPair Level::get_physics_coords(const double x, const double y)
     return result;
 }
 
+void Level::insert_object(
+    GameObject *obj,
+    const CoordInt x,
+    const CoordInt y)
+{
+    LevelCell *const dest = &_cells[x+y*_width];
+    assert(!dest->here && !dest->reserved_by);
+
+    obj->x = x;
+    obj->y = y;
+    obj->cell = CoordPair{x, y};
+    obj->phy = get_physics_coords(x, y);
+    set_cell_here(dest, obj);
+}
+
+size_t Level::live_objects() const
+{
+    size_t result = 0;
+    for (auto &pool: _object_pools) {
+        if (pool) {
+            result += pool->live();
+        }
+    }
+    return result;
+}
+
 void Level::physics_to_gl_texture(bool thread_regions)
 {
-    _physics.to_gl_texture(0.0, 2.0, thread_regions);
+    // called between updates, when the workers of the objects are idle
+    _physics.to_gl_texture(0.0, 2.0, thread_regions, _object_workers);
 }
 
 void Level::place_object(
@@ -301,7 +708,7 @@ void Level::place_object(
     if (dest->reserved_by) {
         GameObject *obj = dest->reserved_by;
         const CoordPair oldpos = obj->phy;
-        obj->movement->skip();
+        skip_movement(obj);
         const CoordPair newpos = get_physics_coords(
             obj->x,
             obj->y);
@@ -309,6 +716,7 @@ void Level::place_object(
             oldpos.x, oldpos.y,
             newpos.x, newpos.y,
             obj->info.stamp);
+        obj->phy = newpos;
     }
     cleanup_cell(dest);
 
@@ -320,11 +728,24 @@ void Level::place_object(
         obj->phy.x, obj->phy.y,
         obj, 1.0);
 
-    dest->here = obj;
+    set_cell_here(dest, obj);
+}
+
+void Level::wake_neighbourhood(const CoordInt x, const CoordInt y)
+{
+    const CoordInt x0 = std::max(x-1, 0);
+    const CoordInt x1 = std::min(x+1, _width-1);
+    const CoordInt y0 = std::max(y-1, 0);
+    const CoordInt y1 = std::min(y+1, _height-1);
+    for (CoordInt cy = y0; cy <= y1; cy++) {
+        for (CoordInt cx = x0; cx <= x1; cx++) {
+            wake_cell(cx, cy);
+        }
+    }
 }
 
 void Level::place_player(
-    GameObject *player,
+    PlayerObject *player,
     const CoordInt x,
     const CoordInt y)
 {
@@ -336,39 +757,756 @@ void Level::place_player(
     _player = player;
 }
 
-void Level::update()
+void Level::reachable_cells(const CoordInt x, const CoordInt y,
+                            Bitboard &result) const
 {
-    _ticks += 1;
+    assert(result.width() == _width && result.height() == _height);
+
+    result.clear();
+    if (!is_cell_free(x, y)) {
+        return;
+    }
+
+    const CoordInt words = result.row_words();
+    std::vector<uint64_t> free(words * _height);
+    for (CoordInt cy = 0; cy < _height; cy++) {
+        const uint64_t *const occupied = _occupied.row(cy);
+        const uint64_t *const reserved = _reserved.row(cy);
+        for (CoordInt w = 0; w < words; w++) {
+            free[cy*words+w] = ~(occupied[w] | reserved[w])
+                & result.word_mask(w);
+        }
+    }
+
+    result.set(x, y);
+    fill_row(result.row(y), &free[y*words], words);
+
+    // alternate downward and upward sweeps until nothing changes; each
+    // sweep spreads the filled area vertically and then along the rows
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (CoordInt i = 0; i < 2*_height; i++) {
+            const CoordInt cy = (i < _height ? i : 2*_height - 1 - i);
+            uint64_t *const row = result.row(cy);
+            const uint64_t *const row_free = &free[cy*words];
+
+            bool row_changed = false;
+            for (CoordInt w = 0; w < words; w++) {
+                uint64_t seed = 0;
+                if (cy > 0) {
+                    seed |= result.row(cy-1)[w];
+                }
+                if (cy < _height - 1) {
+                    seed |= result.row(cy+1)[w];
+                }
+                seed &= row_free[w] & ~row[w];
+                if (seed) {
+                    row[w] |= seed;
+                    row_changed = true;
+                }
+            }
+
+            if (row_changed) {
+                fill_row(row, row_free, words);
+                changed = true;
+            }
+        }
+    }
+}
+
+void Level::release_movement(const Movement &movement)
+{
+    LevelCell *const from = get_cell(movement.start_x, movement.start_y);
+    switch (movement.kind) {
+    case MovementKind::STRAIGHT:
+    {
+        set_cell_reserved_by(from, nullptr);
+        break;
+    }
+    case MovementKind::ROLL:
+    {
+        set_cell_reserved_by(
+            get_cell(movement.start_x + movement.offset_x, movement.start_y),
+            nullptr);
+        if (!movement.cleared_from) {
+            set_cell_reserved_by(from, nullptr);
+        }
+        break;
+    }
+    }
+}
+
+size_t Level::pooled_objects() const
+{
+    size_t result = 0;
+    for (auto &pool: _object_pools) {
+        if (pool) {
+            result += pool->pooled();
+        }
+    }
+    return result;
+}
+
+void Level::seed(uint64_t seed)
+{
+    _seed = seed;
+    _rng.seed(seed, 0);
+    _physics_particles.rng().seed(seed, 1);
+}
+
+void Level::set_cell_here(LevelCell *cell, GameObject *obj)
+{
+    cell->here = obj;
+    const CoordPair coords = get_cell_coords(cell);
+    _occupied.assign(coords.x, coords.y, obj);
+    _occupied_columns.assign(coords.y, coords.x, obj);
+    wake_neighbourhood(coords.x, coords.y);
+}
 
+void Level::set_cell_reserved_by(LevelCell *cell, GameObject *obj)
+{
+    cell->reserved_by = obj;
+    const CoordPair coords = get_cell_coords(cell);
+    _reserved.assign(coords.x, coords.y, obj);
+    _reserved_columns.assign(coords.y, coords.x, obj);
+    wake_neighbourhood(coords.x, coords.y);
+}
+
+void Level::skip_movement(GameObject *obj)
+{
+    obj->x = obj->movement->start_x + obj->movement->offset_x;
+    obj->y = obj->movement->start_y + obj->movement->offset_y;
+    obj->invalidate_view();
+    cancel_movement(obj);
+}
+
+Movement *Level::start_movement(
+    MovementKind kind,
+    GameObject *obj,
+    const CoordInt offset_x,
+    const CoordInt offset_y)
+{
+    const CoordInt start_x = obj->x;
+    const CoordInt start_y = obj->y;
+
+    // yes, this comparision is evil, as obj->x is a double actually.
+    // However, in this case x should be close enough to a whole number, if
+    // not, something went utterly wrong.
+    assert(obj->x == start_x);
+    assert(obj->y == start_y);
+    assert(!obj->movement);
+
+    LevelCell *const from = get_cell(start_x, start_y);
+    LevelCell *const to = get_cell(start_x + offset_x, start_y + offset_y);
+
+    switch (kind) {
+    case MovementKind::STRAIGHT:
+    {
+        if (abs(offset_x) + abs(offset_y) == 0) {
+            throw ProgrammingError("Cannot move zero fields.");
+        } else if (abs(offset_x) + abs(offset_y) > 1) {
+            throw ProgrammingError(
+                "Cannot move diagonally or more than one field.");
+        }
+
+        assert(from->here == obj);
+        assert(!from->reserved_by);
+        assert(!to->here);
+
+        set_cell_reserved_by(from, obj);
+        set_cell_here(from, nullptr);
+        set_cell_here(to, obj);
+        break;
+    }
+    case MovementKind::ROLL:
+    {
+        if (abs(offset_x) != 1 || offset_y != 1) {
+            throw ProgrammingError(
+                "Cannot roll-move with offset_y != 1 or abs(offset_x != 1)");
+        }
+
+        LevelCell *const via = get_cell(start_x + offset_x, start_y);
+        assert(from->here == obj);
+        assert(!from->reserved_by);
+        assert(!to->here);
+        assert(!via->here);
+
+        set_cell_here(from, nullptr);
+        set_cell_reserved_by(from, obj);
+        set_cell_reserved_by(via, obj);
+        set_cell_here(to, obj);
+        break;
+    }
+    }
+
+    obj->cell = CoordPair{start_x + offset_x, start_y + offset_y};
+
+    Movement &movement = _movements[obj->cell.x + obj->cell.y*_width];
+    movement.obj = obj;
+    movement.start_x = start_x;
+    movement.start_y = start_y;
+    movement.offset_x = offset_x;
+    movement.offset_y = offset_y;
+    movement.time = 0;
+    movement.kind = kind;
+    movement.cleared_from = false;
+    obj->movement = &movement;
+    return &movement;
+}
+
+uint64_t Level::state_digest(bool include_physics) const
+{
+    uint64_t h = digest_mix(0, _ticks);
+    for (CoordInt y = 0; y < _height; y++) {
+        for (CoordInt x = 0; x < _width; x++) {
+            const LevelCell &cell = _cells[x+y*_width];
+            const GameObject *const obj = cell.here;
+            h = digest_mix(h, (obj ? 1 : 0) | (cell.reserved_by ? 2 : 0));
+            if (!obj) {
+                continue;
+            }
+            h = digest_mix(h, typeid(*obj).hash_code());
+            h = digest_double(h, obj->x);
+            h = digest_double(h, obj->y);
+            h = digest_double(h, obj->phi);
+            h = digest_mix(h, obj->movement ? 1 : 0);
+        }
+    }
+
+    if (include_physics) {
+        const PhysicsSnapshot view = _physics.snapshot();
+        const size_t count = size_t(view.width) * view.height;
+        for (size_t i = 0; i < count; i++) {
+            const Cell &cell = view.cells[i];
+            h = digest_double(h, cell.air_pressure);
+            h = digest_double(h, cell.heat_energy);
+            h = digest_double(h, cell.flow[0]);
+            h = digest_double(h, cell.flow[1]);
+            h = digest_mix(h, view.fog[i]);
+            h = digest_mix(h, view.metadata[i].blocked);
+        }
+    }
+
+    return h;
+}
+
+void Level::save_state(LevelState &state)
+{
     _physics.wait_for();
 
-    while (!_timers.empty() && _timers.top().trigger_at <= _ticks)
+    const CoordInt count = _width*_height;
+    state.width = _width;
+    state.height = _height;
+    state.ticks = _ticks;
+    state.seed = _seed;
+    state.rng = _rng;
+    state.particle_rng = _physics_particles.rng();
+
+    std::unordered_map<const GameObject*, uint32_t> indices;
+    indices.reserve(count);
+    auto index_of = [&indices](const GameObject *obj) -> uint32_t {
+        if (!obj) {
+            return LevelState::no_object;
+        }
+        auto iter = indices.find(obj);
+        return (iter != indices.end() ? (*iter).second : LevelState::no_object);
+    };
+
+    state.objects.clear();
+    state.object_data.clear();
+    StateWriter writer(state.object_data);
+    const ObjectInfo *last_info = nullptr;
+    uint32_t last_info_index = LevelState::no_info;
+    for (CoordInt i = 0; i < count; i++) {
+        const GameObject *const obj = _cells[i].here;
+        if (!obj) {
+            continue;
+        }
+        if (!obj->pool) {
+            throw ProgrammingError(
+                "Cannot save objects which have not been created with "
+                "create_object().");
+        }
+
+        if (&obj->info != last_info) {
+            last_info = &obj->info;
+            last_info_index = LevelState::no_info;
+            for (size_t j = 0; j < _object_infos.size(); j++) {
+                if (_object_infos[j].get() == last_info) {
+                    last_info_index = j;
+                    break;
+                }
+            }
+        }
+
+        ObjectState object;
+        object.type = obj->pool->type_index();
+        object.info = last_info_index;
+        object.cell = obj->cell;
+        object.phy = obj->phy;
+        object.x = obj->x;
+        object.y = obj->y;
+        object.phi = obj->phi;
+        object.ticks = obj->ticks;
+        object.frame_state = obj->frame_state;
+        object.moving = (obj->movement != nullptr);
+        if (obj->movement) {
+            object.movement = *obj->movement;
+            object.movement.obj = nullptr;
+        } else {
+            object.movement = Movement();
+        }
+        obj->save_state(writer);
+        object.data_end = state.object_data.size();
+
+        indices.emplace(obj, state.objects.size());
+        state.objects.push_back(object);
+    }
+    state.player = index_of(_player);
+
+    state.cells.resize(2*count);
+    for (CoordInt i = 0; i < count; i++) {
+        state.cells[2*i] = index_of(_cells[i].here);
+        state.cells[2*i+1] = index_of(_cells[i].reserved_by);
+    }
+
+    state.awake = _awake;
+    state.occupied = _occupied;
+    state.reserved = _reserved;
+    state.occupied_columns = _occupied_columns;
+    state.reserved_columns = _reserved_columns;
+
+    state.timers.assign(
+        _timers,
+        [&index_of](const LevelTimer &timer) {
+            return TimerState{timer.action, timer.x, timer.y,
+                              index_of(timer.obj)};
+        });
+    state.explosion_batches = _explosion_batches;
+    state.physics_impulses = _physics.pending_impulses();
+    state.physics_deposits.clear();
+    for (const auto &deposits: _physics.pending_deposits()) {
+        state.physics_deposits.insert(state.physics_deposits.end(),
+                                      deposits.begin(), deposits.end());
+    }
+
+    const PhysicsSnapshot view = _physics.snapshot();
+    const size_t physics_count = size_t(view.width) * view.height;
+    state.physics_epoch = view.epoch;
+    state.physics_cells.assign(view.cells, view.cells + physics_count);
+    state.physics_fog.assign(view.fog, view.fog + physics_count);
+    state.physics_metadata.resize(physics_count);
+    // neighbouring cells mostly belong to the same object
+    const GameObject *last_obj = nullptr;
+    uint32_t last_obj_index = LevelState::no_object;
+    for (size_t i = 0; i < physics_count; i++) {
+        const CellMetadata &meta = view.metadata[i];
+        if (meta.obj != last_obj) {
+            last_obj = meta.obj;
+            last_obj_index = index_of(meta.obj);
+        }
+        state.physics_metadata[i] = CellMetadataState{meta.blocked,
+                                                      last_obj_index};
+    }
+
+    _physics_particles.copy_active(state.particles);
+}
+
+void Level::restore_state(const LevelState &state)
+{
+    if (state.width != _width || state.height != _height) {
+        throw ProgrammingError("The saved state is of a different level.");
+    }
+
+    _physics.wait_for();
+
+    const CoordInt count = _width*_height;
+    for (CoordInt i = 0; i < count; i++) {
+        GameObject *const obj = _cells[i].here;
+        if (obj) {
+            obj->movement = nullptr;
+            destroy_object(obj);
+        }
+    }
+    // no record may keep pointing to a destroyed object; the movements of
+    // the state are written below
+    std::fill(_movements.begin(), _movements.end(), Movement());
+
+    std::vector<GameObject*> objects;
+    objects.reserve(state.objects.size());
+    uint32_t data_begin = 0;
+    for (const ObjectState &object: state.objects) {
+        ObjectPoolBase *const pool = _object_pools[object.type].get();
+        const ObjectInfo *const info = (object.info != LevelState::no_info
+                                        ? _object_infos[object.info].get()
+                                        : nullptr);
+        GameObject *const obj = pool->recreate(this, info);
+        obj->cell = object.cell;
+        obj->phy = object.phy;
+        obj->x = object.x;
+        obj->y = object.y;
+        obj->phi = object.phi;
+        obj->ticks = object.ticks;
+        obj->frame_state = object.frame_state;
+        if (object.moving) {
+            Movement &movement = _movements[object.cell.x
+                                            + object.cell.y*_width];
+            movement = object.movement;
+            movement.obj = obj;
+            obj->movement = &movement;
+        }
+
+        StateReader reader(state.object_data.data() + data_begin,
+                           state.object_data.data() + object.data_end);
+        obj->restore_state(reader);
+        data_begin = object.data_end;
+
+        objects.push_back(obj);
+    }
+
+    auto object_at = [&objects](uint32_t index) -> GameObject* {
+        return (index != LevelState::no_object ? objects[index] : nullptr);
+    };
+
+    for (CoordInt i = 0; i < count; i++) {
+        _cells[i].here = object_at(state.cells[2*i]);
+        _cells[i].reserved_by = object_at(state.cells[2*i+1]);
+    }
+    _player = static_cast<PlayerObject*>(object_at(state.player));
+
+    _awake = state.awake;
+    _occupied = state.occupied;
+    _reserved = state.reserved;
+    _occupied_columns = state.occupied_columns;
+    _reserved_columns = state.reserved_columns;
+
+    _timers.assign(
+        state.timers,
+        [&object_at](const TimerState &timer) {
+            return LevelTimer{timer.action, timer.x, timer.y,
+                              object_at(timer.obj)};
+        });
+    _explosion_batches = state.explosion_batches;
+
+    _physics.restore(state.physics_epoch,
+                     state.physics_cells.data(),
+                     state.physics_fog.data());
+    for (const PhysicsImpulse &impulse: state.physics_impulses) {
+        _physics.push_impulse(impulse);
+    }
+    // the workers apply the buffers in order, so a single one reproduces
+    // the order of the deposits
+    _physics.deposits().assign(state.physics_deposits.begin(),
+                               state.physics_deposits.end());
+    CellMetadata *const metadata = _physics.meta_at(0, 0);
+    for (size_t i = 0; i < state.physics_metadata.size(); i++) {
+        const CellMetadataState &meta = state.physics_metadata[i];
+        metadata[i].blocked = meta.blocked;
+        metadata[i].obj = object_at(meta.obj);
+    }
+    _physics.invalidate_collision(0, 0,
+                                  _width*subdivision_count - 1,
+                                  _height*subdivision_count - 1);
+
+    _physics_particles.assign_active(state.particles);
+    _physics_particles.rng() = state.particle_rng;
+
+    _ticks = state.ticks;
+    _seed = state.seed;
+    _rng = state.rng;
+}
+
+void Level::run_shared(std::function<void()> effect)
+{
+    if (_current_band) {
+        _current_band->effects.push_back(
+            SharedEffect{_current_band->order, std::move(effect)});
+    } else {
+        effect();
+    }
+}
+
+void Level::wait_for_band(const ObjectBand &band, const CoordInt y)
+{
+    while (__atomic_load_n(&band.progress, __ATOMIC_ACQUIRE) > y) {
+        std::this_thread::yield();
+    }
+}
+
+void Level::update_band_cells(ObjectBand &band,
+                              const CoordInt x0,
+                              const CoordInt x1,
+                              const CoordInt y)
+{
+    const CoordInt word0 = x0 >> 6;
+    const CoordInt word1 = (x1 - 1) >> 6;
+    const uint64_t first_mask = ~uint64_t(0) << (x0 & 63);
+    const uint64_t last_mask = ~uint64_t(0) >> (63 - ((x1 - 1) & 63));
+
+    uint64_t *const row = &_awake[y*_awake_row_words];
+    for (CoordInt word = word0; word <= word1; word++)
     {
-        const Timer &timer = _timers.top();
-        LevelCell *const cell = (timer.x >= 0 && timer.y >= 0)
-            ? get_cell(timer.x, timer.y)
-            : nullptr;
+        uint64_t mask = ~uint64_t(0);
+        if (word == word0) {
+            mask &= first_mask;
+        }
+        if (word == word1) {
+            mask &= last_mask;
+        }
+
+        while (true) {
+            const uint64_t pending =
+                __atomic_load_n(&row[word], __ATOMIC_RELAXED) & mask;
+            if (!pending) {
+                break;
+            }
+            const unsigned int bit = __builtin_ctzll(pending);
+            // like in update_objects(), continue to the right of the
+            // cell, whatever happens to it
+            mask &= ~((uint64_t(2) << bit) - 1);
+            __atomic_fetch_and(&row[word], ~(uint64_t(1) << bit),
+                               __ATOMIC_RELAXED);
+
+            const CoordInt x = word*64 + bit;
+            LevelCell *const cell = get_cell(x, y);
+            GameObject *const obj = cell->here;
+            if (obj) {
+                band.order = size_t(_height - 1 - y) * _width + x;
+                obj->update();
+                if (cell->here == obj && obj->is_awake()) {
+                    wake_cell(x, y);
+                }
+            }
+        }
+    }
+}
+
+void Level::update_band(ObjectBand &band,
+                        const ObjectBand *left,
+                        const ObjectBand *right)
+{
+    // Updates less than 2*object_reach cells apart may touch the same
+    // cells, so near the borders, the serial order is kept by waiting for
+    // the neighbours: everything left of the band in the row comes first,
+    // everything right of it in the row below.
+    const CoordInt zone = 2*object_reach;
+
+    _current_band = &band;
+    try {
+        for (CoordInt y = _height - 1; y >= 0; y--)
+        {
+            if (left) {
+                wait_for_band(*left, y);
+            }
+            update_band_cells(band, band.x0, band.x1 - zone, y);
+            if (right) {
+                wait_for_band(*right, y + 1);
+            }
+            update_band_cells(band, band.x1 - zone, band.x1, y);
+            __atomic_store_n(&band.progress, y, __ATOMIC_RELEASE);
+        }
+    } catch (...) {
+        band.error = std::current_exception();
+        // release the neighbours; the result is thrown away anyways
+        __atomic_store_n(&band.progress, CoordInt(-1), __ATOMIC_RELEASE);
+    }
+    _current_band = nullptr;
+}
+
+void Level::apply_shared_effects()
+{
+    // the effects of each band are in serial order already, so they only
+    // need to be merged
+    for (ObjectBand &band: _object_bands) {
+        band.next_effect = 0;
+    }
+
+    while (true) {
+        ObjectBand *next = nullptr;
+        for (ObjectBand &band: _object_bands) {
+            if (band.next_effect < band.effects.size() &&
+                    (!next || band.effects[band.next_effect].order
+                                < next->effects[next->next_effect].order))
+            {
+                next = &band;
+            }
+        }
+        if (!next) {
+            break;
+        }
+        next->effects[next->next_effect++].apply();
+    }
 
-        timer.func(*this, cell);
-        _timers.pop();
+    for (ObjectBand &band: _object_bands) {
+        band.effects.clear();
     }
+}
 
+void Level::update_objects()
+{
+    // Same order as a full scan (bottom-up, left to right), but only
+    // cells with the awake bit set are visited. The word is re-read after
+    // each update, as updates may wake cells further right in the row.
     for (CoordInt y = _height-1; y >= 0; y--)
     {
-        LevelCell *cell = get_cell(0, y);
-        for (CoordInt x = 0; x < _width; x++)
+        uint64_t *const row = &_awake[y*_awake_row_words];
+        for (CoordInt word = 0; word < _awake_row_words; word++)
         {
-            GameObject *obj = cell->here;
-            if (!obj) {
-                ++cell;
-                continue;
+            unsigned int bit = 0;
+            while (true) {
+                const uint64_t pending = row[word] & (~uint64_t(0) << bit);
+                if (!pending) {
+                    break;
+                }
+                bit = __builtin_ctzll(pending);
+                row[word] &= ~(uint64_t(1) << bit);
+
+                const CoordInt x = word*64 + bit;
+                LevelCell *const cell = get_cell(x, y);
+                GameObject *const obj = cell->here;
+                if (obj) {
+                    obj->update();
+                    // the object may have moved away or destructed itself
+                    if (cell->here == obj && obj->is_awake()) {
+                        wake_cell(x, y);
+                    }
+                }
+
+                if (bit == 63) {
+                    break;
+                }
+                bit++;
             }
-            obj->update();
-            ++cell;
         }
     }
+}
 
-    _physics_particles.update(0.01);
+void Level::update_objects_parallel()
+{
+    // all bands have to run at once, as they wait for each other
+    const CoordInt bands = std::min(
+        CoordInt(_object_workers->thread_count()),
+        _width / object_band_width);
+    if (bands < 2) {
+        update_objects();
+        return;
+    }
+
+    if (_object_bands.size() != size_t(bands)) {
+        _object_bands.resize(bands);
+        for (CoordInt index = 0; index < bands; index++) {
+            _object_bands[index].x0 = index * _width / bands;
+            _object_bands[index].x1 = (index + 1) * _width / bands;
+        }
+    }
+    for (ObjectBand &band: _object_bands) {
+        band.progress = _height;
+        band.effects.clear();
+        band.error = nullptr;
+    }
+
+    _object_workers->parallel_for(
+        bands,
+        [this](size_t index, unsigned int) {
+            update_band(
+                _object_bands[index],
+                (index > 0 ? &_object_bands[index-1] : nullptr),
+                (index + 1 < _object_bands.size()
+                 ? &_object_bands[index+1] : nullptr));
+        });
+
+    for (ObjectBand &band: _object_bands) {
+        if (band.error) {
+            std::rethrow_exception(band.error);
+        }
+    }
+
+    apply_shared_effects();
+}
+
+void Level::handle_input()
+{
+    if (!_player) {
+        return;
+    }
+
+    const TickCounter tick = _ticks - _input_start;
+    if (_input_replay) {
+        const std::vector<InputRecording::Event> &events =
+            _input_replay->events();
+        while (_input_replay_pos < events.size()
+               && events[_input_replay_pos].tick <= tick)
+        {
+            events[_input_replay_pos].input.apply(*_player);
+            _input_replay_pos += 1;
+        }
+    } else if (_input_recording) {
+        _input_recording->record(tick, PlayerInput::capture(*_player));
+    }
+}
+
+void Level::record_input(InputRecording *recording)
+{
+    _input_recording = recording;
+    _input_start = _ticks;
+    if (recording) {
+        recording->start(_seed,
+                         _player ? _player->x : -1,
+                         _player ? _player->y : -1);
+    }
+}
+
+void Level::finish_input_recording()
+{
+    if (!_input_recording) {
+        return;
+    }
+    _physics.wait_for();
+    _input_recording->finish(_ticks - _input_start, state_digest());
+    _input_recording = nullptr;
+}
+
+void Level::replay_input(const InputRecording *recording)
+{
+    _input_replay = recording;
+    _input_replay_pos = 0;
+    _input_start = _ticks;
+    if (recording) {
+        seed(recording->seed());
+        if (_player) {
+            PlayerInput().apply(*_player);
+        }
+    }
+}
+
+void Level::update()
+{
+    _ticks += 1;
+
+    _physics.wait_for();
+
+    if (_physics_recorder) {
+        _physics_recorder->capture(_physics.snapshot());
+    }
+
+    _timers.advance(
+        _ticks,
+        [this](const LevelTimer &timer) {
+            fire_timer(timer);
+        });
+
+    handle_input();
+
+    if (_object_workers) {
+        update_objects_parallel();
+    } else {
+        update_objects();
+    }
 
     _physics.resume();
+
+    // particles only read the snapshot and hand their heat and fog to the
+    // automaton through its deposits, so they run alongside the step
+    _physics_particles.update(0.01);
 }
@@ -25,7 +25,8 @@ authors named in the AUTHORS file.
 #ifndef _ML_LEVEL_H
 #define _ML_LEVEL_H
 
-#include <queue>
+#include <exception>
+#include <functional>
 #include <vector>
 
 #include <sigc++/sigc++.h>
@@ -33,39 +34,56 @@ authors named in the AUTHORS file.
 #include <CEngine/IO/Stream.hpp>
 
 #include "Types.hpp"
+#include "Bitboard.hpp"
 #include "GameObject.hpp"
+#include "ObjectPool.hpp"
 #include "Physics.hpp"
 #include "Particles.hpp"
+#include "Random.hpp"
+#include "TimerWheel.hpp"
 
 struct Cell;
+class InputRecording;
 class Level;
+struct LevelState;
+class PhysicsRecorder;
+struct PlayerObject;
+class WorkerPool;
 
 struct LevelCell {
     GameObject *here, *reserved_by;
 };
 
-typedef std::function<void(Level&, LevelCell*)> TimerFunc;
-
-struct Timer {
-    Timer(const TickCounter trigger_at,
-          const CoordInt cellx,
-          const CoordInt celly,
-          TimerFunc func);
-    Timer(const Timer &ref) = delete;
-    Timer &operator=(const Timer &ref) = delete;
-    Timer(Timer &&ref);
-    Timer &operator=(Timer &&ref);
-    ~Timer();
+enum class TimerAction {
+    /* trigger the explosion batch with the index x, see ExplosionBatch */
+    EXPLOSION_BATCH,
+    /* remove the object from the cell, if it is still there */
+    DESTRUCT_OBJECT
+};
 
-    TickCounter trigger_at;
+struct LevelTimer {
+    TimerAction action;
     CoordInt x, y;
-    TimerFunc func;
+    GameObject *obj;
+};
+
+/**
+ * The cells which explode in the same tick. All explosions added in one
+ * tick go into the same batch, so overlapping explosions are merged and
+ * each batch is triggered by a single timer.
+ */
+struct ExplosionBatch {
+    ExplosionBatch(CoordInt width, CoordInt height);
 
-    inline bool operator<(const Timer &other) const
+    Bitboard cells;
+
+    /* bounding box of the set cells; x0 > x1 if the batch is empty */
+    CoordInt x0, y0, x1, y1;
+
+    inline bool empty() const
     {
-        return trigger_at > other.trigger_at;
+        return x0 > x1;
     }
-
 };
 
 typedef sigc::signal<void, Level*, GameObject*> PlayerDeathEvent;
@@ -74,6 +92,46 @@ class Level {
 public:
     static constexpr double time_slice = 0.01;
 
+    /* minimum width of the column bands used by the parallel object
+     * update */
+    static constexpr CoordInt object_band_width = 16;
+
+    /* distance (in cells, along each axis) up to which the update of an
+     * object may read or change other cells: the player pushes a chain of
+     * up to two objects, which wakes the cell behind it */
+    static constexpr CoordInt object_reach = 3;
+
+    static_assert(object_band_width >= 4*object_reach,
+                  "object bands must hold both of their border zones");
+
+private:
+    /* A change of state shared by all bands, made by the update with the
+     * given serial order (see ObjectBand::order). */
+    struct SharedEffect {
+        size_t order;
+        std::function<void()> apply;
+    };
+
+    /* A column band of the parallel object update, see update_band(). */
+    struct ObjectBand {
+        CoordInt x0, x1;
+
+        /* rows [progress, height) are done; -1 if the band failed */
+        CoordInt progress;
+
+        /* position of the current update in the serial order */
+        size_t order;
+
+        std::vector<SharedEffect> effects;
+        /* see apply_shared_effects() */
+        size_t next_effect;
+
+        std::exception_ptr error;
+    };
+
+    /* the band the calling thread is updating, if any */
+    static thread_local ObjectBand *_current_band;
+
 public:
     Level(CoordInt width, CoordInt height, bool mp = true);
     ~Level();
@@ -84,29 +142,200 @@ private:
     Automaton _physics;
     std::vector<GameObject*> _objects;
 
-    GameObject *_player;
+    /* indexed by object_pool_index() of the object type */
+    std::vector<std::unique_ptr<ObjectPoolBase>> _object_pools;
+
+    /* infos of objects which are not backed by a static ObjectInfo, see
+     * adopt_object_info() */
+    std::vector<std::unique_ptr<ObjectInfo>> _object_infos;
+
+    PlayerObject *_player;
     PlayerDeathEvent _on_player_death;
 
     ParticleSystem _physics_particles;
 
+    uint64_t _seed;
+    PCG32 _rng;
+
     TickCounter _ticks;
-    std::priority_queue<Timer> _timers;
+    TimerWheel<LevelTimer> _timers;
+
+    /* indexed by the trigger tick modulo the size, which exceeds
+     * EXPLOSION_TRIGGER_TIMEOUT so that a batch may add to the next one
+     * while it is being triggered */
+    std::vector<ExplosionBatch> _explosion_batches;
+
+    /* One bit per cell, set if the object in the cell needs to be updated
+     * in the next tick. Each row starts at a new word. */
+    CoordInt _awake_row_words;
+    std::vector<uint64_t> _awake;
+
+    /* Cells with an object (LevelCell::here set) and cells reserved by a
+     * moving object, both row-major and column-major (addressed as
+     * (y, x)). These are maintained by set_cell_here() and
+     * set_cell_reserved_by(). */
+    Bitboard _occupied, _reserved;
+    Bitboard _occupied_columns, _reserved_columns;
+
+    /* indexed by the destination cell of the movement, see Movement */
+    std::vector<Movement> _movements;
+
+    WorkerPool *_object_workers;
+    std::vector<ObjectBand> _object_bands;
+
+    PhysicsRecorder *_physics_recorder;
+
+    /* see record_input() and replay_input(); ticks of the recordings are
+     * counted from _input_start */
+    InputRecording *_input_recording;
+    const InputRecording *_input_replay;
+    size_t _input_replay_pos;
+    TickCounter _input_start;
 
 private:
     void init_cells();
 
+    inline void wake_cell(const CoordInt x, const CoordInt y)
+    {
+        // atomic, as neighbouring bands may share words
+        __atomic_fetch_or(&_awake[y*_awake_row_words + (x >> 6)],
+                          uint64_t(1) << (x & 63),
+                          __ATOMIC_RELAXED);
+    }
+
+    void fire_timer(const LevelTimer &timer);
+    void fire_explosion_batch(ExplosionBatch &batch);
+    void spawn_explosion_particles(const CoordInt x, const CoordInt y);
+    void handle_input();
+    bool finish_movement(GameObject *obj);
+    void release_movement(const Movement &movement);
+    void add_explosion_cells(const std::vector<CoordPair> &cells);
+    void wait_for_band(const ObjectBand &band, const CoordInt y);
+    void update_band_cells(ObjectBand &band, const CoordInt x0,
+                           const CoordInt x1, const CoordInt y);
+    void update_band(ObjectBand &band, const ObjectBand *left,
+                     const ObjectBand *right);
+    void apply_shared_effects();
+    void update_objects();
+    void update_objects_parallel();
+
 public:
+    /**
+     * Take ownership of *info* and return a reference to it which stays
+     * valid for the lifetime of the level. This is used for objects whose
+     * properties are loaded at runtime, such as TileObject.
+     */
+    const ObjectInfo &adopt_object_info(std::unique_ptr<ObjectInfo> info);
+
     void add_explosion(const CoordInt x,
                        const CoordInt y);
 
+    /**
+     * Let the cells in [x0, x1] x [y0, y1] (clipped to the level) explode
+     * after EXPLOSION_TRIGGER_TIMEOUT ticks. Cells holding an
+     * indestructible object are skipped.
+     *
+     * The cells are added to the explosion batch of the trigger tick;
+     * cells which are already part of it are not added again. When the
+     * batch is triggered, the objects in its cells are touched, free
+     * cells are filled with ExplosionObjects and impulses of heat and
+     * pressure are queued for the automaton.
+     */
+    void add_explosion_region(
+        CoordInt x0, CoordInt y0,
+        CoordInt x1, CoordInt y1);
+
+    /**
+     * Queue an impulse for the physics cells of the level cells in
+     * [x0, x1] x [y0, y1]; see Automaton::push_impulse().
+     */
+    void add_impulse(
+        const CoordInt x0,
+        const CoordInt y0,
+        const CoordInt x1,
+        const CoordInt y1,
+        const double pressure,
+        const double temperature,
+        const FogDensity fog = 0);
+
     void add_large_explosion(
         const CoordInt x0,
         const CoordInt y0,
         const CoordInt xradius,
         const CoordInt yradius);
 
+    /**
+     * Schedule *action* on the cell (x, y) at tick *trigger_at*. The
+     * returned handle may be passed to cancel_timer() until the timer
+     * fires.
+     */
+    TimerHandle add_timer(
+        const TickCounter trigger_at,
+        const TimerAction action,
+        const CoordInt x,
+        const CoordInt y,
+        GameObject *obj = nullptr);
+
+    void cancel_timer(const TimerHandle &handle);
+
     void cleanup_cell(LevelCell *cell);
 
+    /**
+     * Return a pseudo-random boolean which depends only on the current
+     * tick and the given cell, so that the outcome does not depend on the
+     * order in which objects are updated.
+     */
+    inline bool coin_flip(const CoordInt x, const CoordInt y) const
+    {
+        uint64_t h = (uint64_t(_ticks) * UINT64_C(0x9e3779b97f4a7c15))
+            ^ (uint64_t(uint32_t(x)) << 32 | uint32_t(y));
+        h ^= h >> 33;
+        h *= UINT64_C(0xff51afd7ed558ccd);
+        h ^= h >> 33;
+        h *= UINT64_C(0xc4ceb9fe1a85ec53);
+        h ^= h >> 33;
+        return h & 1;
+    }
+
+    /**
+     * Return a mask of the cells of column *x* in the rows
+     * [64*word, 64*word+64) which hold an object and have a free cell
+     * below them, i.e. which could fall straight down if the object is
+     * affected by gravity. Bit i corresponds to row 64*word+i.
+     */
+    uint64_t column_fall_mask(const CoordInt x, const CoordInt word) const;
+
+    /**
+     * Create an object of type *_Object* in the pool of that type. The
+     * level is passed as the first constructor argument, followed by
+     * *args*.
+     *
+     * Objects created this way live until they are destroyed with
+     * destroy_object() (e.g. through cleanup_cell()) or until the level is
+     * destructed.
+     */
+    template <typename _Object, typename... _Args>
+    inline _Object *create_object(_Args&&... args)
+    {
+        if (in_object_band()) {
+            throw ProgrammingError(
+                "Cannot create objects from the parallel object update; "
+                "use run_shared().");
+        }
+        return object_pool<_Object>().create(
+            this, std::forward<_Args>(args)...);
+    }
+
+    /**
+     * Destruct an object, returning it to its pool if it has been created
+     * with create_object().
+     *
+     * Within a band of the parallel object update, the movement of the
+     * object is cancelled right away, but the object is only destructed
+     * once all bands are done, see run_shared().
+     */
+    void destroy_object(GameObject *obj);
+
     void debug_test_stamp(const double x, const double y);
 
     void debug_output(const double x, const double y);
@@ -117,11 +346,17 @@ public:
         return &_cells[x+y*_width];
     }
 
-    void get_fall_channel(
-        const CoordInt x,
-        const CoordInt y,
-        LevelCell *&aside,
-        LevelCell *&asidebelow);
+    inline CoordPair get_cell_coords(const LevelCell *cell) const
+    {
+        const CoordInt index = cell - _cells;
+        return CoordPair{index % _width, index / _width};
+    }
+
+    /**
+     * Return the cell at *x*, *y* if an object can roll into it, i.e. if
+     * it and the cell below are free, and nullptr otherwise.
+     */
+    LevelCell *get_fall_channel(const CoordInt x, const CoordInt y);
 
     inline CoordInt get_height() const
     {
@@ -140,30 +375,336 @@ public:
         return _width;
     }
 
+    /**
+     * Return true if the cell neither holds an object nor is reserved by a
+     * moving object.
+     */
+    inline bool is_cell_free(const CoordInt x, const CoordInt y) const
+    {
+        return !_occupied.test(x, y) && !_reserved.test(x, y);
+    }
+
+    inline bool is_cell_reserved(const CoordInt x, const CoordInt y) const
+    {
+        return _reserved.test(x, y);
+    }
+
+    /**
+     * Number of objects created with create_object() which are still
+     * alive.
+     */
+    size_t live_objects() const;
+
+    /**
+     * Number of cells whose object will be updated in the next tick.
+     */
+    size_t awake_objects() const;
+
+    /**
+     * Number of timers which have not fired yet.
+     */
+    inline size_t pending_timers() const
+    {
+        return _timers.pending();
+    }
+
+    inline const Bitboard &occupied_cells() const
+    {
+        return _occupied;
+    }
+
+    inline const Bitboard &occupied_columns() const
+    {
+        return _occupied_columns;
+    }
+
+    /**
+     * Return the pool for objects of type *_Object*, creating it on first
+     * use.
+     */
+    template <typename _Object>
+    ObjectPool<_Object> &object_pool()
+    {
+        const unsigned int index = object_pool_index<_Object>();
+        if (index >= _object_pools.size()) {
+            _object_pools.resize(index+1);
+        }
+        std::unique_ptr<ObjectPoolBase> &pool = _object_pools[index];
+        if (!pool) {
+            pool = std::unique_ptr<ObjectPoolBase>(new ObjectPool<_Object>());
+        }
+        return static_cast<ObjectPool<_Object>&>(*pool);
+    }
+
     inline ParticleSystem &particles()
     {
         return _physics_particles;
     }
 
+    /**
+     * The random number engine for game logic, e.g. for spawning
+     * particles. It must only be used from the thread updating the level;
+     * the parallel object update has to go through run_shared().
+     */
+    inline PCG32 &rng()
+    {
+        if (in_object_band()) {
+            throw ProgrammingError(
+                "Cannot use the engine of the level from the parallel "
+                "object update; use run_shared().");
+        }
+        return _rng;
+    }
+
+    /**
+     * Return true if called from an object update running in a band of
+     * the parallel object update (see set_parallel_objects()).
+     *
+     * Such updates must not use the timers, the engine of the level, the
+     * particles or create objects directly; that has to go through
+     * run_shared(). Impulses, explosions, destructed objects and the death
+     * of the player are deferred automatically.
+     */
+    static inline bool in_object_band()
+    {
+        return _current_band != nullptr;
+    }
+
+    /**
+     * Call *effect*, which changes state shared by all objects of the
+     * level (such as the engine, the particles or the timers).
+     *
+     * Outside of the parallel object update, it is called right away.
+     * Within a band, it is deferred until all bands are done; the deferred
+     * effects of all bands are then called in the order of the updates
+     * which made them in the serial update, so the result is the same.
+     */
+    void run_shared(std::function<void()> effect);
+
     inline Automaton &physics()
     {
         return _physics;
     }
 
+    /**
+     * Upload the physics state into the bound texture, see
+     * Automaton::to_gl_texture(). The conversion uses the pool passed to
+     * set_parallel_objects(), if any.
+     */
     void physics_to_gl_texture(bool thread_regions);
 
+    /**
+     * Put *obj* into the empty cell (x, y) without touching the physics
+     * simulation. This is used to populate a level in bulk; the stamps of
+     * the objects have to be written to the automaton separately (see
+     * Automaton::init_cells()). Use place_object() otherwise.
+     */
+    void insert_object(
+        GameObject *obj,
+        const CoordInt x,
+        const CoordInt y);
+
     void place_object(
         GameObject *obj,
         const CoordInt x,
         const CoordInt y);
 
     void place_player(
-        GameObject *player,
+        PlayerObject *player,
         const CoordInt x,
         const CoordInt y);
 
+    /**
+     * Number of allocated object slots which are currently unused.
+     */
+    size_t pooled_objects() const;
+
+    /**
+     * Compute the free cells (see is_cell_free()) which can be reached
+     * from (x, y) through horizontally or vertically adjacent free cells.
+     * *result* must have the size of the level. If (x, y) itself is not
+     * free, the result is empty.
+     */
+    void reachable_cells(const CoordInt x, const CoordInt y,
+                         Bitboard &result) const;
+
+    inline const Bitboard &reserved_cells() const
+    {
+        return _reserved;
+    }
+
+    inline const Bitboard &reserved_columns() const
+    {
+        return _reserved_columns;
+    }
+
+    /**
+     * Set the object occupying *cell*. This must be used instead of
+     * writing LevelCell::here directly, as it wakes up the objects around
+     * the cell.
+     */
+    void set_cell_here(LevelCell *cell, GameObject *obj);
+
+    /**
+     * Set the object which reserves *cell*. Like set_cell_here(), this
+     * wakes up the objects around the cell.
+     */
+    void set_cell_reserved_by(LevelCell *cell, GameObject *obj);
+
+    /**
+     * Start moving *obj* by the given offset and set its movement member.
+     * The cells involved are occupied and reserved right away (see
+     * Movement for which cells are involved).
+     *
+     * @throws ProgrammingError if the offset is not valid for *kind*.
+     */
+    Movement *start_movement(MovementKind kind,
+                             GameObject *obj,
+                             const CoordInt offset_x,
+                             const CoordInt offset_y);
+
+    /**
+     * Advance the movement of *obj* by one tick. Return either true if the
+     * movement is still in progress, or the result of the after_movement
+     * handler from the object if the movement is finished.
+     */
+    bool advance_movement(GameObject *obj);
+
+    /**
+     * Move *obj* to the destination of its movement right away and end the
+     * movement without calling after_movement.
+     */
+    void skip_movement(GameObject *obj);
+
+    /**
+     * End the movement of *obj* where it is, releasing the reserved cells.
+     * This is used when a moving object is destroyed.
+     */
+    void cancel_movement(GameObject *obj);
+
+    /**
+     * Update the objects on the given pool, or serially if *pool* is
+     * nullptr (the default).
+     *
+     * The parallel update splits the level into one column band per
+     * thread (each at least object_band_width wide), which are updated
+     * concurrently, row by row like the serial loop. Objects within
+     * 2*object_reach columns of a band border may interact with objects
+     * of the neighbouring band, so a band only updates them in a row once
+     * the band to its left is done with that row and the band to its right
+     * with the row below. Together with run_shared(), this makes the
+     * result equal to that of the serial update, whatever the pool; ml-sim
+     * --check-objects verifies that tick by tick.
+     *
+     * All bands must run at once, so levels narrower than two bands and
+     * pools with a single thread are updated serially. The pool is not
+     * owned by the level.
+     */
+    inline void set_parallel_objects(WorkerPool *pool)
+    {
+        _object_workers = pool;
+    }
+
+    /**
+     * Update the particles on the workers of *pool*, or serially if it is
+     * nullptr. Unlike the parallel object update, this does not change the
+     * result of a simulation; see ParticleSystem. The pool is not owned by
+     * the level.
+     */
+    inline void set_parallel_particles(WorkerPool *pool)
+    {
+        _physics_particles.set_workers(pool);
+    }
+
+    /**
+     * Set the recorder which is fed with each completed physics step, or
+     * nullptr to stop recording. The recorder is not owned by the level
+     * and must outlive it or be unset before destruction.
+     */
+    inline void set_physics_recorder(PhysicsRecorder *recorder)
+    {
+        _physics_recorder = recorder;
+    }
+
+    /**
+     * Return a hash of the state of the level: the cells, the objects in
+     * them and, if *include_physics* is true, the physics simulation. Two
+     * simulations which were fed the same input must have the same digest
+     * in each tick.
+     *
+     * The type of objects enters the hash through typeid, so digests are
+     * only comparable within the same build.
+     */
+    uint64_t state_digest(bool include_physics = true) const;
+
+    /**
+     * Save everything which changes while the level runs into *state*
+     * (see LevelState). The physics are waited for.
+     *
+     * Only objects created with create_object() can be saved.
+     */
+    void save_state(LevelState &state);
+
+    /**
+     * Return the level to a state saved with save_state(). All objects are
+     * destroyed and created anew, so pointers to objects of the level,
+     * including player(), are invalid afterwards. Input recordings and
+     * replays are not rewound.
+     */
+    void restore_state(const LevelState &state);
+
+    /**
+     * Seed the random number engines of the level and its particle system.
+     * Two levels with the same seed, contents and input evolve the same
+     * way.
+     */
+    void seed(uint64_t seed);
+
+    inline uint64_t get_seed() const
+    {
+        return _seed;
+    }
+
+    inline PlayerObject *player() const
+    {
+        return _player;
+    }
+
+    /**
+     * Start recording the input of the player into *recording*, beginning
+     * with the next tick, or stop recording if *recording* is nullptr.
+     * The recording is not owned by the level.
+     *
+     * To be reproducible, a recording has to start before the first
+     * update of the level, as it does not capture the state of the level.
+     */
+    void record_input(InputRecording *recording);
+
+    /**
+     * Stop recording and store the length and the final state digest in
+     * the recording. The physics are waited for to take the digest.
+     */
+    void finish_input_recording();
+
+    /**
+     * Seed the level with the seed of *recording* and drive the player
+     * with the recorded input, beginning with the next tick. After the end
+     * of the recording, the last input stays in effect. Pass nullptr to
+     * stop replaying. The recording is not owned by the level.
+     *
+     * The player has to be placed before, at the position stored in the
+     * recording.
+     */
+    void replay_input(const InputRecording *recording);
+
     void update();
 
+    /**
+     * Make sure that the objects in the 3x3 neighbourhood of the given
+     * cell are updated in the next tick.
+     */
+    void wake_neighbourhood(const CoordInt x, const CoordInt y);
+
 public:
     inline PlayerDeathEvent &on_player_death()
     {
@@ -0,0 +1,112 @@
+#include "LevelLoader.hpp"
+
+#include <unordered_map>
+
+#include "TileObject.hpp"
+
+/**
+ * Blend an initial physics layer value over the background value.
+ */
+static inline double layer_value(const PhysicsInitialLayerValue &layer,
+                                 const double background)
+{
+    if (layer.alpha <= 0) {
+        return background;
+    } else if (layer.alpha >= 1) {
+        return layer.value;
+    }
+    return background + (layer.value - background) * layer.alpha;
+}
+
+std::unique_ptr<Level> instantiate_level(const LevelData &data, bool mp)
+{
+    std::unique_ptr<Level> level(new Level(level_width, level_height, mp));
+
+    const LevelData::TileLayerData &layer =
+        data.get_tile_layer(TILELAYER_DEFAULT);
+
+    size_t object_count = 0;
+    for (const LevelData::TileBinding &binding: layer) {
+        if (binding.second) {
+            object_count++;
+        }
+    }
+    level->object_pool<TileObject>().reserve(object_count);
+
+    // tiles are shared between the cells, so each distinct tile only gets
+    // one ObjectInfo
+    std::unordered_map<const TileData*, const ObjectInfo*> infos;
+
+    for (CoordInt y = 0; y < level_height; y++) {
+        for (CoordInt x = 0; x < level_width; x++) {
+            const TileData *const tile = layer[x+y*level_width].second.get();
+            if (!tile) {
+                continue;
+            }
+
+            const ObjectInfo *&info = infos[tile];
+            if (!info) {
+                info = &level->adopt_object_info(
+                    std::unique_ptr<ObjectInfo>(new ObjectInfo(*tile)));
+            }
+
+            level->insert_object(
+                level->create_object<TileObject>(*info),
+                x, y);
+        }
+    }
+
+    // write the initial physics and the object stamps in one pass instead
+    // of placing each stamp, which would redistribute the air displaced
+    // by each object to its neighbours
+    const PhysicsInitialValue &background =
+        data.get_physics_initial_background();
+    const LevelData::PhysicsLayerData &pressure_layer =
+        data.get_phy_layer(PHYATTR_AIR_PRESSURE);
+    const LevelData::PhysicsLayerData &temperature_layer =
+        data.get_phy_layer(PHYATTR_TEMPERATURE);
+    const LevelData::PhysicsLayerData &fog_layer =
+        data.get_phy_layer(PHYATTR_FOG_DENSITY);
+    const CoordInt physics_width = level_width*subdivision_count;
+
+    level->physics().init_cells(
+        [&](CoordInt x, CoordInt y,
+            Cell &cell, FogDensity &fog, CellMetadata &meta)
+        {
+            const size_t index = x + y*physics_width;
+            const double temperature = layer_value(
+                temperature_layer[index], background.temperature);
+
+            const CoordInt px = x % subdivision_count;
+            const CoordInt py = y % subdivision_count;
+            GameObject *const obj = level->get_cell(
+                x / subdivision_count,
+                y / subdivision_count)->here;
+
+            if (obj && obj->info.stamp.get_blocking(px, py)) {
+                // same as Automaton::place_object, but with the local
+                // initial temperature
+                cell.air_pressure = 0;
+                cell.heat_energy = temperature * obj->info.temp_coefficient;
+                cell.flow[0] = px - ((float)subdivision_count / 2);
+                cell.flow[1] = py - ((float)subdivision_count / 2);
+                fog = 0;
+                meta.blocked = true;
+                meta.obj = obj;
+                return;
+            }
+
+            cell.air_pressure = layer_value(
+                pressure_layer[index], background.air_pressure);
+            cell.heat_energy = temperature * (
+                airtempcoeff_per_pressure * cell.air_pressure);
+            cell.flow[0] = 0;
+            cell.flow[1] = 0;
+            fog = fog_from_double(layer_value(
+                fog_layer[index], background.fog_density));
+            meta.blocked = false;
+            meta.obj = nullptr;
+        });
+
+    return level;
+}
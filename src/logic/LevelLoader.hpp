@@ -0,0 +1,27 @@
+#ifndef _ML_LEVEL_LOADER_H
+#define _ML_LEVEL_LOADER_H
+
+#include <memory>
+
+#include "io/LevelData.hpp"
+
+#include "Level.hpp"
+
+/**
+ * Create a Level from the level data of a collection. Each tile in the
+ * default layer becomes a TileObject; the affector layer is not
+ * instantiated yet. The air pressure, temperature and fog density of the
+ * physics simulation are initialized from the initial physics layers.
+ *
+ * All objects and their stamps are written in bulk, which is much faster
+ * than place_object(). Unlike place_object(), no air is displaced by the
+ * objects, and their initial temperature is taken from the temperature
+ * layer.
+ *
+ * *mp* is passed on to the Level and controls whether the physics
+ * simulation uses multiple threads.
+ */
+std::unique_ptr<Level> instantiate_level(const LevelData &data,
+                                         bool mp = true);
+
+#endif
@@ -0,0 +1,86 @@
+#include "LevelState.hpp"
+
+#include <cassert>
+
+/* LevelState */
+
+constexpr uint32_t LevelState::no_object;
+constexpr uint32_t LevelState::no_info;
+
+LevelState::LevelState():
+    width(0),
+    height(0),
+    ticks(0),
+    seed(0),
+    rng(),
+    particle_rng(),
+    player(no_object),
+    objects(),
+    object_data(),
+    cells(),
+    awake(),
+    occupied(0, 0),
+    reserved(0, 0),
+    occupied_columns(0, 0),
+    reserved_columns(0, 0),
+    timers(),
+    explosion_batches(),
+    physics_epoch(0),
+    physics_cells(),
+    physics_fog(),
+    physics_metadata(),
+    physics_impulses(),
+    physics_deposits(),
+    particles()
+{
+
+}
+
+/* LevelStateRing */
+
+LevelStateRing::LevelStateRing(size_t capacity):
+    _states(),
+    _next(0),
+    _size(0)
+{
+    assert(capacity > 0);
+    for (size_t i = 0; i < capacity; i++) {
+        _states.emplace_back(new LevelState());
+    }
+}
+
+void LevelStateRing::clear()
+{
+    _next = 0;
+    _size = 0;
+}
+
+const LevelState &LevelStateRing::peek(size_t age) const
+{
+    assert(age < _size);
+    const size_t capacity = _states.size();
+    return *_states[(_next + capacity - 1 - age) % capacity];
+}
+
+void LevelStateRing::push(Level &level)
+{
+    level.save_state(*_states[_next]);
+    _next = (_next + 1) % _states.size();
+    if (_size < _states.size()) {
+        _size += 1;
+    }
+}
+
+bool LevelStateRing::rollback(Level &level, size_t age)
+{
+    if (age >= _size) {
+        return false;
+    }
+
+    level.restore_state(peek(age));
+
+    const size_t capacity = _states.size();
+    _next = (_next + capacity - age) % capacity;
+    _size -= age;
+    return true;
+}
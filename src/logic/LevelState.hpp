@@ -0,0 +1,223 @@
+#ifndef _ML_LEVEL_STATE_H
+#define _ML_LEVEL_STATE_H
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "Bitboard.hpp"
+#include "Level.hpp"
+#include "Movements.hpp"
+#include "Particles.hpp"
+#include "Physics.hpp"
+#include "Random.hpp"
+#include "TimerWheel.hpp"
+
+/**
+ * Appends plain values to the byte buffer of a LevelState, see
+ * GameObject::save_state().
+ */
+class StateWriter
+{
+public:
+    explicit StateWriter(std::vector<uint8_t> &buffer):
+        _buffer(buffer)
+    {
+
+    }
+
+private:
+    std::vector<uint8_t> &_buffer;
+
+public:
+    template <typename T>
+    void write(const T &value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "only plain values can be written");
+        const uint8_t *const raw = reinterpret_cast<const uint8_t*>(&value);
+        _buffer.insert(_buffer.end(), raw, raw + sizeof(T));
+    }
+
+};
+
+/**
+ * Reads back the values written by a StateWriter, in the same order.
+ */
+class StateReader
+{
+public:
+    StateReader(const uint8_t *begin, const uint8_t *end):
+        _pos(begin),
+        _end(end)
+    {
+
+    }
+
+private:
+    const uint8_t *_pos;
+    const uint8_t *_end;
+
+public:
+    template <typename T>
+    void read(T &value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "only plain values can be read");
+        assert(_end - _pos >= ptrdiff_t(sizeof(T)));
+        memcpy(&value, _pos, sizeof(T));
+        _pos += sizeof(T);
+    }
+
+};
+
+/**
+ * An object in a LevelState. Objects are numbered in the order of the
+ * cells they occupy (row-major); other structures refer to them by that
+ * number.
+ */
+struct ObjectState
+{
+    /* object_pool_index() of the type of the object */
+    uint32_t type;
+
+    /* index of the info in the infos adopted by the level, or
+     * LevelState::no_info if the type of the object determines its info */
+    uint32_t info;
+
+    CoordPair cell, phy;
+    double x, y, phi;
+    TickCounter ticks;
+    FrameState frame_state;
+
+    bool moving;
+    /* obj is always nullptr */
+    Movement movement;
+
+    /* end of the data written by GameObject::save_state() in
+     * LevelState::object_data; it starts at the end of the previous
+     * object */
+    uint32_t data_end;
+};
+
+struct TimerState
+{
+    TimerAction action;
+    CoordInt x, y;
+    uint32_t obj;
+};
+
+struct CellMetadataState
+{
+    bool blocked;
+    uint32_t obj;
+};
+
+/**
+ * A copy of everything which changes while a Level runs: the cells, the
+ * objects and their movements, the timers, the random number engines, the
+ * physics and the particles. References between these are stored as
+ * object numbers instead of pointers.
+ *
+ * A state can only be restored into the level it was saved from (or one
+ * which has been set up the same way), as the adopted object infos are
+ * referred to by index. The buffers are reused when a state is saved
+ * again, so saving into the same state repeatedly does not allocate.
+ */
+struct LevelState
+{
+    LevelState();
+    LevelState(const LevelState &ref) = delete;
+    LevelState &operator=(const LevelState &ref) = delete;
+
+    static constexpr uint32_t no_object = 0xffffffff;
+    static constexpr uint32_t no_info = 0xffffffff;
+
+    CoordInt width, height;
+    TickCounter ticks;
+    uint64_t seed;
+    PCG32 rng;
+    PCG32 particle_rng;
+    uint32_t player;
+
+    std::vector<ObjectState> objects;
+    std::vector<uint8_t> object_data;
+
+    /* here and reserved_by of each cell, interleaved */
+    std::vector<uint32_t> cells;
+
+    std::vector<uint64_t> awake;
+    Bitboard occupied, reserved;
+    Bitboard occupied_columns, reserved_columns;
+
+    TimerWheel<TimerState> timers;
+    std::vector<ExplosionBatch> explosion_batches;
+
+    TickCounter physics_epoch;
+    std::vector<Cell> physics_cells;
+    std::vector<FogDensity> physics_fog;
+    std::vector<CellMetadataState> physics_metadata;
+    std::vector<PhysicsImpulse> physics_impulses;
+    /* of all producers, in order */
+    std::vector<PhysicsDeposit> physics_deposits;
+
+    /* in update order */
+    std::vector<PhysicsParticle> particles;
+};
+
+/**
+ * A ring of the most recent states of a level, for rolling back.
+ *
+ * The states are allocated once, so pushing a state into a full ring
+ * reuses the buffers of the oldest one.
+ */
+class LevelStateRing
+{
+public:
+    explicit LevelStateRing(size_t capacity);
+
+private:
+    std::vector<std::unique_ptr<LevelState>> _states;
+    /* index of the slot the next state is saved to */
+    size_t _next;
+    size_t _size;
+
+public:
+    inline size_t capacity() const
+    {
+        return _states.size();
+    }
+
+    inline size_t size() const
+    {
+        return _size;
+    }
+
+    void clear();
+
+    /**
+     * Return the state saved *age* pushes ago, 0 being the most recent
+     * one. *age* must be less than size().
+     */
+    const LevelState &peek(size_t age = 0) const;
+
+    /**
+     * Save the state of *level* as the most recent state, dropping the
+     * oldest one if the ring is full.
+     */
+    void push(Level &level);
+
+    /**
+     * Restore the state saved *age* pushes ago and drop all newer states,
+     * so that the restored state becomes the most recent one.
+     *
+     * @return false if there is no such state.
+     */
+    bool rollback(Level &level, size_t age = 0);
+
+};
+
+#endif
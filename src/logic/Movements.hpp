@@ -25,81 +25,49 @@ authors named in the AUTHORS file.
 #ifndef _ML_MOVEMENTS_H
 #define _ML_MOVEMENTS_H
 
-#include "CEngine/IO/Time.hpp"
+#include <cstdint>
 
-#include "Physics.hpp"
-#include "Level.hpp"
+#include "Types.hpp"
 
-struct LevelCell;
 class GameObject;
 
-class Movement {
-public:
-    Movement(GameObject *obj,
-             CoordInt offset_x, CoordInt offset_y);
-    virtual ~Movement();
-
-protected:
-    TickCounter _time;
-    GameObject *_obj;
-    GameObject *_dependency;
-
-protected:
-    void delete_self();
-    bool finalize();
-
-public:
-    const CoordInt offset_x;
-    const CoordInt offset_y;
-
-public:
-    virtual void skip() = 0;
-
-    /**
-     * Advance the movement by one tick. Return either true if the movement is
-     * still in progress, or the result of the after_movement handler from the
-     * object if the movement is finished.
-     */
-    virtual bool update() = 0;
-
+enum class MovementKind: uint8_t {
+    /* move by one cell horizontally or vertically */
+    STRAIGHT,
+    /* move sideways by one cell, then down by one cell; used to roll off
+     * other objects */
+    ROLL
 };
 
-class MovementStraight: public Movement {
-public:
-    MovementStraight(
-        LevelCell *from, LevelCell *to,
-        int offsetX, int offsetY);
-    virtual ~MovementStraight();
-
-private:
-    LevelCell *_from, *_to;
-    CoordInt _startX, _startY;
-
-public:
-    void skip() override;
-    bool update() override;
-
-public:
-    static const double duration;
-
-};
-
-class MovementRoll: public Movement {
-public:
-    MovementRoll(
-        LevelCell *from, LevelCell *via, LevelCell *to,
-        int offsetX, int offsetY);
-    virtual ~MovementRoll();
-
-private:
-    LevelCell *_from, *_via, *_to;
-    CoordInt _startX, _startY;
-    bool _cleared_from;
-
-public:
-    void skip() override;
-    bool update() override;
-
+/**
+ * Record of an object moving from one cell to a neighbouring one.
+ *
+ * Movements are plain data, stored by the Level in an array indexed by the
+ * destination cell (a cell can be the destination of at most one movement,
+ * as the moving object occupies it right from the start). The cells
+ * involved are implied by the start and the offset:
+ *
+ * * STRAIGHT moves from the start cell to start + offset. The start cell is
+ *   reserved for the whole movement.
+ * * ROLL moves from the start cell via (start.x + offset_x, start.y) to
+ *   start + offset. The start cell is reserved for the first half of the
+ *   movement, the via cell for the whole movement.
+ *
+ * Movements are started, advanced and ended by the Level (see
+ * Level::start_movement() and Level::advance_movement()); objects only
+ * learn about them through GameObject::after_movement().
+ */
+struct Movement
+{
+    GameObject *obj;
+    CoordInt start_x, start_y;
+    CoordInt offset_x, offset_y;
+    TickCounter time;
+    MovementKind kind;
+    bool cleared_from;
+
+    /* length of a movement in ticks */
+    static constexpr TickCounter duration = 100;
 };
 
 #endif
@@ -0,0 +1,218 @@
+#ifndef _ML_OBJECT_POOL_H
+#define _ML_OBJECT_POOL_H
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Errors.hpp"
+#include "GameObject.hpp"
+
+class Level;
+
+/**
+ * Type-erased interface of an ObjectPool, which allows to return an object
+ * to its pool through GameObject::pool.
+ */
+class ObjectPoolBase
+{
+public:
+    ObjectPoolBase():
+        _live(0),
+        _pooled(0)
+    {
+
+    }
+
+    ObjectPoolBase(const ObjectPoolBase &ref) = delete;
+    ObjectPoolBase &operator=(const ObjectPoolBase &ref) = delete;
+    virtual ~ObjectPoolBase() = default;
+
+protected:
+    size_t _live;
+    size_t _pooled;
+
+public:
+    /**
+     * Destruct *obj*, which must have been created by this pool, and make
+     * its storage available for reuse.
+     */
+    virtual void destroy(GameObject *obj) = 0;
+
+    /**
+     * Create an object of the type of the pool, for restoring a saved
+     * level state. Objects which take an ObjectInfo are constructed with
+     * *info*, which must not be nullptr then; all others ignore it.
+     */
+    virtual GameObject *recreate(Level *level, const ObjectInfo *info) = 0;
+
+    /**
+     * The object_pool_index() of the type of the pool.
+     */
+    virtual unsigned int type_index() const = 0;
+
+    /**
+     * Number of objects created by the pool which have not been destroyed.
+     */
+    inline size_t live() const
+    {
+        return _live;
+    }
+
+    /**
+     * Number of slots which are allocated but currently unused.
+     */
+    inline size_t pooled() const
+    {
+        return _pooled;
+    }
+
+};
+
+/**
+ * Return a distinct, dense index for each GameObject subclass, used to
+ * look up the pool of a type without hashing.
+ */
+inline unsigned int next_object_pool_index()
+{
+    static std::atomic_uint counter(0);
+    return counter++;
+}
+
+template <typename _Object>
+inline unsigned int object_pool_index()
+{
+    static const unsigned int index = next_object_pool_index();
+    return index;
+}
+
+/**
+ * Storage for objects of a single GameObject subclass.
+ *
+ * Objects are constructed in place in chunks of *_chunk_size* slots. Chunks
+ * are never moved or freed while the pool exists, so object addresses are
+ * stable, and freed slots are reused before a new chunk is allocated. When
+ * the pool is destroyed, all objects still alive are destructed.
+ */
+template <typename _Object, size_t _chunk_size = 64>
+class ObjectPool: public ObjectPoolBase
+{
+public:
+    typedef _Object Object;
+    static constexpr size_t chunk_size = _chunk_size;
+
+public:
+    ObjectPool() = default;
+
+    ~ObjectPool() override
+    {
+        for (auto &chunk: _storage) {
+            for (auto &slot: *chunk) {
+                if (slot.live) {
+                    reinterpret_cast<Object*>(&slot.storage)->~Object();
+                    slot.live = false;
+                }
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        typename std::aligned_storage<
+            sizeof(Object), alignof(Object)>::type storage;
+        bool live;
+    };
+
+    typedef std::array<Slot, chunk_size> Chunk;
+
+    std::vector<std::unique_ptr<Chunk>> _storage;
+    std::vector<Slot*> _available;
+
+private:
+    void grow()
+    {
+        Chunk *new_chunk = new Chunk();
+        _available.reserve(_available.size() + chunk_size);
+        // push in reverse so that slots are handed out in address order
+        for (auto iter = new_chunk->rbegin(); iter != new_chunk->rend(); ++iter)
+        {
+            iter->live = false;
+            _available.push_back(&*iter);
+        }
+        _storage.push_back(std::unique_ptr<Chunk>(new_chunk));
+        _pooled += chunk_size;
+    }
+
+    Object *recreate_impl(Level *level, const ObjectInfo *info,
+                          std::true_type)
+    {
+        if (!info) {
+            throw ProgrammingError(
+                "Cannot recreate an object without its ObjectInfo.");
+        }
+        return create(level, *info);
+    }
+
+    Object *recreate_impl(Level *level, const ObjectInfo*,
+                          std::false_type)
+    {
+        return create(level);
+    }
+
+public:
+    /**
+     * Make sure that at least *count* objects can be created without
+     * allocating.
+     */
+    void reserve(size_t count)
+    {
+        while (_available.size() < count) {
+            grow();
+        }
+    }
+
+    template <typename... _Args>
+    Object *create(_Args&&... args)
+    {
+        if (_available.empty()) {
+            grow();
+        }
+        Slot *slot = _available.back();
+        Object *obj = new (&slot->storage) Object(std::forward<_Args>(args)...);
+        _available.pop_back();
+        slot->live = true;
+        obj->pool = this;
+        _live += 1;
+        _pooled -= 1;
+        return obj;
+    }
+
+    void destroy(GameObject *obj) override
+    {
+        Object *const typed = static_cast<Object*>(obj);
+        Slot *const slot = reinterpret_cast<Slot*>(typed);
+        typed->~Object();
+        slot->live = false;
+        _available.push_back(slot);
+        _live -= 1;
+        _pooled += 1;
+    }
+
+    GameObject *recreate(Level *level, const ObjectInfo *info) override
+    {
+        return recreate_impl(
+            level, info,
+            std::is_constructible<Object, Level*, const ObjectInfo&>());
+    }
+
+    unsigned int type_index() const override
+    {
+        return object_pool_index<Object>();
+    }
+
+};
+
+#endif
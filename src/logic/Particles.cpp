@@ -1,153 +1,407 @@
 #include "Particles.hpp"
 
-#include <CEngine/Math/Vectors.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <functional>
 
-#include "Level.hpp"
+#include <xmmintrin.h>
 
-inline void update_coord(PyEngine::TimeFloat deltaT,
-                         float &v, float &vv, float &av)
-{
-    v = v + vv*deltaT + av*deltaT/2;
-    vv = vv + av*deltaT;
-}
+#include "Errors.hpp"
+#include "Level.hpp"
+#include "WorkerPool.hpp"
 
+/**
+ * Move a particle out of a blocked cell to the nearest unblocked cell and
+ * reflect its velocity at the surface, as given by *way_out*.
+ */
 inline void handle_collision(
-    Automaton &physics,
-    Cell &current_cell,
+    PCG32 &rng,
+    const CollisionCell &way_out,
     float &x, float &vx,
     float &y, float &vy)
 {
-    PyEngine::Vector2f posstep(-vx, -vy);
-    posstep.normalize();
-    PyEngine::Vector2f pos(x, y);
-    pos *= subdivision_count;
-    Cell *cell = &current_cell, *prev_cell = &current_cell;
-    CellMetadata *meta = nullptr;
-    for (unsigned int step = 0; step < 10; step++) {
-        pos += posstep;
-        const CoordInt cx = round(pos[PyEngine::eX]);
-        const CoordInt cy = round(pos[PyEngine::eY]);
-
-        prev_cell = cell;
-        cell = physics.safe_cell_at(cx, cy);
-        if (!cell) {
-            break;
-        }
+    x += float(way_out.dx) / subdivision_count;
+    y += float(way_out.dy) / subdivision_count;
+
+    // without a way out in reach, the particle is sent back where it came
+    // from; a particle which already leaves the surface keeps its heading
+    float new_vx = -vx, new_vy = -vy;
+    if (way_out.nx != 0 || way_out.ny != 0) {
+        const float vn = vx * way_out.nx + vy * way_out.ny;
+        new_vx = vx - 2 * std::min(vn, 0.f) * way_out.nx;
+        new_vy = vy - 2 * std::min(vn, 0.f) * way_out.ny;
+    }
 
-        meta = physics.meta_at(cx, cy);
+    const float vmag = std::sqrt(new_vx*new_vx + new_vy*new_vy);
+    vx = new_vx * 0.4;
+    vx = vx + rng.uniform(-1.f, 1.f)*vmag*0.3;
+    vy = new_vy * 0.4;
+    vy = vy + rng.uniform(-1.f, 1.f)*vmag*0.3;
+}
 
-        if (meta->blocked) {
-            continue;
-        }
 
-        break;
+/* ParticleSystem */
+
+constexpr size_t ParticleSystem::chunk_size;
+constexpr size_t ParticleSystem::default_budget;
+constexpr size_t ParticleSystem::min_capacity;
+constexpr size_t ParticleSystem::deposit_slot_count;
+constexpr unsigned int ParticleSystem::shrink_delay;
+constexpr size_t ParticleSystem::particle_footprint;
+
+ParticleSystem::ParticleSystem(Level &level):
+    _level(level),
+    _rng(0, 1),
+    _size(0),
+    _capacity(0),
+    _age(),
+    _lifetime(),
+    _x(),
+    _y(),
+    _phi(),
+    _vx(),
+    _vy(),
+    _vphi(),
+    _ax(),
+    _ay(),
+    _aphi(),
+    _ctr(),
+    _type(),
+    _workers(nullptr),
+    _chunk_effects(),
+    _budget(default_budget),
+    _culled(0),
+    _throttled(0),
+    _cull_order(),
+    _low_updates(0),
+    _peak_capacity(0)
+{
+
+}
+
+void ParticleSystem::grow(size_t needed)
+{
+    // stays a multiple of four, see integrate()
+    size_t capacity = (_capacity > 0 ? _capacity * 2 : min_capacity);
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    _capacity = std::min(capacity, max_capacity());
+    for (std::vector<float> *field: {&_age, &_lifetime,
+                                     &_x, &_y, &_phi,
+                                     &_vx, &_vy, &_vphi,
+                                     &_ax, &_ay, &_aphi})
+    {
+        field->resize(_capacity, 0.f);
     }
+    _ctr.resize(_capacity, 0);
+    _type.resize(_capacity, ParticleType::FIRE);
+    _peak_capacity = std::max(_peak_capacity, _capacity);
+}
 
-    x = pos[PyEngine::eX] / subdivision_count;
-    y = pos[PyEngine::eY] / subdivision_count;
+/**
+ * Replace *field* with a copy of its first *count* elements; unlike
+ * resize() and shrink_to_fit(), this is guaranteed to free the memory.
+ */
+template <typename T>
+static inline void reallocate_field(std::vector<T> &field, size_t count)
+{
+    std::vector<T>(field.begin(), field.begin() + count).swap(field);
+}
 
-    if (!cell) {
-        // out of game
-        return;
-    } else {
-        if (!meta->blocked) {
-            cell = prev_cell;
-        }
-        // found end of object
-
-        posstep *= -1;
-
-        const PyEngine::Vector2f incoming_ray(vx, vy);
-        PyEngine::Vector2f new_v =
-            incoming_ray - (2*incoming_ray * posstep) * posstep;
-        const float vmag = new_v.length();
-        vx = new_v[PyEngine::eX] * 0.4;
-        vx = vx + (((float)random() / RAND_MAX) * 2.0 - 1.0)*vmag*0.3;
-        vy = new_v[PyEngine::eY] * 0.4;
-        vy = vy + (((float)random() / RAND_MAX) * 2.0 - 1.0)*vmag*0.3;
-        return;
+void ParticleSystem::reallocate(size_t capacity)
+{
+    assert(capacity >= _size && capacity % 4 == 0);
+    _capacity = capacity;
+    for (std::vector<float> *field: {&_age, &_lifetime,
+                                     &_x, &_y, &_phi,
+                                     &_vx, &_vy, &_vphi,
+                                     &_ax, &_ay, &_aphi})
+    {
+        reallocate_field(*field, capacity);
     }
+    reallocate_field(_ctr, capacity);
+    reallocate_field(_type, capacity);
 
+    // the scratch buffers are sized for the largest update so far
+    std::vector<uint32_t>().swap(_cull_order);
+    std::vector<ChunkEffects>().swap(_chunk_effects);
 }
 
+void ParticleSystem::release_unused()
+{
+    if (_capacity <= min_capacity || _size > _capacity / 4) {
+        _low_updates = 0;
+        return;
+    }
+    if (++_low_updates < shrink_delay) {
+        return;
+    }
 
-/* ParticleSystem */
+    // leave room for the particles to double again before growing
+    size_t capacity = min_capacity;
+    while (capacity < 2*_size) {
+        capacity *= 2;
+    }
+    reallocate(capacity);
+    _low_updates = 0;
+}
 
-ParticleSystem::ParticleSystem(Level &level):
-    GenericParticleSystem<PhysicsParticle, 1024>(),
-    _level(level)
+void ParticleSystem::remove(size_t i)
 {
+    const size_t last = _size - 1;
+    _age[i] = _age[last];
+    _lifetime[i] = _lifetime[last];
+    _x[i] = _x[last];
+    _y[i] = _y[last];
+    _phi[i] = _phi[last];
+    _vx[i] = _vx[last];
+    _vy[i] = _vy[last];
+    _vphi[i] = _vphi[last];
+    _ax[i] = _ax[last];
+    _ay[i] = _ay[last];
+    _aphi[i] = _aphi[last];
+    _ctr[i] = _ctr[last];
+    _type[i] = _type[last];
+    _size = last;
+}
 
+size_t ParticleSystem::max_capacity() const
+{
+    return ((_budget + 3) & ~size_t(3)) + chunk_size;
 }
 
-ParticleSystem::Particle *ParticleSystem::spawn()
+void ParticleSystem::cull()
 {
-    Particle *part = allocate();
-    part->alive = true;
-    part->age = 0;
-    part->ctr = 0;
-    _active.push_back(part);
-    return part;
+    if (_size <= _budget) {
+        return;
+    }
+
+    const size_t excess = _size - _budget;
+    _cull_order.resize(_size);
+    for (size_t i = 0; i < _size; i++) {
+        _cull_order[i] = i;
+    }
+
+    // the index breaks ties, so that the selection is deterministic
+    std::nth_element(
+        _cull_order.begin(),
+        _cull_order.begin() + excess,
+        _cull_order.end(),
+        [this](uint32_t a, uint32_t b) {
+            const unsigned int prio_a = particle_priority(_type[a]);
+            const unsigned int prio_b = particle_priority(_type[b]);
+            if (prio_a != prio_b) {
+                return prio_a < prio_b;
+            }
+            if (_age[a] != _age[b]) {
+                return _age[a] > _age[b];
+            }
+            return a < b;
+        });
+
+    // removing from the back first keeps the other indices valid
+    std::sort(_cull_order.begin(),
+              _cull_order.begin() + excess,
+              std::greater<uint32_t>());
+    for (size_t i = 0; i < excess; i++) {
+        remove(_cull_order[i]);
+    }
+    _culled += excess;
 }
 
-void ParticleSystem::spawn_generator(size_t n, const Generator &generator)
+void ParticleSystem::age_particles(float deltaT)
 {
-    for (size_t i = 0; i < n; i++) {
-        Particle *const part = allocate();
-        part->alive = true;
-        part->age = 0;
-        part->ctr = 0;
-        generator(part);
-        if (part->lifetime > 0) {
-            _active.push_back(part);
+    const __m128 dt = _mm_set1_ps(deltaT);
+    for (size_t i = 0; i < _size; i += 4) {
+        _mm_storeu_ps(&_age[i], _mm_add_ps(_mm_loadu_ps(&_age[i]), dt));
+    }
+
+    // test four particles at once and only fall back to single particles
+    // around deaths; a particle moved into a free index is tested again
+    size_t i = 0;
+    while (i < _size) {
+        if (i + 4 <= _size) {
+            const __m128 dead = _mm_cmpgt_ps(_mm_loadu_ps(&_age[i]),
+                                             _mm_loadu_ps(&_lifetime[i]));
+            if (!_mm_movemask_ps(dead)) {
+                i += 4;
+                continue;
+            }
+        }
+        if (_age[i] > _lifetime[i]) {
+            remove(i);
         } else {
-            release(part);
+            i += 1;
         }
     }
 }
 
-void ParticleSystem::update(PyEngine::TimeFloat deltaT)
+/**
+ * Advance *count* coordinates with their velocities and accelerations.
+ * *count* may be rounded up to a multiple of four.
+ */
+static inline void integrate_coords(
+    float *v, float *vv, const float *av,
+    size_t count, float deltaT)
 {
-    Automaton &physics = _level.physics();
-    // const SimulationConfig &config = physics.config();
+    const __m128 dt = _mm_set1_ps(deltaT);
+    const __m128 half_dt = _mm_set1_ps(deltaT / 2);
+    for (size_t i = 0; i < count; i += 4) {
+        const __m128 vel = _mm_loadu_ps(&vv[i]);
+        const __m128 acc = _mm_loadu_ps(&av[i]);
+        const __m128 pos = _mm_loadu_ps(&v[i]);
+        _mm_storeu_ps(&v[i], _mm_add_ps(
+                          _mm_add_ps(pos, _mm_mul_ps(vel, dt)),
+                          _mm_mul_ps(acc, half_dt)));
+        _mm_storeu_ps(&vv[i], _mm_add_ps(vel, _mm_mul_ps(acc, dt)));
+    }
+}
 
-    for (auto it = _active.begin();
-         it != _active.end();
-         it++)
-    {
-        Particle *const part = *it;
-        part->age += deltaT;
-        if (part->age > part->lifetime) {
-            it = _active.erase(it);
-            continue;
+void ParticleSystem::integrate(float deltaT)
+{
+    integrate_coords(_x.data(), _vx.data(), _ax.data(), _size, deltaT);
+    integrate_coords(_y.data(), _vy.data(), _ay.data(), _size, deltaT);
+    integrate_coords(_phi.data(), _vphi.data(), _aphi.data(), _size, deltaT);
+}
+
+PhysicsParticle ParticleSystem::get(size_t i) const
+{
+    return PhysicsParticle{
+        _age[i], _lifetime[i],
+        _x[i], _y[i],
+        _vx[i], _vy[i],
+        _ax[i], _ay[i],
+        _phi[i], _vphi[i], _aphi[i],
+        _ctr[i],
+        _type[i]};
+}
+
+void ParticleSystem::clear()
+{
+    _size = 0;
+}
+
+void ParticleSystem::assign_active(const std::vector<PhysicsParticle> &parts)
+{
+    _size = 0;
+    const ParticleSlots slots = reserve(parts.size());
+    for (size_t j = 0; j < slots.count; j++) {
+        set(slots.first + j, parts[j]);
+    }
+}
+
+void ParticleSystem::copy_active(std::vector<PhysicsParticle> &dest) const
+{
+    dest.resize(_size);
+    for (size_t i = 0; i < _size; i++) {
+        dest[i] = get(i);
+    }
+}
+
+void ParticleSystem::set_budget(size_t budget)
+{
+    _budget = budget;
+}
+
+void ParticleSystem::spawn(const PhysicsParticle &part)
+{
+    const ParticleSlots slots = reserve(1);
+    if (slots.count) {
+        set(slots.first, part);
+    }
+}
+
+ParticleSlots ParticleSystem::reserve(size_t count)
+{
+    if (Level::in_object_band()) {
+        throw ProgrammingError(
+            "Cannot spawn particles from the parallel object update; "
+            "use Level::run_shared().");
+    }
+    if (_capacity - _size < count && _capacity < max_capacity()) {
+        grow(_size + count);
+    }
+    const ParticleSlots slots{_size, std::min(count, _capacity - _size)};
+    _size += slots.count;
+    _culled += count - slots.count;
+    return slots;
+}
+
+void ParticleSystem::deposit(ChunkEffects &effects,
+                             const PhysicsDeposit &item)
+{
+    const uint32_t cell = uint32_t(item.x)
+        + uint32_t(item.y) * uint32_t(_level.get_width()*subdivision_count);
+    // Fibonacci hashing, taking the upper 12 bits
+    static_assert(deposit_slot_count == 4096,
+                  "the hash does not match the deposit table size");
+    size_t slot = (cell * UINT32_C(2654435769)) >> 20;
+    while (true) {
+        const uint16_t entry = effects.deposit_slots[slot];
+        if (!entry) {
+            effects.deposits.push_back(item);
+            effects.deposit_slots[slot] = effects.deposits.size();
+            return;
+        }
+        PhysicsDeposit &existing = effects.deposits[entry - 1];
+        if (existing.x == item.x && existing.y == item.y) {
+            existing.temperature += item.temperature;
+            existing.fog = fog_add_saturated(existing.fog, item.fog);
+            return;
         }
-        update_coord(deltaT, part->x, part->vx, part->ax);
-        update_coord(deltaT, part->y, part->vy, part->ay);
-        update_coord(deltaT, part->phi, part->vphi, part->aphi);
+        slot = (slot + 1) & (deposit_slot_count - 1);
+    }
+}
+
+void ParticleSystem::update_chunk(size_t chunk,
+                                  uint64_t seed,
+                                  float spawn_rate,
+                                  const PhysicsSnapshot &view)
+{
+    ChunkEffects &effects = _chunk_effects[chunk];
+    effects.deposit_slots.assign(deposit_slot_count, 0);
+    PCG32 rng(seed, chunk);
+    const size_t begin = chunk * chunk_size;
+    const size_t end = std::min(begin + chunk_size, _size);
 
-        switch (part->type) {
+    for (size_t i = begin; i < end; i++)
+    {
+        switch (_type[i]) {
         case ParticleType::FIRE:
         {
-            const uint32_t old_ctr = part->ctr;
-            const uint32_t new_ctr = part->age * 25;
-            part->ctr = new_ctr;
+            const uint32_t old_ctr = _ctr[i];
+            const uint32_t new_ctr = _age[i] * 25;
+            _ctr[i] = new_ctr;
 
             const uint32_t to_spawn = new_ctr - old_ctr;
 
-            for (uint32_t i = 0; i < to_spawn; i++)
+            for (uint32_t j = 0; j < to_spawn; j++)
             {
-                Particle *const subpart = spawn();
-                subpart->type = ParticleType::FIRE_SECONDARY;
-                subpart->lifetime = 4+((float)rand() / RAND_MAX)*2-1;
-                subpart->x = part->x - ((float)rand() / RAND_MAX) * part->vx * 0.01;
-                subpart->y = part->y - ((float)rand() / RAND_MAX) * part->vy * 0.01;
-                subpart->vx = part->vx * 0.1;
-                subpart->vy = part->vy * 0.1;
-                subpart->ax = 0;
-                subpart->ay = -0.2;
-                subpart->phi = ((float)random() / RAND_MAX)*2*3.14159;
-                subpart->vphi = part->vphi;
-                subpart->aphi = 0;
+                if (spawn_rate < 1 && rng.uniform(0.f, 1.f) >= spawn_rate) {
+                    effects.throttled += 1;
+                    continue;
+                }
+
+                float r[4];
+                rng.fill_uniform(r, 4);
+
+                PhysicsParticle subpart;
+                subpart.type = ParticleType::FIRE_SECONDARY;
+                subpart.age = 0;
+                subpart.ctr = 0;
+                subpart.lifetime = 4+r[0]*2-1;
+                subpart.x = _x[i] - r[1] * _vx[i] * 0.01;
+                subpart.y = _y[i] - r[2] * _vy[i] * 0.01;
+                subpart.vx = _vx[i] * 0.1;
+                subpart.vy = _vy[i] * 0.1;
+                subpart.ax = 0;
+                subpart.ay = -0.2;
+                subpart.phi = r[3]*2*3.14159;
+                subpart.vphi = _vphi[i];
+                subpart.aphi = 0;
+                effects.spawned.push_back(subpart);
             }
 
             break;
@@ -158,58 +412,112 @@ void ParticleSystem::update(PyEngine::TimeFloat deltaT)
         }
         }
 
-        CoordPair phy = _level.get_physics_coords(part->x, part->y);
+        CoordPair phy = _level.get_physics_coords(_x[i], _y[i]);
         if (phy.x < 0 || phy.y < 0
             || phy.x >= _level.get_width()*subdivision_count
             || phy.y >= _level.get_height()*subdivision_count)
         {
             continue;
         }
-        Cell *cell = physics.cell_at(phy.x, phy.y);
-        CellMetadata *meta = physics.meta_at(phy.x, phy.y);
+        const Cell *cell = view.cell_at(phy.x, phy.y);
+        const CellMetadata *meta = view.meta_at(phy.x, phy.y);
 
-        switch (part->type) {
+        switch (_type[i]) {
         case ParticleType::FIRE:
         {
-            // const double prev_vx = part->vx;
-            // const double prev_vy = part->vy;
-            // cell->flow[0] = cell->flow[0] * config.flow_damping - prev_vy * (1.0 - config.flow_damping);
-            // cell->flow[1] = cell->flow[1] * config.flow_damping - prev_vx * (1.0 - config.flow_damping);
-            part->vx = part->vx * 0.999 - cell->flow[1] * 0.001;
-            part->vy = part->vy * 0.999 - cell->flow[0] * 0.001;
-
-            cell->heat_energy += FIRE_PARTICLE_TEMPERATURE_RISE * (
-                meta->blocked ?
-                meta->obj->info.temp_coefficient :
-                cell->air_pressure);
+            _vx[i] = _vx[i] * 0.999 - cell->flow[1] * 0.001;
+            _vy[i] = _vy[i] * 0.999 - cell->flow[0] * 0.001;
+
+            deposit(effects, PhysicsDeposit{
+                    phy.x, phy.y, FIRE_PARTICLE_TEMPERATURE_RISE, 0});
 
             if (meta->blocked) {
-                meta->obj->ignition_touch();
+                effects.ignited.push_back(meta->obj);
             }
             break;
         }
         case ParticleType::FIRE_SECONDARY:
         {
-            part->vx = part->vx * 0.995 - cell->flow[1] * 0.005;
-            part->vy = part->vy * 0.995 - cell->flow[0] * 0.005;
+            _vx[i] = _vx[i] * 0.995 - cell->flow[1] * 0.005;
+            _vy[i] = _vy[i] * 0.995 - cell->flow[0] * 0.005;
 
-            // cell->fog += 0.001;
+            deposit(effects, PhysicsDeposit{
+                    phy.x, phy.y, 0, SMOKE_PARTICLE_FOG_RISE});
             break;
         }
         }
 
         if (meta->blocked) {
             handle_collision(
-                physics,
-                *cell,
-                part->x,
-                part->vx,
-                part->y,
-                part->vy);
-            continue;
+                rng,
+                *view.collision_at(phy.x, phy.y),
+                _x[i],
+                _vx[i],
+                _y[i],
+                _vy[i]);
         }
+    }
+}
+
+void ParticleSystem::update(PyEngine::TimeFloat deltaT)
+{
+    age_particles(deltaT);
+    integrate(deltaT);
+
+    // this runs while the automaton is working on the next step: the
+    // snapshot is read-only and heat and fog go through the deposits;
+    // the collision field is only needed from here on, so the workers
+    // update it while the particles move
+    Automaton &physics = _level.physics();
+    physics.wait_for_collision();
+    const PhysicsSnapshot view = physics.snapshot();
 
+    const size_t chunks = (_size + chunk_size - 1) / chunk_size;
+    if (_chunk_effects.size() < chunks) {
+        _chunk_effects.resize(chunks);
+    }
+    const uint64_t seed = (uint64_t(_rng.next()) << 32) | _rng.next();
+
+    // beyond half of the budget, secondary particles thin out until none
+    // are spawned at the budget
+    const size_t throttle_from = _budget / 2;
+    const float spawn_rate =
+        (_size <= throttle_from ? 1.f
+         : _size >= _budget ? 0.f
+         : float(_budget - _size) / (_budget - throttle_from));
+
+    if (_workers && chunks > 1) {
+        _workers->parallel_for(
+            chunks,
+            [this, seed, spawn_rate, &view](size_t chunk, unsigned int) {
+                update_chunk(chunk, seed, spawn_rate, view);
+            });
+    } else {
+        for (size_t chunk = 0; chunk < chunks; chunk++) {
+            update_chunk(chunk, seed, spawn_rate, view);
+        }
     }
 
+    std::vector<PhysicsDeposit> &deposits = physics.deposits();
+    for (size_t chunk = 0; chunk < chunks; chunk++) {
+        ChunkEffects &effects = _chunk_effects[chunk];
+        const ParticleSlots slots = reserve(effects.spawned.size());
+        for (size_t j = 0; j < slots.count; j++) {
+            set(slots.first + j, effects.spawned[j]);
+        }
+        deposits.insert(deposits.end(),
+                        effects.deposits.begin(),
+                        effects.deposits.end());
+        for (GameObject *obj: effects.ignited) {
+            obj->ignition_touch();
+        }
+        _throttled += effects.throttled;
+        effects.spawned.clear();
+        effects.deposits.clear();
+        effects.ignited.clear();
+        effects.throttled = 0;
+    }
 
+    cull();
+    release_unused();
 }
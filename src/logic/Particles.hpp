@@ -1,144 +1,356 @@
 #ifndef _ML_PARTICLES_H
 #define _ML_PARTICLES_H
 
-#include <forward_list>
-#include <list>
+#include <cstdint>
 #include <vector>
-#include <array>
 
 #include <CEngine/IO/Time.hpp>
 
-template <typename _Particle, size_t _chunk_size>
-class GenericParticleSystem
+#include "Physics.hpp"
+#include "Random.hpp"
+
+enum class ParticleType {
+    FIRE,
+    FIRE_SECONDARY
+};
+
+/**
+ * Return the priority of particles of the given type when the particle
+ * budget is exceeded. Particles of lower priority are culled first.
+ */
+inline unsigned int particle_priority(ParticleType type)
 {
-public:
-    static constexpr size_t chunk_size = _chunk_size;
-    typedef _Particle Particle;
+    switch (type) {
+    case ParticleType::FIRE:
+    {
+        // heats the cells and ignites objects
+        return 1;
+    }
+    case ParticleType::FIRE_SECONDARY:
+    {
+        return 0;
+    }
+    }
+    return 0;
+}
+
+/**
+ * A single particle, as passed to ParticleSystem::spawn() and set() and
+ * returned by ParticleSystem::get(). The particle system itself keeps each field in a
+ * separate array.
+ */
+struct PhysicsParticle
+{
+    float age;
+    float lifetime;
+    float x, y;
+    float vx, vy;
+    float ax, ay;
+
+    float phi;
+    float vphi;
+    float aphi;
 
-    typedef std::list<Particle*> container_type;
-    typedef typename container_type::iterator iterator;
-    typedef typename container_type::const_iterator const_iterator;
+    uint32_t ctr;
+
+    ParticleType type;
+};
+
+/**
+ * The indices [first, first + count) of the particles reserved by
+ * ParticleSystem::reserve().
+ */
+struct ParticleSlots
+{
+    size_t first;
+    size_t count;
+};
+
+class GameObject;
+class Level;
+class WorkerPool;
 
+/**
+ * The particles of a level, stored as a structure of arrays.
+ *
+ * The active particles occupy the indices [0, active_size()) of the field
+ * arrays. When a particle dies, the last particle is moved into its place,
+ * so indices are only stable until the next update(). The arrays are padded
+ * to a multiple of four elements, which allows the integrator to process
+ * four particles at a time without handling a remainder.
+ *
+ * The behaviour of the particles is updated in chunks of chunk_size
+ * particles, which may run on a WorkerPool. Each chunk draws from its own
+ * random engine and collects what its particles spawn, deposit and ignite;
+ * these effects are applied in chunk order once all chunks are done. As
+ * the chunks do not depend on the pool, neither does the result.
+ *
+ * The number of particles is bounded by a budget, see set_budget(). The
+ * arrays grow by doubling; once few particles have been active for
+ * shrink_delay updates, they are reallocated with a smaller capacity, so
+ * that the memory of a large burst is released again.
+ */
+class ParticleSystem
+{
+public:
+    explicit ParticleSystem(Level &level);
+    ParticleSystem(const ParticleSystem &ref) = delete;
+    ParticleSystem &operator=(const ParticleSystem &ref) = delete;
 
 public:
-    GenericParticleSystem() = default;
-    GenericParticleSystem(const GenericParticleSystem &ref) = delete;
-    GenericParticleSystem &operator=(const GenericParticleSystem &ref) = delete;
-    GenericParticleSystem(GenericParticleSystem &&ref) = default;
-    GenericParticleSystem &operator=(GenericParticleSystem &&ref) = default;
+    static constexpr size_t chunk_size = 2048;
+    static constexpr size_t default_budget = 131072;
+    static constexpr size_t min_capacity = 1024;
+    static constexpr unsigned int shrink_delay = 500;
+
+    /**
+     * Memory used by the arrays per particle of capacity.
+     */
+    static constexpr size_t particle_footprint =
+        11*sizeof(float) + sizeof(uint32_t) + sizeof(ParticleType);
 
 private:
-    typedef std::array<Particle, chunk_size> Chunk;
+    /* a particle deposits into at most one cell, so half of the slots
+     * stay free and probes stay short */
+    static constexpr size_t deposit_slot_count = 2*chunk_size;
 
-    std::vector<std::unique_ptr<Chunk>> _storage;
+    struct ChunkEffects {
+        std::vector<PhysicsParticle> spawned;
+        /* at most one per cell, see deposit() */
+        std::vector<PhysicsDeposit> deposits;
+        /* open addressing table over the cells of the deposits, holding
+         * the index of the deposit plus one, or zero if free */
+        std::vector<uint16_t> deposit_slots;
+        std::vector<GameObject*> ignited;
+        uint64_t throttled;
+    };
 
-protected:
-    std::forward_list<Particle*> _available;
-    container_type _active;
+private:
+    Level &_level;
+    PCG32 _rng;
 
-protected:
-    inline Particle *allocate()
-    {
-        if (_available.empty()) {
-            grow();
-        }
-        Particle *result = _available.front();
-        _available.pop_front();
-        return result;
-    }
+    size_t _size;
+    size_t _capacity;
+
+    std::vector<float> _age, _lifetime;
+    std::vector<float> _x, _y, _phi;
+    std::vector<float> _vx, _vy, _vphi;
+    std::vector<float> _ax, _ay, _aphi;
+    std::vector<uint32_t> _ctr;
+    std::vector<ParticleType> _type;
+
+    WorkerPool *_workers;
+    std::vector<ChunkEffects> _chunk_effects;
+
+    size_t _budget;
+    uint64_t _culled;
+    uint64_t _throttled;
+    std::vector<uint32_t> _cull_order;
+
+    unsigned int _low_updates;
+    size_t _peak_capacity;
+
+private:
+    /**
+     * Grow the arrays to hold *needed* particles, or as many as
+     * max_capacity() allows.
+     */
+    void grow(size_t needed);
 
-    void grow()
+    /**
+     * Reallocate the arrays (and the scratch buffers) to hold *capacity*
+     * particles.
+     */
+    void reallocate(size_t capacity);
+
+    /**
+     * Shrink the arrays once at most a quarter of them has been used for
+     * shrink_delay updates in a row.
+     */
+    void release_unused();
+    void remove(size_t i);
+
+    /**
+     * Advance the age of all particles and remove those which exceeded
+     * their lifetime.
+     */
+    void age_particles(float deltaT);
+
+    /**
+     * Advance the position and the rotation of all particles.
+     */
+    void integrate(float deltaT);
+
+    /**
+     * Remove the particles exceeding the budget: those of the lowest
+     * priority first and, within a priority, the oldest first.
+     */
+    void cull();
+
+    /**
+     * Number of particles the arrays may hold: the budget plus some room
+     * for the particles spawned between two updates.
+     */
+    size_t max_capacity() const;
+
+    /**
+     * Add *item* to the deposits of the chunk, merging it with an earlier
+     * deposit into the same cell.
+     */
+    void deposit(ChunkEffects &effects, const PhysicsDeposit &item);
+
+    void update_chunk(size_t chunk,
+                      uint64_t seed,
+                      float spawn_rate,
+                      const PhysicsSnapshot &view);
+
+public:
+    /**
+     * The engine used for the randomness in particle updates. It is
+     * separate from the engine of the level, so that the amount of
+     * particles does not influence the rest of the game.
+     */
+    inline PCG32 &rng()
     {
-        Chunk *new_chunk = new Chunk();
-        for (auto &item: *new_chunk) {
-            _available.push_front(&item);
-        }
-        _storage.push_back(std::unique_ptr<Chunk>(new_chunk));
+        return _rng;
     }
 
-    inline void release(Particle *part)
+    /**
+     * Update the chunks on the workers of *pool*, or serially if it is
+     * nullptr. The pool is not owned by the particle system.
+     */
+    inline void set_workers(WorkerPool *pool)
     {
-        _available.push_front(part);
+        _workers = pool;
     }
 
-public:
-    inline typename container_type::size_type active_size()
+    inline size_t active_size() const
     {
-        return _active.size();
+        return _size;
     }
 
-    inline iterator begin()
+    inline size_t budget() const
     {
-        return _active.begin();
+        return _budget;
     }
 
-    inline const_iterator cbegin()
+    /**
+     * Limit the number of particles to *budget*.
+     *
+     * Once more than half of the budget is used, particles spawn fewer
+     * secondary particles, down to none when the budget is reached.
+     * update() culls the particles exceeding the budget, and spawn() drops
+     * particles which do not fit into max_capacity(), which bounds the
+     * memory used and the time spent per update.
+     */
+    void set_budget(size_t budget);
+
+    /**
+     * Number of particles which have been culled or dropped because of
+     * the budget so far.
+     */
+    inline uint64_t culled() const
     {
-        return _active.cbegin();
+        return _culled;
     }
 
-    void clear()
+    /**
+     * Memory currently used by the particle arrays, in bytes.
+     */
+    inline size_t footprint() const
     {
-        _active.clear();
-        _available.clear();
-        for (auto &chunk: _storage) {
-            for (auto &item: *chunk) {
-                _available.push_front(&item);
-            }
-        }
+        return _capacity * particle_footprint;
     }
 
-    inline const_iterator cend()
+    inline size_t peak_footprint() const
     {
-        return _active.cend();
+        return _peak_capacity * particle_footprint;
     }
 
-    inline iterator end()
+    /**
+     * Number of secondary particles which have not been spawned because
+     * of the budget so far.
+     */
+    inline uint64_t throttled() const
     {
-        return _active.end();
+        return _throttled;
     }
 
-};
-
-enum class ParticleType {
-    FIRE,
-    FIRE_SECONDARY
-};
-
-struct PhysicsParticle
-{
-    bool alive;
-    float age;
-    float lifetime;
-    float x, y;
-    float vx, vy;
-    float ax, ay;
+    PhysicsParticle get(size_t i) const;
 
-    float phi;
-    float vphi;
-    float aphi;
+    /**
+     * Overwrite the particle at index *i* with *part*.
+     */
+    inline void set(size_t i, const PhysicsParticle &part)
+    {
+        _age[i] = part.age;
+        _lifetime[i] = part.lifetime;
+        _x[i] = part.x;
+        _y[i] = part.y;
+        _phi[i] = part.phi;
+        _vx[i] = part.vx;
+        _vy[i] = part.vy;
+        _vphi[i] = part.vphi;
+        _ax[i] = part.ax;
+        _ay[i] = part.ay;
+        _aphi[i] = part.aphi;
+        _ctr[i] = part.ctr;
+        _type[i] = part.type;
+    }
 
-    uint32_t ctr;
+    void clear();
 
-    ParticleType type;
-};
+    /**
+     * Replace the active particles with copies of *parts*, in that order.
+     */
+    void assign_active(const std::vector<PhysicsParticle> &parts);
 
-class Level;
+    /**
+     * Copy the active particles, in index order, into *dest*.
+     */
+    void copy_active(std::vector<PhysicsParticle> &dest) const;
 
-class ParticleSystem: public GenericParticleSystem<PhysicsParticle, 1024>
-{
-public:
-    explicit ParticleSystem(Level &level);
+    /**
+     * Add a copy of *part*. Particles spawned during update() are first
+     * moved by the next update(). If the arrays are full, the particle is
+     * dropped and counted as culled.
+     */
+    void spawn(const PhysicsParticle &part);
 
-public:
-    typedef std::function<void(Particle*)> Generator;
+    /**
+     * Add *count* particles at the end of the active particles, growing
+     * the arrays at most once, and return their indices. The particles
+     * have undefined contents and must be written with set() before
+     * anything else accesses them.
+     *
+     * Fewer slots are returned if the arrays are full; the remaining
+     * particles are counted as culled, like in spawn().
+     */
+    ParticleSlots reserve(size_t count);
 
-private:
-    Level &_level;
+    /**
+     * Spawn *count* particles with a single reserve(). *emitter* is called
+     * as emitter(j, part) for each j in [0, count) and has to set all
+     * fields of the PhysicsParticle *part*.
+     *
+     * The emitter is called for all particles, including those dropped
+     * because the arrays are full, so that any randomness it draws does
+     * not depend on the budget. Return the number of particles spawned.
+     */
+    template <typename Emitter>
+    size_t emit(size_t count, Emitter &&emitter)
+    {
+        const ParticleSlots slots = reserve(count);
+        PhysicsParticle part;
+        for (size_t j = 0; j < count; j++) {
+            emitter(j, part);
+            if (j < slots.count) {
+                set(slots.first + j, part);
+            }
+        }
+        return slots.count;
+    }
 
-public:
-    Particle *spawn();
-    void spawn_generator(size_t n, const Generator &generator);
     void update(PyEngine::TimeFloat deltaT);
 
 };
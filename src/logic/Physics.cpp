@@ -24,14 +24,18 @@ authors named in the AUTHORS file.
 **********************************************************************/
 #include "Physics.hpp"
 
+#include <algorithm>
 #include <cstdio>
 #include <cmath>
 #include <cassert>
 #include <cstring>
 
+#include <emmintrin.h>
+
 #include <glew.h>
 
 #include "GameObject.hpp"
+#include "PhysicsColourMap.hpp"
 
 using namespace PyEngine;
 
@@ -59,11 +63,14 @@ Automaton::Automaton(
         double initial_pressure,
         double initial_temperature):
     _resumed(false),
+    _epoch(0),
     _width(width),
     _height(height),
     _metadata(new CellMetadata[width*height]()),
     _cells(new Cell[width*height]()),
     _backbuffer(new Cell[width*height]()),
+    _fog(new FogDensity[width*height]()),
+    _fog_backbuffer(new FogDensity[width*height]()),
     _config(config),
     _thread_count(mp?(get_hardware_thread_count()):1),
     _finished_signal(),
@@ -71,6 +78,13 @@ Automaton::Automaton(
     _forward_signals(_thread_count),
     _shared_zones(_thread_count),
     _threads(_thread_count),
+    _impulses(),
+    _step_impulses(),
+    _deposits(1),
+    _step_deposits(1),
+    _collision(width, height),
+    _collision_pending(false),
+    _collision_signal(),
     _rgba_buffer(0)
 {
     for (CoordInt y = 0; y < _height; y++) {
@@ -109,7 +123,6 @@ void Automaton::init_cell(Cell *buffer, CoordInt x, CoordInt y,
         airtempcoeff_per_pressure * cell->air_pressure);
     cell->flow[0] = 0;
     cell->flow[1] = 0;
-    cell->fog = 0;
 }
 
 void Automaton::init_threads()
@@ -190,13 +203,18 @@ void Automaton::clear_cells(
         CellMetadata *const curr_meta = meta_at(x, y);
         init_cell(_cells, x, y, 0, 0);
         init_cell(_backbuffer, x, y, 0, 0);
+        clear_fog(x, y);
         curr_meta->blocked = false;
     }
+    _collision.invalidate(dx, dy,
+                          dx + subdivision_count - 1,
+                          dy + subdivision_count - 1);
 }
 
 void Automaton::apply_temperature_stamp(const CoordInt x, const CoordInt y,
     const Stamp &stamp, const double temperature)
 {
+    assert(!_resumed);
     uintptr_t stamp_cells_len = 0;
     const CoordPair *cell_coord = stamp.get_map_coords(&stamp_cells_len);
     cell_coord--;
@@ -244,7 +262,7 @@ void Automaton::move_stamp(
 {
     assert(!_resumed);
 
-    static CellInfo cells[cell_stamp_length];
+    CellInfo cells[cell_stamp_length];
 
     uintptr_t write_index = 0;
 
@@ -268,13 +286,18 @@ void Automaton::move_stamp(
         CellInfo *dst = &cells[write_index];
         memcpy(&dst->offs, stamp_cells, sizeof(CoordPair));
         memcpy(&dst->phys, cell, sizeof(Cell));
+        dst->fog = fog_to_double(*fog_at(x, y));
         memcpy(&dst->meta, meta, sizeof(CellMetadata));
         write_index++;
         init_cell(_cells, x, y, 0, 0);
         init_cell(_backbuffer, x, y, 0, 0);
+        clear_fog(x, y);
         meta->blocked = false;
         meta->obj = 0;
     }
+    _collision.invalidate(oldx, oldy,
+                          oldx + subdivision_count - 1,
+                          oldy + subdivision_count - 1);
 
     place_stamp(newx, newy, cells, write_index, vel);
 }
@@ -286,7 +309,7 @@ void Automaton::place_object(
 {
     assert(!_resumed);
 
-    static CellInfo cells[cell_stamp_length];
+    CellInfo cells[cell_stamp_length];
 
     uintptr_t stamp_cells_len = 0;
     const CoordPair *stamp_cells = obj->info.stamp.get_map_coords(
@@ -301,6 +324,7 @@ void Automaton::place_object(
         dst->phys.heat_energy = heat_energy;
         dst->phys.flow[0] = dst->offs.x - ((float)subdivision_count / 2);
         dst->phys.flow[1] = dst->offs.y - ((float)subdivision_count / 2);
+        dst->fog = 0;
         dst->meta.blocked = true;
         dst->meta.obj = obj;
     }
@@ -319,13 +343,14 @@ void Automaton::place_stamp(const CoordInt atx, const CoordInt aty,
         {-1, 0}, {1, 0}, {0, -1}, {0, 1}
     };
 
-    // buffers to keep temporary data. we keep them in a static variable.
-    // XXX: This will break for more than one Automaton instance!
-    const intptr_t index_row_length = subdivision_count+2;
-    const intptr_t index_length = index_row_length * index_row_length;
-    static intptr_t border_indicies[index_length];
-    static Cell *border_cells[index_length];
-    static double border_cell_weights[index_length];
+    // buffers to keep temporary data. they are small enough for the stack,
+    // which allows stamps in disjoint regions to be placed concurrently.
+    constexpr intptr_t index_row_length = subdivision_count+2;
+    constexpr intptr_t index_length = index_row_length * index_row_length;
+    intptr_t border_indicies[index_length];
+    Cell *border_cells[index_length];
+    FogDensity *border_fog[index_length];
+    double border_cell_weights[index_length];
 
     intptr_t border_cell_write_index = 0;
     intptr_t border_cell_count = 0;
@@ -333,6 +358,7 @@ void Automaton::place_stamp(const CoordInt atx, const CoordInt aty,
 
     memset(border_indicies, -1, index_length * sizeof(intptr_t));
     memset(border_cells, 0, index_length * sizeof(Cell*));
+    memset(border_fog, 0, index_length * sizeof(FogDensity*));
 
     // collect surplus matter here
     double air_to_distribute = 0.;
@@ -356,14 +382,16 @@ void Automaton::place_stamp(const CoordInt atx, const CoordInt aty,
             continue;
         }
         CellMetadata *const curr_meta = meta_at(x, y);
+        FogDensity *const curr_fog = fog_at(x, y);
         assert(!curr_meta->blocked);
 
         if (!curr_meta->blocked) {
             air_to_distribute += curr_cell->air_pressure;
             heat_to_distribute += curr_cell->heat_energy;
-            fog_to_distribute += curr_cell->fog;
+            fog_to_distribute += fog_to_double(*curr_fog);
         }
         memcpy(curr_cell, &cells[i].phys, sizeof(Cell));
+        *curr_fog = fog_from_double(cells[i].fog);
         memcpy(curr_meta, &cells[i].meta, sizeof(CellMetadata));
 
         for (uintptr_t j = 0; j < 4; j++) {
@@ -404,6 +432,7 @@ void Automaton::place_stamp(const CoordInt atx, const CoordInt aty,
 
             border_indicies[index_cell] = border_cell_write_index;
             border_cells[border_cell_write_index] = neigh_cell;
+            border_fog[border_cell_write_index] = fog_at(nx, ny);
             border_cell_weights[border_cell_write_index] = cell_weight;
             assert(border_cell_write_index < index_length);
             border_cell_write_index++;
@@ -421,6 +450,9 @@ void Automaton::place_stamp(const CoordInt atx, const CoordInt aty,
 
         assert(!isnan(curr_cell->heat_energy));
     }
+    _collision.invalidate(atx, aty,
+                          atx + subdivision_count - 1,
+                          aty + subdivision_count - 1);
 
     if (air_to_distribute == 0 && fog_to_distribute == 0)
         return;
@@ -444,9 +476,11 @@ void Automaton::place_stamp(const CoordInt atx, const CoordInt aty,
             continue;
         }
         const double cell_weight = (border_cell_weight > 0 ? *neigh_cell_weight : 1);
+        FogDensity *const neigh_fog = border_fog[neigh_cell - &border_cells[0]];
         (*neigh_cell)->air_pressure += air_per_cell * cell_weight;
         (*neigh_cell)->heat_energy += heat_per_cell * cell_weight;
-        (*neigh_cell)->fog += fog_per_cell * cell_weight;
+        *neigh_fog = fog_add_saturated(
+            *neigh_fog, fog_from_double(fog_per_cell * cell_weight));
 
         assert(!isnan((*neigh_cell)->heat_energy));
         j++;
@@ -454,8 +488,38 @@ void Automaton::place_stamp(const CoordInt atx, const CoordInt aty,
     }
 }
 
+void Automaton::push_impulse(const PhysicsImpulse &impulse)
+{
+    PhysicsImpulse clipped = impulse;
+    clipped.x0 = std::max(clipped.x0, CoordInt(0));
+    clipped.y0 = std::max(clipped.y0, CoordInt(0));
+    clipped.x1 = std::min(clipped.x1, _width - 1);
+    clipped.y1 = std::min(clipped.y1, _height - 1);
+    if (clipped.x0 > clipped.x1 || clipped.y0 > clipped.y1) {
+        return;
+    }
+    _impulses.push_back(clipped);
+}
+
+void Automaton::set_deposit_producers(unsigned int count)
+{
+    assert(!_resumed);
+    assert(count > 0);
+    _deposits.resize(count);
+    _step_deposits.resize(count);
+    for (auto &deposits: _deposits) {
+        deposits.clear();
+    }
+}
+
 void Automaton::resume()
 {
+    // the workers only read the impulses of their step, so further
+    // impulses can be pushed into the other vector meanwhile
+    assert(_step_impulses.empty());
+    _step_impulses.swap(_impulses);
+    _step_deposits.swap(_deposits);
+    _collision_pending = true;
     for (auto &sem: _resume_signals) {
         sem.post();
     }
@@ -466,57 +530,104 @@ void Automaton::set_blocked(CoordInt x, CoordInt y, bool blocked)
 {
     assert(!_resumed);
     _metadata[x+_width*y].blocked = blocked;
+    _collision.invalidate(x, y, x, y);
+}
+
+void Automaton::wait_for_collision()
+{
+    if (!_collision_pending)
+        return;
+    for (unsigned int i = 0; i < _thread_count; i++) {
+        _collision_signal.wait();
+    }
+    _collision_pending = false;
 }
 
 void Automaton::wait_for()
 {
     if (!_resumed)
         return;
+    wait_for_collision();
     for (unsigned int i = 0; i < _thread_count; i++) {
         _finished_signal.wait();
     }
     _resumed = false;
+    _step_impulses.clear();
+    for (auto &deposits: _step_deposits) {
+        deposits.clear();
+    }
     Cell *tmp = _backbuffer;
     _backbuffer = _cells;
     _cells = tmp;
+    FogDensity *fog_tmp = _fog_backbuffer;
+    _fog_backbuffer = _fog;
+    _fog = fog_tmp;
+    _epoch += 1;
+}
+
+void Automaton::restore(TickCounter epoch,
+                        const Cell *cells,
+                        const FogDensity *fog)
+{
+    assert(!_resumed);
+    // only the current buffers have to be written: a step initializes
+    // the other buffer from them before using it
+    const size_t count = _width*_height;
+    memcpy(_cells, cells, count * sizeof(Cell));
+    memcpy(_fog, fog, count * sizeof(FogDensity));
+    _epoch = epoch;
+    _impulses.clear();
+    for (auto &deposits: _deposits) {
+        deposits.clear();
+    }
+}
+
+PhysicsSnapshot Automaton::snapshot() const
+{
+    // While resumed, _cells is the buffer the workers read from; they
+    // never write to it. When stopped, it holds the completed state.
+    return PhysicsSnapshot{_epoch, _width, _height, _cells, _fog, _metadata,
+                           (_collision_pending
+                            ? nullptr
+                            : _collision.cells())};
 }
 
 void Automaton::to_gl_texture(
     const double min, const double max,
-    bool thread_regions)
+    bool thread_regions,
+    WorkerPool *pool)
 {
     if (!_rgba_buffer) {
         _rgba_buffer = (uint32_t*)malloc(_width*_height*4);
     }
 
+    const PhysicsSnapshot view = snapshot();
     const CoordInt half = _width / 2;
 
-    uint32_t *target = _rgba_buffer;
-    Cell *source = _backbuffer;
-    CellMetadata *meta_source = _metadata;
-    for (CoordInt i = 0; i < _width*_height; i++) {
-        if (meta_source->blocked) {
-            *target = 0x0000FF;
-        } else {
-            const bool right = (i % _height) >= half;
-            const unsigned char press_color = (unsigned char)(clamp((source->air_pressure - min) / (max - min), 0.0, 1.0) * 255.0);
-            // const double temperature = (meta_source->blocked ? source->heat_energy / meta_source->obj->info.temp_coefficient : source->heat_energy / (source->air_pressure * airtempcoeff_per_pressure));
-            const double fog = (meta_source->blocked ? 0 : source->fog);
-            // const unsigned char temp_color = (unsigned char)(clamp((temperature - min) / (max - min), 0.0, 1.0) * 255.0);
-            const unsigned char fog_color = (unsigned char)(clamp((fog - min) / (max - min), 0.0, 1.0) *255.0);
-            const unsigned char b = (right ? fog_color : press_color);
-            const unsigned char r = b;
-            if (thread_regions) {
-                const unsigned char g = (unsigned char)((double)(int)(((double)(i / _width)) / _height * _thread_count) / _thread_count * 255.0);
-                //const unsigned char b = (unsigned char)(clamp((source->flow[1] - min) / (max - min), -1.0, 1.0) * 127.0 + 127.0);
-                *target = r | (g << 8) | (r << 16);
-            } else {
-                *target = r | (b << 8) | (b << 16);
+    // left half shows the air pressure, right half the fog density
+    PhysicsColourMap pressure_map(
+        PhysicsPlane::AIR_PRESSURE, min, max, greyscale_palette());
+    PhysicsColourMap fog_map(
+        PhysicsPlane::FOG_DENSITY, min, max, greyscale_palette());
+
+    pressure_map.map(view, 0, 0, half, _height,
+                     _rgba_buffer, _width, pool);
+    fog_map.map(view, half, 0, _width, _height,
+                &_rgba_buffer[half], _width, pool);
+
+    if (thread_regions) {
+        uint32_t *target = _rgba_buffer;
+        const CellMetadata *meta_source = view.metadata;
+        for (CoordInt y = 0; y < _height; y++) {
+            const uint32_t g = (uint32_t)((double)(int)(((double)y) / _height * _thread_count) / _thread_count * 255.0);
+            for (CoordInt x = 0; x < _width; x++) {
+                if (!meta_source->blocked) {
+                    *target = (*target & 0xffff00ff) | (g << 8);
+                }
+                target++;
+                meta_source++;
             }
         }
-        target++;
-        source++;
-        meta_source++;
     }
 
     glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, _width, _height, GL_RGBA, GL_UNSIGNED_BYTE, (const GLvoid*)_rgba_buffer);
@@ -548,7 +659,14 @@ AutomatonThread::AutomatonThread(
     _sim(dataclass._config),
     _backbuffer(dataclass._backbuffer),
     _cells(dataclass._cells),
+    _fog_backbuffer(dataclass._fog_backbuffer),
+    _fog(dataclass._fog),
     _metadata(dataclass._metadata),
+    _fog_open(_width),
+    _fog_open_above(_width),
+    _fog_flow_pos(_width+1),
+    _fog_flow_neg(_width+1),
+    _row_activated(slice_y1 - slice_y0 + 1, 0),
     _terminated(false),
     _thread(&AutomatonThread::execute, this)
 {
@@ -562,7 +680,7 @@ AutomatonThread::~AutomatonThread()
     _thread.join();
 }
 
-inline void AutomatonThread::activate_cell(Cell *front, Cell *back)
+inline void AutomatonThread::activate_cell(Cell *front, const Cell *back)
 {
     //~ if (back->air_pressure <= 1e-100 && back->air_pressure != 0) {
         //~ front->air_pressure = 0;
@@ -575,20 +693,20 @@ inline void AutomatonThread::activate_cell(Cell *front, Cell *back)
         //~ front->heat_energy = 0;
     //~ } else {
     front->air_pressure = back->air_pressure;
+    // the back buffer must not be written to, as it is published as
+    // snapshot while we are running; flow() takes the sanitized old flow
+    // from the front buffer instead.
     for (int i = 0; i < 2; i++) {
         const double flow = back->flow[i];
         if (!isinf(flow) && abs(flow) < 1e10) {
             front->flow[i] = flow;
         } else {
             front->flow[i] = 0;
-            back->flow[i] = 0;
         }
     }
     front->heat_energy = back->heat_energy;
-    front->fog = back->fog;
     //~ }
     assert(!isnan(back->air_pressure));
-    assert(!isnan(back->fog));
     assert(!isnan(back->heat_energy));
 }
 
@@ -609,7 +727,8 @@ inline double AutomatonThread::flow(const Cell *b_cellA, Cell *f_cellA,
     const double dtemp = (direction == 1 ? b_cellA->heat_energy - b_cellB->heat_energy : 0);
     const double temp_flow = (dtemp > 0 ? dtemp * _sim.convection_friction : 0);
     const double press_flow = dpressure * _sim.flow_friction;
-    const double old_flow = b_cellA->flow[direction];
+    // activate_cell() has already copied (and sanitized) the old flow
+    const double old_flow = f_cellA->flow[direction];
 
     const double tcA = b_cellA->air_pressure;
     const double tcB = b_cellB->air_pressure;
@@ -645,12 +764,6 @@ inline double AutomatonThread::flow(const Cell *b_cellA, Cell *f_cellA,
     f_cellA->heat_energy -= energy_flow;
     f_cellB->heat_energy += energy_flow;
 
-    const double fog_flow = (applicable_flow > 0 ? b_cellA->fog / tcA * tc_flow : b_cellB->fog / tcB * tc_flow);
-    assert(!isnan(fog_flow));
-
-    f_cellA->fog -= fog_flow;
-    f_cellB->fog += fog_flow;
-
     return applicable_flow;
 }
 
@@ -697,31 +810,269 @@ inline void AutomatonThread::temperature_flow(
     }
 }
 
-inline void AutomatonThread::fog_flow(
-    const Cell *b_cellA, Cell *f_cellA,
-    const Cell *b_cellB, Cell *f_cellB)
+inline void AutomatonThread::advect_fog(
+    const double applicable_flow,
+    const Cell *b_cellA, const FogDensity *b_fogA, FogDensity *f_fogA,
+    const Cell *b_cellB, const FogDensity *b_fogB, FogDensity *f_fogB)
 {
-    const double dfog = b_cellA->fog - b_cellB->fog;
-    const double flow = dfog * _sim.fog_flow_friction;
-    double applicable_flow = clamp(
-        flow,
-        -b_cellB->fog / 4.,
-        b_cellA->fog / 4.
-    );
+    // the fog moves along with the air; as flow() never moves more than
+    // a quarter of the air of a cell, this cannot underflow the donor.
+    if (applicable_flow > 0) {
+        const FogDensity moved = FogDensity(
+            *b_fogA * (applicable_flow / b_cellA->air_pressure));
+        *f_fogA = fog_sub_saturated(*f_fogA, moved);
+        *f_fogB = fog_add_saturated(*f_fogB, moved);
+    } else if (applicable_flow < 0) {
+        const FogDensity moved = FogDensity(
+            *b_fogB * (-applicable_flow / b_cellB->air_pressure));
+        *f_fogB = fog_sub_saturated(*f_fogB, moved);
+        *f_fogA = fog_add_saturated(*f_fogA, moved);
+    }
+}
 
-    f_cellA->fog -= applicable_flow;
-    f_cellB->fog += applicable_flow;
+inline void AutomatonThread::activate_fog_row(CoordInt y)
+{
+    memcpy(&_fog[y*_width], &_fog_backbuffer[y*_width],
+           _width * sizeof(FogDensity));
+}
+
+void AutomatonThread::activate_row(CoordInt y)
+{
+    uint8_t &activated = _row_activated[y - _slice_y0];
+    if (activated) {
+        return;
+    }
+    activated = 1;
+
+    Cell *const front = &_cells[y*_width];
+    const Cell *const back = &_backbuffer[y*_width];
+    for (CoordInt x = 0; x < _width; x++) {
+        activate_cell(&front[x], &back[x]);
+    }
+    activate_fog_row(y);
+}
+
+inline void AutomatonThread::deposit(
+    CoordInt index,
+    double pressure,
+    double temperature,
+    FogDensity fog)
+{
+    const CellMetadata *const meta = &_metadata[index];
+    Cell *const cell = &_cells[index];
+    if (meta->blocked) {
+        cell->heat_energy += temperature * meta->obj->info.temp_coefficient;
+    } else {
+        cell->air_pressure += pressure;
+        cell->heat_energy += temperature *
+            airtempcoeff_per_pressure * cell->air_pressure;
+        _fog[index] = fog_add_saturated(_fog[index], fog);
+    }
+}
+
+void AutomatonThread::apply_impulses()
+{
+    for (const PhysicsImpulse &impulse: _dataclass._step_impulses) {
+        const CoordInt y0 = std::max(impulse.y0, _slice_y0);
+        const CoordInt y1 = std::min(impulse.y1, _slice_y1);
+        for (CoordInt y = y0; y <= y1; y++) {
+            activate_row(y);
+            for (CoordInt x = impulse.x0; x <= impulse.x1; x++) {
+                deposit(x + _width*y,
+                        impulse.pressure, impulse.temperature, impulse.fog);
+            }
+        }
+    }
+}
+
+void AutomatonThread::apply_deposits()
+{
+    for (const auto &deposits: _dataclass._step_deposits) {
+        for (const PhysicsDeposit &item: deposits) {
+            if (item.y < _slice_y0 || item.y > _slice_y1) {
+                continue;
+            }
+            activate_row(item.y);
+            deposit(item.x + _width*item.y, 0, item.temperature, item.fog);
+        }
+    }
+}
+
+static inline __m128i min_epu16(const __m128i a, const __m128i b)
+{
+    return _mm_sub_epi16(a, _mm_subs_epu16(a, b));
+}
+
+/**
+ * Calculate the diffusion between two vectors of fog cells *a* and *b*.
+ * *pos* receives the amount moving from a to b, *neg* the amount moving
+ * from b to a. Pairs where *open* is zero do not exchange anything.
+ */
+static inline void fog_exchange(
+    const __m128i a, const __m128i b,
+    const __m128i open, const __m128i friction,
+    __m128i &pos, __m128i &neg)
+{
+    pos = _mm_mulhi_epu16(_mm_subs_epu16(a, b), friction);
+    neg = _mm_mulhi_epu16(_mm_subs_epu16(b, a), friction);
+    // never move more than a quarter of the donor, as with the air flow
+    pos = _mm_and_si128(min_epu16(pos, _mm_srli_epi16(a, 2)), open);
+    neg = _mm_and_si128(min_epu16(neg, _mm_srli_epi16(b, 2)), open);
+}
+
+static inline __m128i load_fog(const uint16_t *src)
+{
+    return _mm_loadu_si128((const __m128i*)src);
+}
+
+static inline void store_fog(uint16_t *dest, const __m128i value)
+{
+    _mm_storeu_si128((__m128i*)dest, value);
+}
+
+/* the tails of the rows use lane 0 of the vector code, so that the results
+ * do not depend on the position of a cell in the row */
+static inline __m128i load_fog_single(const uint16_t *src)
+{
+    return _mm_cvtsi32_si128(*src);
+}
+
+static inline void store_fog_single(uint16_t *dest, const __m128i value)
+{
+    *dest = _mm_extract_epi16(value, 0);
 }
 
-inline void AutomatonThread::update_cell(CoordInt x, CoordInt y, bool activate)
+void AutomatonThread::fog_flow_row(CoordInt y)
+{
+    static constexpr CoordInt lanes = 8;
+
+    const __m128i friction = _mm_set1_epi16(
+        (int16_t)(uint16_t)std::min(_sim.fog_flow_friction * 65536., 65535.));
+
+    const CellMetadata *meta = &_metadata[y*_width];
+    uint16_t *const open = _fog_open.data();
+    for (CoordInt x = 0; x < _width; x++) {
+        open[x] = (meta[x].blocked ? 0 : 0xffff);
+    }
+    uint16_t *const open_above = _fog_open_above.data();
+    if (y > 0) {
+        meta -= _width;
+        for (CoordInt x = 0; x < _width; x++) {
+            open_above[x] = (meta[x].blocked ? 0 : 0xffff);
+        }
+    }
+
+    const FogDensity *const back = &_fog_backbuffer[y*_width];
+    FogDensity *const front = &_fog[y*_width];
+    uint16_t *const hpos = _fog_flow_pos.data();
+    uint16_t *const hneg = _fog_flow_neg.data();
+
+    // horizontal exchange between x-1 and x, stored at index x
+    hpos[0] = hneg[0] = 0;
+    hpos[_width] = hneg[_width] = 0;
+    {
+        CoordInt x = 1;
+        __m128i pos, neg;
+        for (; x + lanes <= _width; x += lanes) {
+            fog_exchange(
+                load_fog(&back[x]), load_fog(&back[x-1]),
+                _mm_and_si128(load_fog(&open[x]), load_fog(&open[x-1])),
+                friction, pos, neg);
+            store_fog(&hpos[x], pos);
+            store_fog(&hneg[x], neg);
+        }
+        for (; x < _width; x++) {
+            fog_exchange(
+                load_fog_single(&back[x]), load_fog_single(&back[x-1]),
+                _mm_and_si128(load_fog_single(&open[x]),
+                              load_fog_single(&open[x-1])),
+                friction, pos, neg);
+            store_fog_single(&hpos[x], pos);
+            store_fog_single(&hneg[x], neg);
+        }
+    }
+
+    const FogDensity *const back_above = back - _width;
+    FogDensity *const front_above = front - _width;
+
+    // self gains: hneg[x] + hpos[x+1] (+ vneg)
+    // self loses: hpos[x] + hneg[x+1] (+ vpos)
+    auto apply = [&](const __m128i self_back,
+                     const __m128i self_front,
+                     const __m128i hpos_self,
+                     const __m128i hneg_self,
+                     const __m128i hpos_right,
+                     const __m128i hneg_right,
+                     const __m128i above_back,
+                     const __m128i above_front,
+                     const __m128i vopen,
+                     __m128i &new_self,
+                     __m128i &new_above)
+    {
+        __m128i gain = _mm_adds_epu16(hneg_self, hpos_right);
+        __m128i loss = _mm_adds_epu16(hpos_self, hneg_right);
+        if (y > 0) {
+            __m128i vpos, vneg;
+            fog_exchange(self_back, above_back, vopen, friction, vpos, vneg);
+            gain = _mm_adds_epu16(gain, vneg);
+            loss = _mm_adds_epu16(loss, vpos);
+            new_above = _mm_subs_epu16(_mm_adds_epu16(above_front, vpos),
+                                       vneg);
+        }
+        new_self = _mm_subs_epu16(_mm_adds_epu16(self_front, gain), loss);
+    };
+
+    const __m128i zero = _mm_setzero_si128();
+
+    CoordInt x = 0;
+    for (; x + lanes <= _width; x += lanes) {
+        __m128i new_self, new_above;
+        apply(load_fog(&back[x]), load_fog(&front[x]),
+              load_fog(&hpos[x]), load_fog(&hneg[x]),
+              load_fog(&hpos[x+1]), load_fog(&hneg[x+1]),
+              (y > 0 ? load_fog(&back_above[x]) : zero),
+              (y > 0 ? load_fog(&front_above[x]) : zero),
+              (y > 0
+               ? _mm_and_si128(load_fog(&open[x]), load_fog(&open_above[x]))
+               : zero),
+              new_self, new_above);
+        store_fog(&front[x], new_self);
+        if (y > 0) {
+            store_fog(&front_above[x], new_above);
+        }
+    }
+    for (; x < _width; x++) {
+        __m128i new_self, new_above;
+        apply(load_fog_single(&back[x]), load_fog_single(&front[x]),
+              load_fog_single(&hpos[x]), load_fog_single(&hneg[x]),
+              load_fog_single(&hpos[x+1]), load_fog_single(&hneg[x+1]),
+              (y > 0 ? load_fog_single(&back_above[x]) : zero),
+              (y > 0 ? load_fog_single(&front_above[x]) : zero),
+              (y > 0
+               ? _mm_and_si128(load_fog_single(&open[x]),
+                               load_fog_single(&open_above[x]))
+               : zero),
+              new_self, new_above);
+        store_fog_single(&front[x], new_self);
+        if (y > 0) {
+            store_fog_single(&front_above[x], new_above);
+        }
+    }
+}
+
+void AutomatonThread::update_cell_reference(CoordInt x, CoordInt y, bool activate)
 {
     Cell *b_self, *f_self;
     CellMetadata *m_self;
     Cell *b_neighbours[2], *f_neighbours[2];
     CellMetadata *m_neighbours[2];
+    FogDensity *bfog_self, *ffog_self;
+    FogDensity *bfog_neighbours[2], *ffog_neighbours[2];
     get_cell_and_neighbours(_metadata, &m_self, &m_neighbours, x, y);
     get_cell_and_neighbours(_backbuffer, &b_self, &b_neighbours, x, y);
     get_cell_and_neighbours(_cells, &f_self, &f_neighbours, x, y);
+    get_cell_and_neighbours(_fog_backbuffer, &bfog_self, &bfog_neighbours, x, y);
+    get_cell_and_neighbours(_fog, &ffog_self, &ffog_neighbours, x, y);
 
     if (activate) {
         activate_cell(f_self, b_self);
@@ -730,8 +1081,12 @@ inline void AutomatonThread::update_cell(CoordInt x, CoordInt y, bool activate)
         if (b_neighbours[i]) {
             if (!m_self->blocked && !m_neighbours[i]->blocked)
             {
-                flow(b_self, f_self, b_neighbours[i], f_neighbours[i], i);
-                fog_flow(b_self, f_self, b_neighbours[i], f_neighbours[i]);
+                const double applicable_flow = flow(
+                    b_self, f_self, b_neighbours[i], f_neighbours[i], i);
+                advect_fog(applicable_flow,
+                           b_self, bfog_self, ffog_self,
+                           b_neighbours[i], bfog_neighbours[i],
+                           ffog_neighbours[i]);
             }
             temperature_flow(
                 m_self, b_self, f_self,
@@ -742,40 +1097,236 @@ inline void AutomatonThread::update_cell(CoordInt x, CoordInt y, bool activate)
     }
 }
 
+inline void AutomatonThread::update_cell_fused(CoordInt x, CoordInt y, bool activate)
+{
+    const CoordInt index = x + _width*y;
+    const CellMetadata *const m_self = &_metadata[index];
+    const Cell *const b_self = &_backbuffer[index];
+    Cell *const f_self = &_cells[index];
+    FogDensity *const ffog_self = &_fog[index];
+
+    Cell self;
+    if (activate) {
+        activate_cell(&self, b_self);
+    } else {
+        self = *f_self;
+    }
+    FogDensity fog_self = *ffog_self;
+
+    const double pA = b_self->air_pressure;
+    const double uA = b_self->heat_energy;
+    const FogDensity bfogA = _fog_backbuffer[index];
+    const bool blockedA = m_self->blocked;
+    const double tcA = (blockedA
+                        ? m_self->obj->info.temp_coefficient
+                        : pA * airtempcoeff_per_pressure);
+
+    for (CoordInt i = 0; i < 2; i++) {
+        if ((i == 0 && x == 0) || (i == 1 && y == 0)) {
+            continue;
+        }
+        const CoordInt nindex = index - (i == 0 ? 1 : _width);
+        const CellMetadata *const m_neigh = &_metadata[nindex];
+        const Cell *const b_neigh = &_backbuffer[nindex];
+        Cell *const f_neigh = &_cells[nindex];
+
+        const double pB = b_neigh->air_pressure;
+        const double uB = b_neigh->heat_energy;
+        const bool blockedB = m_neigh->blocked;
+
+        double neigh_pressure = f_neigh->air_pressure;
+        double neigh_heat = f_neigh->heat_energy;
+
+        if (!blockedA && !blockedB) {
+            // see flow()
+            const double dpressure = pA - pB;
+            const double dtemp = (i == 1 ? uA - uB : 0);
+            const double temp_flow = (dtemp > 0 ? dtemp * _sim.convection_friction : 0);
+            const double press_flow = dpressure * _sim.flow_friction;
+            const double flow = self.flow[i] * _sim.flow_damping + (temp_flow + press_flow) * (1.0 - _sim.flow_damping);
+            const double applicable_flow = clamp(flow, -pB / 4., pA / 4.);
+
+            self.flow[i] = applicable_flow;
+            self.air_pressure -= applicable_flow;
+            neigh_pressure += applicable_flow;
+
+            assert(! ((applicable_flow > 0 && pA == 0) || (applicable_flow < 0 && pB == 0) ));
+
+            if (applicable_flow != 0) {
+                const double energy_flow = (applicable_flow > 0 ? uA / pA * applicable_flow : uB / pB * applicable_flow);
+                assert(!isnan(energy_flow));
+                self.heat_energy -= energy_flow;
+                neigh_heat += energy_flow;
+
+                // see advect_fog()
+                FogDensity *const ffog_neigh = &_fog[nindex];
+                if (applicable_flow > 0) {
+                    const FogDensity moved = FogDensity(
+                        bfogA * (applicable_flow / pA));
+                    fog_self = fog_sub_saturated(fog_self, moved);
+                    *ffog_neigh = fog_add_saturated(*ffog_neigh, moved);
+                } else {
+                    const FogDensity moved = FogDensity(
+                        _fog_backbuffer[nindex] * (-applicable_flow / pB));
+                    *ffog_neigh = fog_sub_saturated(*ffog_neigh, moved);
+                    fog_self = fog_add_saturated(fog_self, moved);
+                }
+            }
+        }
+
+        // see temperature_flow()
+        const double tcB = (blockedB
+                            ? m_neigh->obj->info.temp_coefficient
+                            : pB * airtempcoeff_per_pressure);
+
+        if (tcA >= 1e-17 && tcB >= 1e-17) {
+            const double tempA = uA / tcA;
+            const double tempB = uB / tcB;
+            const double temp_gradient = tempB - tempA;
+            const double energy_flow_raw = (temp_gradient > 0
+                                            ? tcB * temp_gradient
+                                            : tcA * temp_gradient);
+            const double energy_flow = clamp(
+                energy_flow_raw * _sim.heat_flow_friction,
+                -uA / 4.,
+                uB / 4.
+            );
+
+            self.heat_energy += energy_flow;
+            neigh_heat -= energy_flow;
+            assert(abs(energy_flow) < 100);
+
+            if ((energy_flow > 0 && tempB < tempA) || (energy_flow <= 0 && tempA < tempB)) {
+                const double avg_temp = (uA + uB) / (tcA + tcB);
+                self.heat_energy = avg_temp * tcA;
+                neigh_heat = avg_temp * tcB;
+            }
+        }
+
+        f_neigh->air_pressure = neigh_pressure;
+        f_neigh->heat_energy = neigh_heat;
+    }
+
+    *f_self = self;
+    *ffog_self = fog_self;
+}
+
+#ifdef ML_PHYSICS_VALIDATE_KERNEL
+void AutomatonThread::validate_update_cell(CoordInt x, CoordInt y, bool activate)
+{
+    static constexpr double epsilon = 1e-9;
+
+    // update_cell_* only write to the cell itself and its left and upper
+    // neighbour; save those, run the reference, restore, run the fused
+    // kernel and compare.
+    const CoordInt indices[3] = {
+        x + _width*y,
+        (x > 0 ? x - 1 + _width*y : -1),
+        (y > 0 ? x + _width*(y-1) : -1)
+    };
+
+    Cell saved_cells[3], reference_cells[3];
+    FogDensity saved_fog[3], reference_fog[3];
+    for (int i = 0; i < 3; i++) {
+        if (indices[i] >= 0) {
+            saved_cells[i] = _cells[indices[i]];
+            saved_fog[i] = _fog[indices[i]];
+        }
+    }
+
+    update_cell_reference(x, y, activate);
+
+    for (int i = 0; i < 3; i++) {
+        if (indices[i] >= 0) {
+            reference_cells[i] = _cells[indices[i]];
+            reference_fog[i] = _fog[indices[i]];
+            _cells[indices[i]] = saved_cells[i];
+            _fog[indices[i]] = saved_fog[i];
+        }
+    }
+
+    update_cell_fused(x, y, activate);
+
+    auto differs = [](const double a, const double b) {
+        return abs(a - b) > epsilon * std::max(1., std::max(abs(a), abs(b)));
+    };
+
+    for (int i = 0; i < 3; i++) {
+        if (indices[i] < 0) {
+            continue;
+        }
+        const Cell &ref = reference_cells[i];
+        const Cell &fused = _cells[indices[i]];
+        if (differs(ref.air_pressure, fused.air_pressure) ||
+            differs(ref.heat_energy, fused.heat_energy) ||
+            differs(ref.flow[0], fused.flow[0]) ||
+            differs(ref.flow[1], fused.flow[1]) ||
+            reference_fog[i] != _fog[indices[i]])
+        {
+            fprintf(stderr,
+                    "[PHY!] [KV] kernel mismatch at %d,%d (cell %d): "
+                    "p %g/%g U %g/%g f %g,%g/%g,%g fog %u/%u\n",
+                    x, y, i,
+                    ref.air_pressure, fused.air_pressure,
+                    ref.heat_energy, fused.heat_energy,
+                    ref.flow[0], ref.flow[1], fused.flow[0], fused.flow[1],
+                    reference_fog[i], _fog[indices[i]]);
+        }
+    }
+}
+#endif
+
 void AutomatonThread::update()
 {
+    // the workers do not touch the metadata, so the field stays valid
+    // for snapshots until the next modification
+    _dataclass._collision.update(_metadata, _slice_y0, _slice_y1);
+    _dataclass._collision_signal.post();
+
     Cell *_tmp = _backbuffer;
     _backbuffer = _cells;
     _cells = _tmp;
+    FogDensity *_fog_tmp = _fog_backbuffer;
+    _fog_backbuffer = _fog;
+    _fog = _fog_tmp;
 
-    {
-        Cell *const f_start = &_cells[_slice_y1*_width];
-        Cell *const b_start = &_backbuffer[_slice_y1*_width];
-        Cell *const f_end = &_cells[(_slice_y1+1)*_width];
-        Cell *back = b_start;
-        for (Cell *front = f_start; front != f_end; front++) {
-            activate_cell(front, back);
-            back++;
-        }
-        if (_bottom_shared_forward)
-            _bottom_shared_forward->post();
-    }
+    // rows which receive impulses or deposits are activated up front;
+    // only this thread writes to them until they are updated
+    std::fill(_row_activated.begin(), _row_activated.end(), 0);
+    apply_impulses();
+    apply_deposits();
+
+    activate_row(_slice_y1);
+    if (_bottom_shared_forward)
+        _bottom_shared_forward->post();
 
     if (_top_shared_ready)
         _top_shared_ready->wait();
 
     if (_top_shared_zone)
         _top_shared_zone->lock();
-    for (CoordInt x = 0; x < _width; x++) {
-        update_cell(x, _slice_y0);
+    {
+        const bool activated = _row_activated[0];
+        if (!activated) {
+            activate_fog_row(_slice_y0);
+        }
+        for (CoordInt x = 0; x < _width; x++) {
+            update_cell(x, _slice_y0, !activated);
+        }
     }
+    fog_flow_row(_slice_y0);
     if (_top_shared_zone)
         _top_shared_zone->unlock();
 
     for (CoordInt y = _slice_y0+1; y < _slice_y1; y++) {
+        const bool activated = _row_activated[y - _slice_y0];
+        if (!activated) {
+            activate_fog_row(y);
+        }
         for (CoordInt x = 0; x < _width; x++) {
-            update_cell(x, y);
+            update_cell(x, y, !activated);
         }
+        fog_flow_row(y);
     }
 
     if (_bottom_shared_zone)
@@ -783,6 +1334,7 @@ void AutomatonThread::update()
     for (CoordInt x = 0; x < _width; x++) {
         update_cell(x, _slice_y1, false);
     }
+    fog_flow_row(_slice_y1);
     if (_bottom_shared_zone)
         _bottom_shared_zone->unlock();
 
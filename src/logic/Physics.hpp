@@ -25,6 +25,8 @@ authors named in the AUTHORS file.
 #ifndef _ML_PHYSICS_H
 #define _ML_PHYSICS_H
 
+#include <algorithm>
+#include <cassert>
 #include <vector>
 
 #include <CEngine/Misc/Int.hpp>
@@ -32,9 +34,49 @@ authors named in the AUTHORS file.
 
 #include "Types.hpp"
 #include "PhysicsConfig.hpp"
+#include "CollisionField.hpp"
 #include "Stamp.hpp"
 
 class GameObject;
+class WorkerPool;
+
+/**
+ * Fog density, stored as unsigned fixed point number with 4 integer and 12
+ * fractional bits. Arithmetic on fog saturates at both ends of the range.
+ *
+ * Fog is kept in a separate plane of the automaton and only converted
+ * from and to double where it enters or leaves the simulation (stamps,
+ * visualization).
+ */
+typedef uint16_t FogDensity;
+
+static constexpr unsigned int fog_fraction_bits = 12;
+static constexpr double fog_scale = double(1u << fog_fraction_bits);
+static constexpr double fog_max = 0xffff / fog_scale;
+
+inline FogDensity fog_from_double(const double value)
+{
+    // written so that NaNs end up as zero
+    return (value > 0.
+            ? (value < fog_max ? FogDensity(value * fog_scale + 0.5) : 0xffff)
+            : 0);
+}
+
+inline double fog_to_double(const FogDensity value)
+{
+    return value / fog_scale;
+}
+
+inline FogDensity fog_add_saturated(const FogDensity a, const FogDensity b)
+{
+    const uint32_t sum = uint32_t(a) + b;
+    return (sum > 0xffff ? 0xffff : FogDensity(sum));
+}
+
+inline FogDensity fog_sub_saturated(const FogDensity a, const FogDensity b)
+{
+    return (a > b ? a - b : 0);
+}
 
 struct Cell {
     double air_pressure;
@@ -42,7 +84,6 @@ struct Cell {
 
     // flow is in relation to upper left neighbour!
     double flow[2];
-    double fog;
 };
 
 struct CellMetadata {
@@ -55,9 +96,87 @@ typedef Cell PhysicsCellStamp[cell_stamp_length];
 struct CellInfo {
     CoordPair offs;
     Cell phys;
+    double fog;
     CellMetadata meta;
 };
 
+/**
+ * Read-only view on the physics state of the last completed step of an
+ * Automaton.
+ *
+ * While the automaton is running, the workers only read from the buffer
+ * the snapshot refers to and write their results into the other one.
+ * Thus, a snapshot may be read while the next step is being calculated,
+ * without calling Automaton::wait_for() first.
+ *
+ * The snapshot becomes stale with the next call to Automaton::wait_for()
+ * which actually stops the automaton; this is tracked by the epoch, which
+ * is increased each time a step has been completed. Between wait_for()
+ * and resume(), modifications made through the Automaton API (e.g. by
+ * moving stamps) are visible through the snapshot, except for the
+ * collision field. The workers bring that up to date at the start of
+ * each step; until Automaton::wait_for_collision() has returned,
+ * *collision* is nullptr.
+ */
+struct PhysicsSnapshot {
+    TickCounter epoch;
+    CoordInt width, height;
+    const Cell *cells;
+    const FogDensity *fog;
+    const CellMetadata *metadata;
+    const CollisionCell *collision;
+
+    inline const Cell *cell_at(CoordInt x, CoordInt y) const
+    {
+        return &cells[x+width*y];
+    }
+
+    inline double fog_at(CoordInt x, CoordInt y) const
+    {
+        return fog_to_double(fog[x+width*y]);
+    }
+
+    inline const Cell *safe_cell_at(CoordInt x, CoordInt y) const
+    {
+        return (x >= 0 && x < width && y >= 0 && y < height) ? cell_at(x, y) : nullptr;
+    }
+
+    inline const CellMetadata *meta_at(CoordInt x, CoordInt y) const
+    {
+        return &metadata[x+width*y];
+    }
+
+    inline const CollisionCell *collision_at(CoordInt x, CoordInt y) const
+    {
+        return &collision[x+width*y];
+    }
+};
+
+/**
+ * Matter and heat added to the cells [x0, x1] x [y0, y1] at the start of a
+ * step, see Automaton::push_impulse().
+ *
+ * *pressure* and *fog* are only added to unblocked cells. The heat
+ * energy of each cell rises by *temperature* times its heat capacity,
+ * which is taken after the pressure has been added.
+ */
+struct PhysicsImpulse {
+    CoordInt x0, y0, x1, y1;
+    double pressure;
+    double temperature;
+    FogDensity fog;
+};
+
+/**
+ * Heat and fog added to a single cell at the start of a step, like a
+ * PhysicsImpulse without pressure. See Automaton::deposits().
+ */
+struct PhysicsDeposit {
+    CoordInt x, y;
+    float temperature;
+    FogDensity fog;
+};
+
 class AutomatonThread;
 
 /**
@@ -96,9 +215,11 @@ public:
 
 private:
     bool _resumed;
+    TickCounter _epoch;
     const CoordInt _width, _height;
     CellMetadata *_metadata;
     Cell *_cells, *_backbuffer;
+    FogDensity *_fog, *_fog_backbuffer;
     const SimulationConfig _config;
     unsigned int _thread_count;
     PyEngine::Semaphore _finished_signal;
@@ -107,6 +228,23 @@ private:
     std::vector<std::mutex> _shared_zones;
     std::vector<std::unique_ptr<AutomatonThread>> _threads;
 
+    /* impulses pushed since the last resume() and those the workers apply
+     * in the current step; the vectors are swapped by resume(), so their
+     * storage is reused */
+    std::vector<PhysicsImpulse> _impulses;
+    std::vector<PhysicsImpulse> _step_impulses;
+
+    /* the same for deposits, with one vector for each producer */
+    std::vector<std::vector<PhysicsDeposit>> _deposits;
+    std::vector<std::vector<PhysicsDeposit>> _step_deposits;
+
+    CollisionField _collision;
+
+    /* set by resume() until the workers have signalled through
+     * _collision_signal that the collision field is up to date */
+    bool _collision_pending;
+    PyEngine::Semaphore _collision_signal;
+
     uint32_t *_rgba_buffer; //! Used by to_gl_texture() and allocated on-demand.
 private:
     void init_cell(
@@ -117,6 +255,12 @@ private:
 
     void init_metadata(CellMetadata *buffer, CoordInt x, CoordInt y);
 
+    inline void clear_fog(CoordInt x, CoordInt y)
+    {
+        _fog[x+_width*y] = 0;
+        _fog_backbuffer[x+_width*y] = 0;
+    }
+
     /**
      * Initialize all threads for the automaton. Uses
      * PyEngine::Thread::get_hardware_thread_count() internally to find a
@@ -132,8 +276,13 @@ public:
         const CoordInt x, const CoordInt y,
         const Stamp &stamp, const double temperature);
 
+    /**
+     * Writable cell. Like the other writable accessors, this requires the
+     * automaton to be stopped; use snapshot() to read while it runs.
+     */
     Cell inline *cell_at(CoordInt x, CoordInt y)
     {
+        assert(!_resumed);
         return &_cells[x+_width*y];
     }
 
@@ -152,15 +301,135 @@ public:
         return _config;
     }
 
+    /**
+     * Return the number of steps which have been completed so far. This
+     * is the version of the state returned by snapshot().
+     */
+    inline TickCounter epoch() const
+    {
+        return _epoch;
+    }
+
     void get_cell_stamp_at(
         const CoordInt left, const CoordInt top,
         PhysicsCellStamp *stamp);
 
+    /**
+     * Set the state of all cells at once, e.g. to load a level.
+     *
+     * *init* is called as init(x, y, cell, fog, meta) for each cell in
+     * row-major order and must set all fields of the Cell, the
+     * FogDensity and the CellMetadata it is passed. Unlike place_stamp(),
+     * nothing is redistributed to neighbouring cells. Both buffers are
+     * written, so the automaton must be stopped.
+     */
+    template <typename Init>
+    void init_cells(Init &&init)
+    {
+        assert(!_resumed);
+
+        Cell *cell = _cells;
+        FogDensity *fog = _fog;
+        CellMetadata *meta = _metadata;
+        for (CoordInt y = 0; y < _height; y++) {
+            for (CoordInt x = 0; x < _width; x++) {
+                init(x, y, *cell++, *fog++, *meta++);
+            }
+        }
+
+        const size_t count = _width*_height;
+        std::copy(_cells, _cells + count, _backbuffer);
+        std::copy(_fog, _fog + count, _fog_backbuffer);
+        _collision.invalidate_all();
+    }
+
+    /**
+     * Return the buffer of *producer* for deposits to be applied by the
+     * workers at the start of the step after the next resume().
+     *
+     * Each producer has its own buffer, so that producers running on
+     * different threads can fill their buffers concurrently, without
+     * locking, and while the automaton is running. A buffer must not be
+     * used across a call to resume(), which hands it to the workers.
+     */
+    inline std::vector<PhysicsDeposit> &deposits(unsigned int producer = 0)
+    {
+        assert(producer < _deposits.size());
+        return _deposits[producer];
+    }
+
+    inline const std::vector<std::vector<PhysicsDeposit>> &pending_deposits() const
+    {
+        return _deposits;
+    }
+
+    inline unsigned int deposit_producers() const
+    {
+        return _deposits.size();
+    }
+
+    /**
+     * Set the number of deposit buffers. This discards pending deposits
+     * and requires the automaton to be stopped.
+     */
+    void set_deposit_producers(unsigned int count);
+
+    /**
+     * Impulses which have been pushed since the last resume().
+     */
+    inline const std::vector<PhysicsImpulse> &pending_impulses() const
+    {
+        return _impulses;
+    }
+
+    /**
+     * Queue *impulse* to be applied by the workers at the start of the
+     * step after the next resume(), each within its own slice. The
+     * rectangle is clipped to the automaton.
+     *
+     * Unlike the other modifying calls, this may be used while the
+     * automaton is running, but only from the thread which calls resume()
+     * and wait_for().
+     */
+    void push_impulse(const PhysicsImpulse &impulse);
+
+    /**
+     * Replace the cells and the fog (width*height values each, row-major)
+     * and set the epoch, to restore a saved state. The metadata has to be
+     * restored separately through meta_at(). Pending impulses and
+     * deposits are discarded.
+     */
+    void restore(TickCounter epoch,
+                 const Cell *cells,
+                 const FogDensity *fog);
+
+    inline FogDensity *fog_at(CoordInt x, CoordInt y)
+    {
+        assert(!_resumed);
+        return &_fog[x+_width*y];
+    }
+
+    /**
+     * Writable metadata of a cell. Changes to the blocked flag made
+     * through this have to be announced with invalidate_collision().
+     */
     CellMetadata inline *meta_at(CoordInt x, CoordInt y)
     {
+        assert(!_resumed);
         return &_metadata[x+_width*y];
     }
 
+    /**
+     * Announce that the blocked flags in [x0, x1] x [y0, y1] have been
+     * changed through meta_at(). The other modifying calls do this
+     * themselves.
+     */
+    inline void invalidate_collision(CoordInt x0, CoordInt y0,
+                                     CoordInt x1, CoordInt y1)
+    {
+        _collision.invalidate(x0, y0, x1, y1);
+    }
+
     void move_stamp(
         const CoordInt oldx, const CoordInt oldy,
         const CoordInt newx, const CoordInt newy,
@@ -182,10 +451,29 @@ public:
      * Tell the automaton to resume it's work. The effect of this
      * function if it's called while the automaton is still working is
      * undefined. Make sure it's stopped by calling wait_for() first.
+     *
+     * Before the workers start, the collision field is updated for the
+     * blocked flags changed since the last call.
      */
     void resume();
     void set_blocked(CoordInt x, CoordInt y, bool blocked);
 
+    /**
+     * Return a read-only view on the state of the last completed step.
+     * Unlike cell_at() and friends, this is safe to use while the
+     * automaton is running. See PhysicsSnapshot for details.
+     */
+    PhysicsSnapshot snapshot() const;
+
+    /**
+     * Wait until the workers have updated the collision field for the
+     * current step, which they do before calculating the step. Snapshots
+     * taken before this returns have no collision field.
+     *
+     * If the automaton is suspended, return immediately.
+     */
+    void wait_for_collision();
+
     /**
      * Wait until the cellular automaton has settled its calculation
      * and return. The automaton will not continue calculating until
@@ -200,11 +488,20 @@ public:
      * image representation and store it in the currently bound
      * opengl texture.
      *
+     * The data is taken from snapshot(), so it is not required to stop
+     * the automaton before calling this.
+     *
+     * The conversion itself is done by PhysicsColourMap; this only
+     * arranges the planes and uploads the result.
+     *
      * @param min pressure which will be mapped to 0
      * @param max pressure which will be mapped to 1
      * @param thread_regions if true, thread regions are also visualized
+     * @param pool if given, the conversion is split across its workers
      */
-    void to_gl_texture(const double min, const double max, bool thread_regions);
+    void to_gl_texture(const double min, const double max,
+                       bool thread_regions,
+                       WorkerPool *pool = nullptr);
 
     friend class AutomatonThread;
 };
@@ -235,12 +532,24 @@ private:
     const CoordInt _width, _height, _slice_y0, _slice_y1;
     const SimulationConfig _sim;
     Cell *_backbuffer, *_cells;
+    FogDensity *_fog_backbuffer, *_fog;
     CellMetadata *_metadata;
+
+    /* scratch rows for fog_flow_row(); the flow rows have one extra
+     * element so that the flows to both sides of a cell can be loaded
+     * with the same index */
+    std::vector<uint16_t> _fog_open, _fog_open_above;
+    std::vector<uint16_t> _fog_flow_pos, _fog_flow_neg;
+
+    /* for each row of the slice, whether it has been activated before
+     * the rows are updated, see activate_row() */
+    std::vector<uint8_t> _row_activated;
+
     std::atomic_bool _terminated;
     std::thread _thread;
 
 protected:
-    void activate_cell(Cell *front, Cell *back);
+    void activate_cell(Cell *front, const Cell *back);
 
     template<class CType>
     void get_cell_and_neighbours(
@@ -266,17 +575,85 @@ protected:
         Cell *f_cellB,
         CoordInt direction);
 
-    void fog_flow(
+    void advect_fog(
+        const double applicable_flow,
         const Cell *b_cellA,
-        Cell *f_cellA,
+        const FogDensity *b_fogA,
+        FogDensity *f_fogA,
         const Cell *b_cellB,
-        Cell *f_cellB);
+        const FogDensity *b_fogB,
+        FogDensity *f_fogB);
+
+    void activate_fog_row(CoordInt y);
+
+    /**
+     * Activate the cells and the fog of row *y* ahead of the update of
+     * the row, unless this has already been done in this step.
+     */
+    void activate_row(CoordInt y);
+
+    inline void deposit(
+        CoordInt index,
+        double pressure,
+        double temperature,
+        FogDensity fog);
+
+    /**
+     * Add the queued impulses and deposits to the front buffers of the
+     * slice, activating the rows they touch.
+     */
+    void apply_impulses();
+    void apply_deposits();
+
+    /**
+     * Let fog diffuse between the unblocked cells of row *y* and their
+     * left and upper neighbours, eight cells at a time.
+     */
+    void fog_flow_row(CoordInt y);
+
+    /**
+     * Update a cell using the separate activate_cell(), flow(),
+     * advect_fog() and temperature_flow() steps. This is the reference
+     * implementation for update_cell_fused().
+     */
+    void update_cell_reference(
+        CoordInt x,
+        CoordInt y,
+        bool activate = true);
 
-    void update_cell(
+    /**
+     * Update a cell and exchange with its left and upper neighbours in a
+     * single pass: each input is loaded once, the new state of the cell
+     * is kept in registers and each output is written once. Produces the
+     * same results as update_cell_reference().
+     */
+    void update_cell_fused(
         CoordInt x,
         CoordInt y,
         bool activate = true);
 
+#ifdef ML_PHYSICS_VALIDATE_KERNEL
+    /**
+     * Run both kernels on the same input and report differences.
+     */
+    void validate_update_cell(
+        CoordInt x,
+        CoordInt y,
+        bool activate);
+#endif
+
+    inline void update_cell(
+        CoordInt x,
+        CoordInt y,
+        bool activate = true)
+    {
+#ifdef ML_PHYSICS_VALIDATE_KERNEL
+        validate_update_cell(x, y, activate);
+#else
+        update_cell_fused(x, y, activate);
+#endif
+    }
+
     void update();
 
 public:
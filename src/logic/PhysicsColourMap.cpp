@@ -0,0 +1,330 @@
+#include "PhysicsColourMap.hpp"
+
+#include <cassert>
+
+#include <emmintrin.h>
+
+#include "WorkerPool.hpp"
+
+/* the amount of output rows handed to a worker at once */
+static constexpr CoordInt rows_per_job = 16;
+
+/* free functions */
+
+ColourPalette gradient_palette(const std::vector<uint32_t> &stops)
+{
+    assert(stops.size() >= 2);
+
+    ColourPalette result;
+    const unsigned int segments = stops.size() - 1;
+    for (unsigned int i = 0; i < result.size(); i++) {
+        const float pos = (float)i / (result.size() - 1) * segments;
+        const unsigned int segment = std::min((unsigned int)pos, segments - 1);
+        const float t = pos - segment;
+        const uint32_t a = stops[segment];
+        const uint32_t b = stops[segment+1];
+
+        uint32_t pixel = 0;
+        for (unsigned int shift = 0; shift < 32; shift += 8) {
+            const float ca = (a >> shift) & 0xff;
+            const float cb = (b >> shift) & 0xff;
+            pixel |= uint32_t(ca + (cb - ca) * t + 0.5f) << shift;
+        }
+        result[i] = pixel;
+    }
+    return result;
+}
+
+ColourPalette greyscale_palette()
+{
+    return gradient_palette({rgba(0, 0, 0), rgba(255, 255, 255)});
+}
+
+ColourPalette heat_palette()
+{
+    return gradient_palette({
+            rgba(0, 0, 0),
+            rgba(128, 0, 0),
+            rgba(255, 64, 0),
+            rgba(255, 224, 0),
+            rgba(255, 255, 255)});
+}
+
+/* PhysicsColourMap */
+
+PhysicsColourMap::PhysicsColourMap(
+        PhysicsPlane plane,
+        const double min,
+        const double max,
+        const ColourPalette &palette,
+        const CoordInt downsample):
+    _plane(plane),
+    _min(min),
+    _scale(max > min ? 255. / (max - min) : 0.),
+    _palette(palette),
+    _downsample(downsample > 0 ? downsample : 1),
+    blocked_colour(rgba(255, 0, 0))
+{
+
+}
+
+/**
+ * Load the values of a plane at the cell indices [index, index+4) of the
+ * snapshot, the first two into *lo* and the others into *hi*. The results
+ * are the same as those of physics_plane_value().
+ */
+template <PhysicsPlane plane>
+static inline void load_plane4(const PhysicsSnapshot &view, size_t index,
+                               __m128d &lo, __m128d &hi);
+
+/**
+ * Load (air_pressure, heat_energy) of four consecutive cells and
+ * transpose them into the pressures (p) and energies (u) of two pairs.
+ */
+static inline void load_cell_heads4(const Cell *cells,
+                                    __m128d &p_lo, __m128d &p_hi,
+                                    __m128d &u_lo, __m128d &u_hi)
+{
+    const __m128d c0 = _mm_loadu_pd(&cells[0].air_pressure);
+    const __m128d c1 = _mm_loadu_pd(&cells[1].air_pressure);
+    const __m128d c2 = _mm_loadu_pd(&cells[2].air_pressure);
+    const __m128d c3 = _mm_loadu_pd(&cells[3].air_pressure);
+    p_lo = _mm_unpacklo_pd(c0, c1);
+    p_hi = _mm_unpacklo_pd(c2, c3);
+    u_lo = _mm_unpackhi_pd(c0, c1);
+    u_hi = _mm_unpackhi_pd(c2, c3);
+}
+
+/**
+ * Load the flow of four consecutive cells, transposed into the x (fx) and
+ * y (fy) components of two pairs.
+ */
+static inline void load_cell_flows4(const Cell *cells,
+                                    __m128d &fx_lo, __m128d &fx_hi,
+                                    __m128d &fy_lo, __m128d &fy_hi)
+{
+    const __m128d c0 = _mm_loadu_pd(cells[0].flow);
+    const __m128d c1 = _mm_loadu_pd(cells[1].flow);
+    const __m128d c2 = _mm_loadu_pd(cells[2].flow);
+    const __m128d c3 = _mm_loadu_pd(cells[3].flow);
+    fx_lo = _mm_unpacklo_pd(c0, c1);
+    fx_hi = _mm_unpacklo_pd(c2, c3);
+    fy_lo = _mm_unpackhi_pd(c0, c1);
+    fy_hi = _mm_unpackhi_pd(c2, c3);
+}
+
+template <>
+inline void load_plane4<PhysicsPlane::AIR_PRESSURE>(
+    const PhysicsSnapshot &view, size_t index,
+    __m128d &lo, __m128d &hi)
+{
+    __m128d u_lo, u_hi;
+    load_cell_heads4(&view.cells[index], lo, hi, u_lo, u_hi);
+}
+
+template <>
+inline void load_plane4<PhysicsPlane::TEMPERATURE>(
+    const PhysicsSnapshot &view, size_t index,
+    __m128d &lo, __m128d &hi)
+{
+    __m128d p_lo, p_hi, u_lo, u_hi;
+    load_cell_heads4(&view.cells[index], p_lo, p_hi, u_lo, u_hi);
+
+    const __m128d coeff = _mm_set1_pd(airtempcoeff_per_pressure);
+    const __m128d threshold = _mm_set1_pd(1e-17);
+    const __m128d tc_lo = _mm_mul_pd(p_lo, coeff);
+    const __m128d tc_hi = _mm_mul_pd(p_hi, coeff);
+    // cells without air are masked to zero after the division
+    lo = _mm_and_pd(_mm_cmpgt_pd(tc_lo, threshold),
+                    _mm_div_pd(u_lo, tc_lo));
+    hi = _mm_and_pd(_mm_cmpgt_pd(tc_hi, threshold),
+                    _mm_div_pd(u_hi, tc_hi));
+}
+
+template <>
+inline void load_plane4<PhysicsPlane::FOG_DENSITY>(
+    const PhysicsSnapshot &view, size_t index,
+    __m128d &lo, __m128d &hi)
+{
+    const __m128i fog = _mm_unpacklo_epi16(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&view.fog[index])),
+        _mm_setzero_si128());
+    // the scale is a power of two, so this equals fog_to_double()
+    const __m128d scale = _mm_set1_pd(1. / fog_scale);
+    lo = _mm_mul_pd(_mm_cvtepi32_pd(fog), scale);
+    hi = _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(fog, 0x0e)), scale);
+}
+
+template <>
+inline void load_plane4<PhysicsPlane::FLOW_X>(
+    const PhysicsSnapshot &view, size_t index,
+    __m128d &lo, __m128d &hi)
+{
+    __m128d fy_lo, fy_hi;
+    load_cell_flows4(&view.cells[index], lo, hi, fy_lo, fy_hi);
+}
+
+template <>
+inline void load_plane4<PhysicsPlane::FLOW_Y>(
+    const PhysicsSnapshot &view, size_t index,
+    __m128d &lo, __m128d &hi)
+{
+    __m128d fx_lo, fx_hi;
+    load_cell_flows4(&view.cells[index], fx_lo, fx_hi, lo, hi);
+}
+
+template <PhysicsPlane plane>
+void PhysicsColourMap::map_row(
+    const PhysicsSnapshot &view,
+    CoordInt x0, CoordInt x1, CoordInt y,
+    uint32_t *dest) const
+{
+    size_t src = x0 + y * view.width;
+    const CellMetadata *meta = view.meta_at(x0, y);
+
+    const __m128d offset = _mm_set1_pd(_min);
+    const __m128d scale = _mm_set1_pd(_scale);
+    const __m128d lower = _mm_setzero_pd();
+    const __m128d upper = _mm_set1_pd(255.);
+
+    CoordInt x = x0;
+    for (; x + 4 <= x1; x += 4) {
+        __m128d lo, hi;
+        load_plane4<plane>(view, src, lo, hi);
+        lo = _mm_mul_pd(_mm_sub_pd(lo, offset), scale);
+        hi = _mm_mul_pd(_mm_sub_pd(hi, offset), scale);
+        // maxpd returns the second operand for NaNs, which maps them to 0
+        lo = _mm_min_pd(_mm_max_pd(lo, lower), upper);
+        hi = _mm_min_pd(_mm_max_pd(hi, lower), upper);
+
+        // SSE2 has no gather, so the palette is looked up per cell
+        alignas(16) int32_t index[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(index),
+                        _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo),
+                                           _mm_cvttpd_epi32(hi)));
+        for (unsigned int i = 0; i < 4; i++) {
+            dest[i] = (meta[i].blocked ? blocked_colour : _palette[index[i]]);
+        }
+
+        src += 4;
+        meta += 4;
+        dest += 4;
+    }
+
+    for (; x < x1; x++) {
+        if (meta->blocked) {
+            *dest = blocked_colour;
+        } else {
+            __m128d value = _mm_set_sd(physics_plane_value<plane>(view, src));
+            value = _mm_mul_sd(_mm_sub_sd(value, offset), scale);
+            value = _mm_min_sd(_mm_max_sd(value, lower), upper);
+            *dest = _palette[_mm_cvttsd_si32(value)];
+        }
+        src++;
+        meta++;
+        dest++;
+    }
+}
+
+template <PhysicsPlane plane>
+void PhysicsColourMap::map_row_downsampled(
+    const PhysicsSnapshot &view,
+    CoordInt x0, CoordInt x1,
+    CoordInt y0, CoordInt y1,
+    uint32_t *dest) const
+{
+    for (CoordInt bx = x0; bx < x1; bx += _downsample) {
+        const CoordInt bx1 = std::min(bx + _downsample, x1);
+
+        double sum = 0;
+        unsigned int count = 0;
+        for (CoordInt y = y0; y < y1; y++) {
+            size_t src = bx + y * view.width;
+            const CellMetadata *meta = view.meta_at(bx, y);
+            for (CoordInt x = bx; x < bx1; x++) {
+                if (!meta->blocked) {
+                    sum += physics_plane_value<plane>(view, src);
+                    count++;
+                }
+                src++;
+                meta++;
+            }
+        }
+
+        if (count == 0) {
+            *dest = blocked_colour;
+        } else {
+            __m128d value = _mm_set_sd(sum / count);
+            value = _mm_mul_sd(_mm_sub_sd(value, _mm_set_sd(_min)),
+                               _mm_set_sd(_scale));
+            value = _mm_min_sd(_mm_max_sd(value, _mm_setzero_pd()),
+                               _mm_set_sd(255.));
+            *dest = _palette[_mm_cvttsd_si32(value)];
+        }
+        dest++;
+    }
+}
+
+void PhysicsColourMap::map_rows(
+    const PhysicsSnapshot &view,
+    CoordInt x0, CoordInt x1,
+    CoordInt y0, CoordInt y1,
+    CoordInt out_y0, CoordInt out_y1,
+    uint32_t *dest, size_t dest_stride) const
+{
+    for (CoordInt out_y = out_y0; out_y < out_y1; out_y++) {
+        uint32_t *const row = dest + out_y * dest_stride;
+        const CoordInt y = y0 + out_y * _downsample;
+        const CoordInt ylast = std::min(y + _downsample, y1);
+
+#define DISPATCH(p)                                                     \
+        case p:                                                         \
+        {                                                               \
+            if (_downsample == 1) {                                     \
+                map_row<p>(view, x0, x1, y, row);                       \
+            } else {                                                    \
+                map_row_downsampled<p>(view, x0, x1, y, ylast, row);    \
+            }                                                           \
+            break;                                                      \
+        }
+
+        switch (_plane) {
+        DISPATCH(PhysicsPlane::AIR_PRESSURE)
+        DISPATCH(PhysicsPlane::TEMPERATURE)
+        DISPATCH(PhysicsPlane::FOG_DENSITY)
+        DISPATCH(PhysicsPlane::FLOW_X)
+        DISPATCH(PhysicsPlane::FLOW_Y)
+        }
+
+#undef DISPATCH
+    }
+}
+
+void PhysicsColourMap::map(
+    const PhysicsSnapshot &view,
+    CoordInt x0, CoordInt y0,
+    CoordInt x1, CoordInt y1,
+    uint32_t *dest, size_t dest_stride,
+    WorkerPool *pool) const
+{
+    assert(x0 >= 0 && x1 <= view.width && x0 <= x1);
+    assert(y0 >= 0 && y1 <= view.height && y0 <= y1);
+
+    const CoordInt out_height = output_size(y1 - y0);
+
+    if (!pool || out_height <= rows_per_job) {
+        map_rows(view, x0, x1, y0, y1, 0, out_height, dest, dest_stride);
+        return;
+    }
+
+    const size_t jobs = (out_height + rows_per_job - 1) / rows_per_job;
+    pool->parallel_for(
+        jobs,
+        [&](size_t index, unsigned int) {
+            const CoordInt out_y0 = index * rows_per_job;
+            const CoordInt out_y1 = std::min(out_y0 + rows_per_job,
+                                             out_height);
+            map_rows(view, x0, x1, y0, y1, out_y0, out_y1,
+                     dest, dest_stride);
+        });
+}
@@ -0,0 +1,169 @@
+#ifndef _ML_PHYSICS_COLOUR_MAP_H
+#define _ML_PHYSICS_COLOUR_MAP_H
+
+#include <array>
+#include <vector>
+
+#include "Physics.hpp"
+
+class WorkerPool;
+
+enum class PhysicsPlane {
+    AIR_PRESSURE,
+    TEMPERATURE,
+    FOG_DENSITY,
+    FLOW_X,
+    FLOW_Y
+};
+
+/**
+ * Return the value of a plane at the given cell index of the snapshot.
+ */
+template <PhysicsPlane plane>
+inline double physics_plane_value(const PhysicsSnapshot &view, size_t index);
+
+template <>
+inline double physics_plane_value<PhysicsPlane::AIR_PRESSURE>(
+    const PhysicsSnapshot &view, size_t index)
+{
+    return view.cells[index].air_pressure;
+}
+
+/**
+ * Temperature of an unblocked cell (for blocked cells, the heat capacity
+ * of the object would be needed).
+ */
+template <>
+inline double physics_plane_value<PhysicsPlane::TEMPERATURE>(
+    const PhysicsSnapshot &view, size_t index)
+{
+    const Cell &cell = view.cells[index];
+    const double tc = cell.air_pressure * airtempcoeff_per_pressure;
+    return (tc > 1e-17 ? cell.heat_energy / tc : 0.);
+}
+
+template <>
+inline double physics_plane_value<PhysicsPlane::FOG_DENSITY>(
+    const PhysicsSnapshot &view, size_t index)
+{
+    return fog_to_double(view.fog[index]);
+}
+
+template <>
+inline double physics_plane_value<PhysicsPlane::FLOW_X>(
+    const PhysicsSnapshot &view, size_t index)
+{
+    return view.cells[index].flow[0];
+}
+
+template <>
+inline double physics_plane_value<PhysicsPlane::FLOW_Y>(
+    const PhysicsSnapshot &view, size_t index)
+{
+    return view.cells[index].flow[1];
+}
+
+/**
+ * A lookup table from normalized plane values (0..255) to RGBA pixels. The
+ * pixels are stored in memory order R, G, B, A, which is what
+ * GL_RGBA/GL_UNSIGNED_BYTE expects.
+ */
+typedef std::array<uint32_t, 256> ColourPalette;
+
+static inline uint32_t rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a = 0xff)
+{
+    return uint32_t(r) | (uint32_t(g) << 8) | (uint32_t(b) << 16) | (uint32_t(a) << 24);
+}
+
+/**
+ * Create a palette which linearly interpolates between the given colours,
+ * which are spread evenly over the palette. At least two stops are
+ * required.
+ */
+ColourPalette gradient_palette(const std::vector<uint32_t> &stops);
+
+ColourPalette greyscale_palette();
+ColourPalette heat_palette();
+
+/**
+ * Convert a plane of the physics simulation into RGBA pixels.
+ *
+ * Values of the plane are mapped linearly from [min, max] onto the palette
+ * and clamped at the ends. Blocked cells are drawn with blocked_colour. If
+ * a downsampling factor larger than one is used, each output pixel
+ * represents the average of the unblocked cells in a square of that edge
+ * length; squares without unblocked cells are drawn as blocked.
+ *
+ * This is entirely independent from OpenGL and may thus be used for
+ * headless dumps as well as for the debug overlay.
+ */
+class PhysicsColourMap
+{
+public:
+    PhysicsColourMap(PhysicsPlane plane,
+                     const double min,
+                     const double max,
+                     const ColourPalette &palette,
+                     const CoordInt downsample = 1);
+
+private:
+    const PhysicsPlane _plane;
+    const double _min;
+    const double _scale;
+    const ColourPalette _palette;
+    const CoordInt _downsample;
+
+public:
+    uint32_t blocked_colour;
+
+private:
+    template <PhysicsPlane plane>
+    void map_row(const PhysicsSnapshot &view,
+                 CoordInt x0, CoordInt x1, CoordInt y,
+                 uint32_t *dest) const;
+
+    template <PhysicsPlane plane>
+    void map_row_downsampled(const PhysicsSnapshot &view,
+                             CoordInt x0, CoordInt x1,
+                             CoordInt y0, CoordInt y1,
+                             uint32_t *dest) const;
+
+    void map_rows(const PhysicsSnapshot &view,
+                  CoordInt x0, CoordInt x1,
+                  CoordInt y0, CoordInt y1,
+                  CoordInt out_y0, CoordInt out_y1,
+                  uint32_t *dest, size_t dest_stride) const;
+
+public:
+    /**
+     * Return the size of the output for an input region of the given size.
+     */
+    inline CoordInt output_size(const CoordInt input_size) const
+    {
+        return (input_size + _downsample - 1) / _downsample;
+    }
+
+    /**
+     * Map the region [x0, x1) x [y0, y1) of the snapshot into *dest*,
+     * which must have room for output_size(y1 - y0) rows of *dest_stride*
+     * pixels each.
+     *
+     * If a *pool* is given, the rows are split across its workers.
+     */
+    void map(const PhysicsSnapshot &view,
+             CoordInt x0, CoordInt y0,
+             CoordInt x1, CoordInt y1,
+             uint32_t *dest, size_t dest_stride,
+             WorkerPool *pool = nullptr) const;
+
+    inline void map(const PhysicsSnapshot &view,
+                    uint32_t *dest,
+                    WorkerPool *pool = nullptr) const
+    {
+        map(view, 0, 0, view.width, view.height,
+            dest, output_size(view.width), pool);
+    }
+
+};
+
+#endif
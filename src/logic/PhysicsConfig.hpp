@@ -37,7 +37,17 @@ const CoordInt level_height = 50;
 static constexpr TickCounter EXPLOSION_TRIGGER_TIMEOUT = 50;
 static constexpr TickCounter EXPLOSION_BLOCK_LIFETIME = 150;
 
+/* impulses (see PhysicsImpulse) of an exploding cell, of the cell of a
+ * bomb when it goes off and of the cell in front of a flamethrower for
+ * each fired particle */
+static constexpr double EXPLOSION_PRESSURE_RISE = 0.5;
+static constexpr double EXPLOSION_TEMPERATURE_RISE = 1.0;
+static constexpr double BOMB_PRESSURE_RISE = 2.0;
+static constexpr double FLAMETHROWER_TEMPERATURE_RISE = 0.2;
+
 static constexpr float FIRE_PARTICLE_TEMPERATURE_RISE = 0.01;
+/* fog left by secondary fire particles, in FogDensity units (1/4096) */
+static constexpr uint16_t SMOKE_PARTICLE_FOG_RISE = 4;
 
 struct SimulationConfig {
     double flow_friction;
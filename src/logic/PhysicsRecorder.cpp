@@ -0,0 +1,602 @@
+#include "PhysicsRecorder.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include "io/Common.hpp"
+
+static const char recording_magic[4] = {'M', 'L', 'P', 'R'};
+static constexpr uint16_t recording_version = 1;
+
+static constexpr uint8_t FRAME_KEY = 'K';
+static constexpr uint8_t FRAME_DELTA = 'D';
+
+/* free functions */
+
+static inline void put_uint(std::vector<uint8_t> &buf,
+                            uint64_t value,
+                            unsigned int bytes)
+{
+    for (unsigned int i = 0; i < bytes; i++) {
+        buf.push_back(value & 0xff);
+        value >>= 8;
+    }
+}
+
+static inline void put_double(std::vector<uint8_t> &buf, double value)
+{
+    uint64_t raw;
+    static_assert(sizeof(raw) == sizeof(value), "unexpected double size");
+    memcpy(&raw, &value, sizeof(raw));
+    put_uint(buf, raw, sizeof(raw));
+}
+
+static inline void put_varint(std::vector<uint8_t> &buf, uint32_t value)
+{
+    while (value >= 0x80) {
+        buf.push_back((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    buf.push_back(value);
+}
+
+static inline uint64_t get_uint(const uint8_t *&pos, unsigned int bytes)
+{
+    uint64_t result = 0;
+    for (unsigned int i = 0; i < bytes; i++) {
+        result |= uint64_t(*pos++) << (8*i);
+    }
+    return result;
+}
+
+static inline double get_double(const uint8_t *&pos)
+{
+    const uint64_t raw = get_uint(pos, sizeof(raw));
+    double value;
+    memcpy(&value, &raw, sizeof(value));
+    return value;
+}
+
+static inline uint32_t get_varint(const uint8_t *&pos, const uint8_t *end)
+{
+    uint32_t result = 0;
+    unsigned int shift = 0;
+    while (true) {
+        if (pos == end || shift > 28) {
+            throw LevelIOError("Malformed varint in physics recording.");
+        }
+        const uint8_t byte = *pos++;
+        result |= uint32_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return result;
+        }
+        shift += 7;
+    }
+}
+
+static inline uint32_t zigzag(int32_t value)
+{
+    return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t value)
+{
+    return int32_t(value >> 1) ^ -int32_t(value & 1);
+}
+
+/**
+ * Interpret the difference of two quantized values modulo 2^bits as a
+ * signed number, so that small changes in both directions produce small
+ * numbers.
+ */
+static inline int32_t wrap_delta(uint16_t curr, uint16_t prev,
+                                 unsigned int bits)
+{
+    if (bits == 8) {
+        return int8_t(uint8_t(curr - prev));
+    }
+    return int16_t(uint16_t(curr - prev));
+}
+
+static inline void read_exactly(PyEngine::Stream &stream,
+                                void *buf, uint64_t len)
+{
+    if (stream.read(buf, len) != len) {
+        throw LevelIOError("Unexpected end of physics recording.");
+    }
+}
+
+static inline void write_exactly(PyEngine::Stream &stream,
+                                 const void *buf, uint64_t len)
+{
+    if (stream.write(buf, len) != len) {
+        throw LevelIOError("Could not write physics recording.");
+    }
+}
+
+template <PhysicsPlane plane>
+static void quantize_rows(const PhysicsSnapshot &view,
+                          CoordInt x0, CoordInt y0,
+                          CoordInt width, CoordInt height,
+                          double min, double scale, double limit,
+                          uint16_t *dest)
+{
+    for (CoordInt y = y0; y < y0 + height; y++) {
+        size_t src = x0 + y * view.width;
+        for (CoordInt x = 0; x < width; x++) {
+            const double value = (physics_plane_value<plane>(view, src++) - min)
+                * scale;
+            // written so that NaNs end up as zero
+            *dest++ = (value > 0.
+                       ? uint16_t(std::min(value, limit) + 0.5)
+                       : 0);
+        }
+    }
+}
+
+/* PhysicsRecorderConfig */
+
+PhysicsRecorderConfig::PhysicsRecorderConfig():
+    planes(),
+    bits(8),
+    interval(1),
+    keyframe_interval(64),
+    x0(0),
+    y0(0),
+    width(0),
+    height(0),
+    queue_length(16),
+    block_when_full(false)
+{
+
+}
+
+/* PhysicsRecorder */
+
+PhysicsRecorder::PhysicsRecorder(
+        const PyEngine::StreamHandle &stream,
+        const PhysicsRecorderConfig &config,
+        CoordInt automaton_width,
+        CoordInt automaton_height):
+    _stream(stream),
+    _config(config),
+    _plane_size(
+        (_config.width > 0 ? _config.width : automaton_width - _config.x0) *
+        (_config.height > 0 ? _config.height : automaton_height - _config.y0)),
+    _queue_lock(),
+    _queue_changed(),
+    _queue(),
+    _free_frames(),
+    _terminated(false),
+    _error(),
+    _previous(),
+    _frames_since_keyframe(0),
+    _payload(),
+    _dropped_frames(0),
+    _written_frames(0),
+    _thread()
+{
+    if (_config.width <= 0) {
+        _config.width = automaton_width - _config.x0;
+    }
+    if (_config.height <= 0) {
+        _config.height = automaton_height - _config.y0;
+    }
+    if (_config.interval == 0) {
+        _config.interval = 1;
+    }
+    if (_config.queue_length == 0) {
+        _config.queue_length = 1;
+    }
+
+    if (_config.bits != 8 && _config.bits != 16) {
+        throw std::invalid_argument("Physics recordings support 8 or 16 "
+                                    "bits per value only.");
+    }
+    if (_config.x0 < 0 || _config.y0 < 0 ||
+        _config.x0 + _config.width > automaton_width ||
+        _config.y0 + _config.height > automaton_height ||
+        _config.width <= 0 || _config.height <= 0)
+    {
+        throw std::invalid_argument("Recorded region exceeds the automaton.");
+    }
+    if (_config.planes.empty()) {
+        throw std::invalid_argument("No planes to record.");
+    }
+
+    write_header();
+
+    _thread = std::thread(&PhysicsRecorder::execute, this);
+}
+
+PhysicsRecorder::~PhysicsRecorder()
+{
+    try {
+        finish();
+    } catch (...) {
+        // destructors must not throw; see finish()
+    }
+}
+
+std::unique_ptr<PhysicsRecorder::Frame> PhysicsRecorder::get_free_frame()
+{
+    std::unique_ptr<Frame> frame;
+    if (!_free_frames.empty()) {
+        frame = std::move(_free_frames.back());
+        _free_frames.pop_back();
+    } else {
+        frame = std::unique_ptr<Frame>(new Frame());
+        frame->values.resize(_plane_size * _config.planes.size());
+    }
+    return frame;
+}
+
+void PhysicsRecorder::quantize(const PhysicsSnapshot &view,
+                               Frame &frame) const
+{
+    const double limit = (1u << _config.bits) - 1;
+
+    uint16_t *dest = frame.values.data();
+    for (const PhysicsRecordedPlane &plane: _config.planes) {
+        const double scale = (plane.max > plane.min
+                              ? limit / (plane.max - plane.min)
+                              : 0.);
+
+#define DISPATCH(p)                                                     \
+        case p:                                                         \
+        {                                                               \
+            quantize_rows<p>(view, _config.x0, _config.y0,              \
+                             _config.width, _config.height,             \
+                             plane.min, scale, limit, dest);            \
+            break;                                                      \
+        }
+
+        switch (plane.plane) {
+        DISPATCH(PhysicsPlane::AIR_PRESSURE)
+        DISPATCH(PhysicsPlane::TEMPERATURE)
+        DISPATCH(PhysicsPlane::FOG_DENSITY)
+        DISPATCH(PhysicsPlane::FLOW_X)
+        DISPATCH(PhysicsPlane::FLOW_Y)
+        }
+
+#undef DISPATCH
+
+        dest += _plane_size;
+    }
+}
+
+void PhysicsRecorder::write_header()
+{
+    std::vector<uint8_t> buf;
+    buf.insert(buf.end(), recording_magic, recording_magic + 4);
+    put_uint(buf, recording_version, 2);
+    put_uint(buf, _config.planes.size(), 2);
+    put_uint(buf, _config.bits, 1);
+    put_uint(buf, 0, 1);
+    put_uint(buf, _config.interval, 4);
+    put_uint(buf, _config.keyframe_interval, 4);
+    put_uint(buf, uint32_t(_config.x0), 4);
+    put_uint(buf, uint32_t(_config.y0), 4);
+    put_uint(buf, uint32_t(_config.width), 4);
+    put_uint(buf, uint32_t(_config.height), 4);
+    for (const PhysicsRecordedPlane &plane: _config.planes) {
+        put_uint(buf, static_cast<uint8_t>(plane.plane), 1);
+        put_double(buf, plane.min);
+        put_double(buf, plane.max);
+    }
+    write_exactly(*_stream, buf.data(), buf.size());
+}
+
+void PhysicsRecorder::write_frame(const Frame &frame)
+{
+    const bool keyframe = !_previous ||
+        _frames_since_keyframe >= _config.keyframe_interval;
+
+    _payload.clear();
+    // reserve room for the frame header, which is filled in below
+    _payload.resize(9);
+
+    if (keyframe) {
+        for (uint16_t value: frame.values) {
+            put_uint(_payload, value, _config.bits / 8);
+        }
+        _frames_since_keyframe = 0;
+    } else {
+        const uint16_t *prev = _previous->values.data();
+        const uint16_t *curr = frame.values.data();
+        for (unsigned int p = 0; p < _config.planes.size(); p++) {
+            size_t i = 0;
+            while (i < _plane_size) {
+                const size_t run_start = i;
+                while (i < _plane_size && curr[i] == prev[i]) {
+                    i++;
+                }
+                const size_t literal_start = i;
+                while (i < _plane_size && curr[i] != prev[i]) {
+                    i++;
+                }
+                put_varint(_payload, literal_start - run_start);
+                put_varint(_payload, i - literal_start);
+                for (size_t j = literal_start; j < i; j++) {
+                    put_varint(_payload, zigzag(
+                        wrap_delta(curr[j], prev[j], _config.bits)));
+                }
+            }
+            prev += _plane_size;
+            curr += _plane_size;
+        }
+        _frames_since_keyframe++;
+    }
+
+    std::vector<uint8_t> header;
+    header.reserve(9);
+    put_uint(header, keyframe ? FRAME_KEY : FRAME_DELTA, 1);
+    put_uint(header, uint32_t(frame.epoch), 4);
+    put_uint(header, _payload.size() - 9, 4);
+    std::copy(header.begin(), header.end(), _payload.begin());
+
+    write_exactly(*_stream, _payload.data(), _payload.size());
+}
+
+void PhysicsRecorder::execute()
+{
+    while (true) {
+        std::unique_ptr<Frame> frame;
+        {
+            std::unique_lock<std::mutex> lock(_queue_lock);
+            _queue_changed.wait(lock, [this]() {
+                    return _terminated || !_queue.empty();
+                });
+            if (_queue.empty()) {
+                // terminated and everything has been written
+                return;
+            }
+            frame = std::move(_queue.front());
+            _queue.pop_front();
+        }
+        _queue_changed.notify_all();
+
+        try {
+            write_frame(*frame);
+        } catch (...) {
+            // this thread must not throw; the error is passed on to the
+            // user of the recorder by capture() and finish()
+            {
+                std::lock_guard<std::mutex> lock(_queue_lock);
+                _error = std::current_exception();
+                _queue.clear();
+            }
+            _queue_changed.notify_all();
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(_queue_lock);
+        _written_frames++;
+        if (_previous) {
+            _free_frames.emplace_back(std::move(_previous));
+        }
+        _previous = std::move(frame);
+    }
+}
+
+bool PhysicsRecorder::capture(const PhysicsSnapshot &view)
+{
+    if (view.epoch % _config.interval != 0) {
+        return false;
+    }
+
+    std::unique_ptr<Frame> frame;
+    {
+        std::unique_lock<std::mutex> lock(_queue_lock);
+        if (_terminated) {
+            throw std::logic_error("The physics recording has been "
+                                   "finished.");
+        }
+        if (_error) {
+            std::rethrow_exception(_error);
+        }
+        if (_queue.size() >= _config.queue_length) {
+            if (!_config.block_when_full) {
+                _dropped_frames++;
+                return false;
+            }
+            _queue_changed.wait(lock, [this]() {
+                    return _error || _queue.size() < _config.queue_length;
+                });
+            if (_error) {
+                std::rethrow_exception(_error);
+            }
+        }
+        frame = get_free_frame();
+    }
+
+    frame->epoch = view.epoch;
+    quantize(view, *frame);
+
+    {
+        std::lock_guard<std::mutex> lock(_queue_lock);
+        _queue.emplace_back(std::move(frame));
+    }
+    _queue_changed.notify_all();
+    return true;
+}
+
+void PhysicsRecorder::finish()
+{
+    if (_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(_queue_lock);
+            _terminated = true;
+        }
+        _queue_changed.notify_all();
+        _thread.join();
+        if (!_error) {
+            _stream->flush();
+        }
+    }
+
+    if (_error) {
+        std::rethrow_exception(_error);
+    }
+}
+
+size_t PhysicsRecorder::dropped_frames()
+{
+    std::lock_guard<std::mutex> lock(_queue_lock);
+    return _dropped_frames;
+}
+
+size_t PhysicsRecorder::written_frames()
+{
+    std::lock_guard<std::mutex> lock(_queue_lock);
+    return _written_frames;
+}
+
+/* PhysicsRecordingFrame */
+
+double PhysicsRecordingFrame::value(const PhysicsRecorderConfig &header,
+                                    unsigned int plane_index,
+                                    CoordInt x, CoordInt y) const
+{
+    const PhysicsRecordedPlane &plane = header.planes[plane_index];
+    const size_t plane_size = header.width * header.height;
+    const double limit = (1u << header.bits) - 1;
+    const uint16_t raw = quantized[plane_index * plane_size
+                                   + x + y * header.width];
+    return plane.min + raw * (plane.max - plane.min) / limit;
+}
+
+/* PhysicsRecordingReader */
+
+PhysicsRecordingReader::PhysicsRecordingReader(
+        const PyEngine::StreamHandle &stream):
+    _stream(stream),
+    _header(),
+    _payload(),
+    _previous(),
+    _has_previous(false)
+{
+    uint8_t fixed[34];
+    read_exactly(*_stream, fixed, sizeof(fixed));
+    if (memcmp(fixed, recording_magic, 4) != 0) {
+        throw LevelIOError("Not a physics recording.");
+    }
+
+    const uint8_t *pos = &fixed[4];
+    if (get_uint(pos, 2) != recording_version) {
+        throw LevelIOError("Unsupported physics recording version.");
+    }
+    const unsigned int plane_count = get_uint(pos, 2);
+    _header.bits = get_uint(pos, 1);
+    get_uint(pos, 1);
+    _header.interval = get_uint(pos, 4);
+    _header.keyframe_interval = get_uint(pos, 4);
+    _header.x0 = int32_t(get_uint(pos, 4));
+    _header.y0 = int32_t(get_uint(pos, 4));
+    _header.width = int32_t(get_uint(pos, 4));
+    _header.height = int32_t(get_uint(pos, 4));
+
+    if ((_header.bits != 8 && _header.bits != 16) ||
+        _header.width <= 0 || _header.height <= 0 ||
+        plane_count == 0)
+    {
+        throw LevelIOError("Malformed physics recording header.");
+    }
+
+    for (unsigned int i = 0; i < plane_count; i++) {
+        uint8_t plane_raw[17];
+        read_exactly(*_stream, plane_raw, sizeof(plane_raw));
+        pos = &plane_raw[0];
+
+        PhysicsRecordedPlane plane;
+        const uint8_t plane_type = get_uint(pos, 1);
+        if (plane_type > static_cast<uint8_t>(PhysicsPlane::FLOW_Y)) {
+            throw LevelIOError("Unknown plane in physics recording.");
+        }
+        plane.plane = static_cast<PhysicsPlane>(plane_type);
+        plane.min = get_double(pos);
+        plane.max = get_double(pos);
+        _header.planes.push_back(plane);
+    }
+}
+
+bool PhysicsRecordingReader::next_frame(PhysicsRecordingFrame &frame)
+{
+    uint8_t frame_header[9];
+    const uint64_t header_read = _stream->read(frame_header,
+                                               sizeof(frame_header));
+    if (header_read == 0) {
+        return false;
+    } else if (header_read != sizeof(frame_header)) {
+        throw LevelIOError("Truncated frame in physics recording.");
+    }
+
+    const uint8_t *pos = &frame_header[0];
+    const uint8_t type = get_uint(pos, 1);
+    frame.epoch = get_uint(pos, 4);
+    const uint32_t payload_size = get_uint(pos, 4);
+
+    _payload.resize(payload_size);
+    read_exactly(*_stream, _payload.data(), payload_size);
+
+    const size_t plane_size = _header.width * _header.height;
+    const size_t total_size = plane_size * _header.planes.size();
+    const uint16_t mask = (1u << _header.bits) - 1;
+    frame.quantized.resize(total_size);
+
+    pos = _payload.data();
+    const uint8_t *const end = pos + _payload.size();
+
+    if (type == FRAME_KEY) {
+        const unsigned int bytes = _header.bits / 8;
+        if (payload_size != total_size * bytes) {
+            throw LevelIOError("Malformed keyframe in physics recording.");
+        }
+        for (size_t i = 0; i < total_size; i++) {
+            frame.quantized[i] = get_uint(pos, bytes);
+        }
+        frame.keyframe = true;
+    } else if (type == FRAME_DELTA) {
+        if (!_has_previous) {
+            throw LevelIOError("Delta frame without preceding keyframe in "
+                               "physics recording.");
+        }
+        for (size_t offs = 0; offs < total_size; offs += plane_size) {
+            size_t i = 0;
+            while (i < plane_size) {
+                const size_t run = get_varint(pos, end);
+                const size_t literals = get_varint(pos, end);
+                // the writer never emits empty pairs; without progress,
+                // the loop would only end once the varints run out
+                if (run + literals == 0 ||
+                    run > plane_size - i ||
+                    literals > plane_size - i - run)
+                {
+                    throw LevelIOError("Malformed delta frame in physics "
+                                       "recording.");
+                }
+                std::copy(&_previous[offs + i],
+                          &_previous[offs + i + run],
+                          &frame.quantized[offs + i]);
+                i += run;
+                for (size_t j = 0; j < literals; j++, i++) {
+                    const int32_t delta = unzigzag(get_varint(pos, end));
+                    frame.quantized[offs + i] =
+                        (_previous[offs + i] + delta) & mask;
+                }
+            }
+        }
+        if (pos != end) {
+            throw LevelIOError("Malformed delta frame in physics "
+                               "recording.");
+        }
+        frame.keyframe = false;
+    } else {
+        throw LevelIOError("Unknown frame type in physics recording.");
+    }
+
+    _previous = frame.quantized;
+    _has_previous = true;
+    return true;
+}
@@ -0,0 +1,221 @@
+#ifndef _ML_PHYSICS_RECORDER_H
+#define _ML_PHYSICS_RECORDER_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <CEngine/IO/Stream.hpp>
+
+#include "PhysicsColourMap.hpp"
+
+/* The recording is a sequence of little endian binary records. It starts
+ * with a header:
+ *
+ *   char[4]  magic "MLPR"
+ *   uint16   version
+ *   uint16   plane count
+ *   uint8    bits per value (8 or 16)
+ *   uint8    reserved (0)
+ *   uint32   capture interval in ticks
+ *   uint32   keyframe interval in frames
+ *   int32    x0, y0, width, height of the recorded region
+ *   per plane:
+ *     uint8    PhysicsPlane
+ *     float64  min, max (mapped to 0 and the largest quantized value)
+ *
+ * followed by frames:
+ *
+ *   uint8    frame type ('K' for keyframes, 'D' for delta frames)
+ *   uint32   epoch of the automaton at which the frame was captured
+ *   uint32   payload length in bytes
+ *   payload
+ *
+ * A keyframe payload contains the quantized values of all planes, one
+ * after another, in row-major order. Delta frames contain for each plane
+ * the differences (modulo 2^bits) to the previous frame, encoded as
+ * repetitions of (varint zero run length, varint literal count, literal
+ * count zig-zag varints) until the plane is complete.
+ */
+
+struct PhysicsRecordedPlane {
+    PhysicsPlane plane;
+    double min, max;
+};
+
+struct PhysicsRecorderConfig {
+    PhysicsRecorderConfig();
+
+    std::vector<PhysicsRecordedPlane> planes;
+
+    /* quantization, must be 8 or 16 */
+    unsigned int bits;
+
+    /* capture every interval-th epoch of the automaton */
+    TickCounter interval;
+
+    /* write a full frame after this many delta frames */
+    unsigned int keyframe_interval;
+
+    /* recorded region; a width or height of zero selects everything
+     * from (x0, y0) to the edge of the automaton */
+    CoordInt x0, y0, width, height;
+
+    /* maximum amount of frames waiting to be written */
+    size_t queue_length;
+
+    /* if true, capture() waits for room in the queue instead of dropping
+     * the frame */
+    bool block_when_full;
+};
+
+/**
+ * Record planes of the physics simulation into a stream.
+ *
+ * capture() only quantizes the recorded region into a pooled buffer and
+ * queues it; delta coding and writing take place on a background thread.
+ * If writing fails, the recorder stops and the error is thrown by the
+ * next call to capture() or finish().
+ */
+class PhysicsRecorder
+{
+public:
+    PhysicsRecorder(const PyEngine::StreamHandle &stream,
+                    const PhysicsRecorderConfig &config,
+                    CoordInt automaton_width,
+                    CoordInt automaton_height);
+    PhysicsRecorder(const PhysicsRecorder &ref) = delete;
+    PhysicsRecorder &operator=(const PhysicsRecorder &ref) = delete;
+
+    /**
+     * Calls finish(). Errors are not thrown from the destructor, so call
+     * finish() explicitly to learn whether the recording is complete.
+     */
+    ~PhysicsRecorder();
+
+private:
+    struct Frame {
+        TickCounter epoch;
+        std::vector<uint16_t> values;
+    };
+
+private:
+    PyEngine::StreamHandle _stream;
+    PhysicsRecorderConfig _config;
+    const size_t _plane_size;
+
+    std::mutex _queue_lock;
+    std::condition_variable _queue_changed;
+    std::deque<std::unique_ptr<Frame>> _queue;
+    std::vector<std::unique_ptr<Frame>> _free_frames;
+    bool _terminated;
+
+    /* set by the writer thread if writing failed; it stops then */
+    std::exception_ptr _error;
+
+    /* only used by the writer thread */
+    std::unique_ptr<Frame> _previous;
+    unsigned int _frames_since_keyframe;
+    std::vector<uint8_t> _payload;
+
+    size_t _dropped_frames;
+    size_t _written_frames;
+
+    std::thread _thread;
+
+private:
+    std::unique_ptr<Frame> get_free_frame();
+    void quantize(const PhysicsSnapshot &view, Frame &frame) const;
+    void write_frame(const Frame &frame);
+    void write_header();
+    void execute();
+
+public:
+    /**
+     * Capture the given snapshot if its epoch is due according to the
+     * configured interval.
+     *
+     * @return true if a frame was queued.
+     */
+    bool capture(const PhysicsSnapshot &view);
+
+    /**
+     * Write all pending frames, flush the stream and stop the writer
+     * thread. Throws the error which stopped the writer, if any. No frames
+     * can be captured afterwards.
+     */
+    void finish();
+
+    inline const PhysicsRecorderConfig &config() const
+    {
+        return _config;
+    }
+
+    /**
+     * Number of frames dropped because the queue was full.
+     */
+    size_t dropped_frames();
+
+    /**
+     * Number of frames written to the stream so far.
+     */
+    size_t written_frames();
+
+};
+
+/**
+ * A frame loaded from a physics recording. The values are stored per
+ * plane in the order of the header, each plane in row-major order.
+ */
+struct PhysicsRecordingFrame {
+    TickCounter epoch;
+    bool keyframe;
+    std::vector<uint16_t> quantized;
+
+    /**
+     * Return the dequantized value of the given plane at the given
+     * position relative to the recorded region.
+     */
+    double value(const PhysicsRecorderConfig &header,
+                 unsigned int plane_index,
+                 CoordInt x, CoordInt y) const;
+};
+
+/**
+ * Read back the frames of a recording written by PhysicsRecorder.
+ */
+class PhysicsRecordingReader
+{
+public:
+    /**
+     * Read the header of the recording. Throws LevelIOError if the
+     * stream does not contain a physics recording.
+     */
+    explicit PhysicsRecordingReader(const PyEngine::StreamHandle &stream);
+
+private:
+    PyEngine::StreamHandle _stream;
+    PhysicsRecorderConfig _header;
+    std::vector<uint8_t> _payload;
+    std::vector<uint16_t> _previous;
+    bool _has_previous;
+
+public:
+    inline const PhysicsRecorderConfig &header() const
+    {
+        return _header;
+    }
+
+    /**
+     * Load the next frame into *frame*.
+     *
+     * @return false if the end of the stream has been reached.
+     */
+    bool next_frame(PhysicsRecordingFrame &frame);
+
+};
+
+#endif
@@ -1,5 +1,7 @@
 #include "PlayerObject.hpp"
 
+#include "LevelState.hpp"
+
 static const CellStamp player_object_stamp(
     {
         false, true, true, true, false,
@@ -68,6 +70,31 @@ bool PlayerObject::idle()
     return true;
 }
 
+bool PlayerObject::is_awake() const
+{
+    // actions are set from outside the level
+    return true;
+}
+
+void PlayerObject::restore_state(StateReader &reader)
+{
+    bool has_weapon;
+    reader.read(action);
+    reader.read(move_direction);
+    reader.read(has_weapon);
+    active_weapon = (has_weapon ? &flamethrower : nullptr);
+    flamethrower.restore_state(reader);
+}
+
+void PlayerObject::save_state(StateWriter &writer) const
+{
+    // the flamethrower is the only weapon there is
+    writer.write(action);
+    writer.write(move_direction);
+    writer.write(bool(active_weapon));
+    flamethrower.save_state(writer);
+}
+
 std::unique_ptr<ObjectView> PlayerObject::setup_view(
     TileMaterialManager &matman)
 {
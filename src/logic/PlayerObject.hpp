@@ -35,6 +35,9 @@ protected:
 
 public:
     bool idle() override;
+    bool is_awake() const override;
+    void restore_state(StateReader &reader) override;
+    void save_state(StateWriter &writer) const override;
 
 };
 
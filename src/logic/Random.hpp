@@ -0,0 +1,110 @@
+#ifndef _ML_RANDOM_H
+#define _ML_RANDOM_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * The PCG32 (XSH-RR) pseudo random number generator by M. E. O'Neill.
+ *
+ * Unlike rand() and random(), an engine has no shared state and takes no
+ * locks, so each level and each thread can own one, and a run can be
+ * reproduced by seeding the engines the same way. Engines with the same
+ * seed but a different *stream* produce independent sequences.
+ *
+ * Satisfies the UniformRandomBitGenerator requirements, so it can also be
+ * used with the distributions of <random>.
+ */
+class PCG32
+{
+public:
+    typedef uint32_t result_type;
+
+public:
+    explicit PCG32(uint64_t seed = 0, uint64_t stream = 0)
+    {
+        this->seed(seed, stream);
+    }
+
+private:
+    uint64_t _state;
+    uint64_t _inc;
+
+public:
+    static constexpr result_type min()
+    {
+        return 0;
+    }
+
+    static constexpr result_type max()
+    {
+        return 0xffffffff;
+    }
+
+    void seed(uint64_t seed, uint64_t stream = 0)
+    {
+        _state = 0;
+        _inc = (stream << 1) | 1;
+        next();
+        _state += seed;
+        next();
+    }
+
+    inline uint32_t next()
+    {
+        const uint64_t old = _state;
+        _state = old * UINT64_C(6364136223846793005) + _inc;
+        const uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+        const uint32_t rot = old >> 59;
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+    inline result_type operator()()
+    {
+        return next();
+    }
+
+    /**
+     * Return a number in [0, *bound*). The result is very slightly biased
+     * for bounds which are not a power of two, which is irrelevant for the
+     * small bounds used in the game.
+     */
+    inline uint32_t below(uint32_t bound)
+    {
+        return (uint64_t(next()) * bound) >> 32;
+    }
+
+    /**
+     * Return a float in [0, 1), using the upper 24 bits of the next number
+     * so that all results are exactly representable.
+     */
+    inline float uniform()
+    {
+        return (next() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    inline float uniform(float min, float max)
+    {
+        return min + (max - min) * uniform();
+    }
+
+    /**
+     * Fill *dest* with *n* floats in [*min*, *max*). This produces the same
+     * numbers as *n* calls to uniform(), but keeps the state in registers,
+     * which makes it the preferred way to draw the numbers for a batch of
+     * particles at once.
+     */
+    void fill_uniform(float *dest, size_t n,
+                      float min = 0.f, float max = 1.f)
+    {
+        PCG32 local(*this);
+        const float scale = (max - min) * (1.0f / 16777216.0f);
+        for (size_t i = 0; i < n; i++) {
+            dest[i] = min + (local.next() >> 8) * scale;
+        }
+        *this = local;
+    }
+
+};
+
+#endif
@@ -161,6 +161,10 @@ public:
         return _border;
     }
 
+    inline bool get_blocking(int x, int y) const {
+        return _map[x + y * subdivision_count];
+    }
+
 public:
     inline bool non_empty() const {
         return _map_coords_len != 0;
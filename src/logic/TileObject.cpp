@@ -0,0 +1,9 @@
+#include "TileObject.hpp"
+
+/* TileObject */
+
+TileObject::TileObject(Level *level, const ObjectInfo &info):
+    GameObject(info, level)
+{
+
+}
@@ -0,0 +1,22 @@
+#ifndef _ML_TILE_OBJECT_H
+#define _ML_TILE_OBJECT_H
+
+#include "GameObject.hpp"
+
+/**
+ * An object whose properties are entirely defined by a tile of a tileset,
+ * as placed in the default layer of a level. It has the default behaviour
+ * of GameObject (gravity and rolling, as far as the tile flags ask for it)
+ * and no view of its own.
+ *
+ * The ObjectInfo is not owned by the object; see
+ * Level::adopt_object_info().
+ */
+class TileObject: public GameObject
+{
+public:
+    TileObject(Level *level, const ObjectInfo &info);
+
+};
+
+#endif
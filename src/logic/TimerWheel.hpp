@@ -0,0 +1,306 @@
+#ifndef _ML_TIMER_WHEEL_H
+#define _ML_TIMER_WHEEL_H
+
+#include <array>
+#include <cassert>
+#include <vector>
+
+#include "Types.hpp"
+
+/**
+ * Refers to a timer scheduled in a TimerWheel. Handles stay safe to use
+ * after the timer has fired or has been cancelled; they simply do not
+ * refer to anything anymore.
+ */
+struct TimerHandle
+{
+    TimerHandle():
+        index(invalid_index),
+        generation(0)
+    {
+
+    }
+
+    TimerHandle(uint32_t index, uint32_t generation):
+        index(index),
+        generation(generation)
+    {
+
+    }
+
+    static constexpr uint32_t invalid_index = 0xffffffff;
+
+    uint32_t index;
+    uint32_t generation;
+
+    inline bool valid() const
+    {
+        return index != invalid_index;
+    }
+};
+
+/**
+ * A hierarchical timing wheel which schedules payloads by TickCounter.
+ *
+ * The wheel has four levels of 256 slots each, one level per byte of the
+ * tick counter. A timer lives in the level of the most significant byte in
+ * which its trigger time differs from the current time of the wheel and is
+ * moved to the lower levels when the lower bytes of the current time roll
+ * over. Scheduling, cancelling and firing are O(1) per timer.
+ *
+ * Timers scheduled for the same tick fire in the order in which they have
+ * been scheduled. Payloads are stored in a slab of entries which are
+ * recycled through a free list, so steady-state operation does not
+ * allocate. Cancelled timers are only unlinked when their slot comes up.
+ */
+template <typename _Payload>
+class TimerWheel
+{
+public:
+    typedef _Payload Payload;
+
+    static constexpr unsigned int level_count = 4;
+    static constexpr unsigned int slot_bits = 8;
+    static constexpr unsigned int slot_count = 1u << slot_bits;
+
+public:
+    explicit TimerWheel(TickCounter now = 0):
+        _now(now),
+        _entries(),
+        _free_head(nil),
+        _pending(0)
+    {
+        for (auto &level: _slots) {
+            for (auto &slot: level) {
+                slot.head = nil;
+                slot.tail = nil;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel &ref) = delete;
+    TimerWheel &operator=(const TimerWheel &ref) = delete;
+
+    template <typename _Other>
+    friend class TimerWheel;
+
+private:
+    static constexpr uint32_t nil = 0xffffffff;
+
+    struct Entry {
+        TickCounter trigger_at;
+        uint32_t next;
+        uint32_t generation;
+        bool scheduled;
+        bool cancelled;
+        Payload payload;
+    };
+
+    struct Slot {
+        uint32_t head, tail;
+    };
+
+    TickCounter _now;
+    std::vector<Entry> _entries;
+    uint32_t _free_head;
+    std::array<std::array<Slot, slot_count>, level_count> _slots;
+    size_t _pending;
+
+private:
+    uint32_t allocate()
+    {
+        if (_free_head != nil) {
+            const uint32_t index = _free_head;
+            _free_head = _entries[index].next;
+            return index;
+        }
+        _entries.emplace_back();
+        Entry &entry = _entries.back();
+        entry.generation = 0;
+        return _entries.size() - 1;
+    }
+
+    void release(uint32_t index)
+    {
+        Entry &entry = _entries[index];
+        entry.scheduled = false;
+        entry.generation += 1;
+        entry.next = _free_head;
+        _free_head = index;
+        _pending -= 1;
+    }
+
+    void link(uint32_t index)
+    {
+        Entry &entry = _entries[index];
+        const TickCounter diff = entry.trigger_at ^ _now;
+        unsigned int level = level_count - 1;
+        while (level > 0 && (diff >> (level * slot_bits)) == 0) {
+            level--;
+        }
+        Slot &slot = _slots[level][(entry.trigger_at >> (level * slot_bits))
+                                   & (slot_count - 1)];
+
+        entry.next = nil;
+        if (slot.tail == nil) {
+            slot.head = index;
+        } else {
+            _entries[slot.tail].next = index;
+        }
+        slot.tail = index;
+    }
+
+    inline uint32_t detach(unsigned int level, unsigned int slot_index)
+    {
+        Slot &slot = _slots[level][slot_index];
+        const uint32_t head = slot.head;
+        slot.head = nil;
+        slot.tail = nil;
+        return head;
+    }
+
+    void cascade(unsigned int level)
+    {
+        uint32_t index = detach(
+            level, (_now >> (level * slot_bits)) & (slot_count - 1));
+        while (index != nil) {
+            const uint32_t next = _entries[index].next;
+            if (_entries[index].cancelled) {
+                release(index);
+            } else {
+                link(index);
+            }
+            index = next;
+        }
+    }
+
+public:
+    /**
+     * Schedule *payload* to be fired at the tick *trigger_at*. Timers for
+     * the current or a past tick fire with the next call to advance().
+     */
+    TimerHandle schedule(TickCounter trigger_at, const Payload &payload)
+    {
+        const uint32_t index = allocate();
+        Entry &entry = _entries[index];
+        entry.trigger_at = (trigger_at > _now ? trigger_at : _now + 1);
+        entry.scheduled = true;
+        entry.cancelled = false;
+        entry.payload = payload;
+        _pending += 1;
+        link(index);
+        return TimerHandle(index, entry.generation);
+    }
+
+    /**
+     * Cancel the timer referred to by *handle*, if it has not fired yet.
+     *
+     * @return true if a pending timer has been cancelled.
+     */
+    bool cancel(const TimerHandle &handle)
+    {
+        if (!handle.valid() || handle.index >= _entries.size()) {
+            return false;
+        }
+        Entry &entry = _entries[handle.index];
+        if (entry.generation != handle.generation
+                || !entry.scheduled
+                || entry.cancelled)
+        {
+            return false;
+        }
+        entry.cancelled = true;
+        return true;
+    }
+
+    /**
+     * Advance the wheel up to and including tick *now* and call
+     * *callback* with the payload of each timer which is due.
+     *
+     * The timer is released before the callback is called, so the
+     * callback may schedule new timers and cancel others (including,
+     * harmlessly, the one being fired).
+     */
+    template <typename Callback>
+    void advance(TickCounter now, Callback &&callback)
+    {
+        while (_now != now) {
+            _now += 1;
+
+            for (unsigned int level = level_count - 1; level > 0; level--) {
+                const TickCounter mask = (TickCounter(1) << (level * slot_bits)) - 1;
+                if ((_now & mask) == 0) {
+                    cascade(level);
+                }
+            }
+
+            uint32_t index = detach(0, _now & (slot_count - 1));
+            while (index != nil) {
+                Entry &entry = _entries[index];
+                const uint32_t next = entry.next;
+                if (entry.cancelled) {
+                    release(index);
+                } else {
+                    assert(entry.trigger_at == _now);
+                    const Payload payload = entry.payload;
+                    release(index);
+                    callback(payload);
+                }
+                index = next;
+            }
+        }
+    }
+
+    /**
+     * Make this wheel an exact copy of *other*, so that handles of timers
+     * in *other* refer to the same timers in this wheel. The payloads of
+     * pending timers are converted with *convert*; those of cancelled and
+     * released entries are value-initialized, as they are never passed to
+     * a callback.
+     */
+    template <typename _Other, typename Convert>
+    void assign(const TimerWheel<_Other> &other, Convert &&convert)
+    {
+        _now = other._now;
+        _free_head = other._free_head;
+        _pending = other._pending;
+
+        for (unsigned int level = 0; level < level_count; level++) {
+            for (unsigned int slot = 0; slot < slot_count; slot++) {
+                _slots[level][slot].head = other._slots[level][slot].head;
+                _slots[level][slot].tail = other._slots[level][slot].tail;
+            }
+        }
+
+        _entries.resize(other._entries.size());
+        for (size_t i = 0; i < _entries.size(); i++) {
+            const auto &src = other._entries[i];
+            Entry &dest = _entries[i];
+            dest.trigger_at = src.trigger_at;
+            dest.next = src.next;
+            dest.generation = src.generation;
+            dest.scheduled = src.scheduled;
+            dest.cancelled = src.cancelled;
+            dest.payload = (src.scheduled && !src.cancelled
+                            ? convert(src.payload)
+                            : Payload());
+        }
+    }
+
+    /**
+     * Number of scheduled timers, including cancelled timers which have
+     * not been unlinked yet.
+     */
+    inline size_t pending() const
+    {
+        return _pending;
+    }
+
+    inline TickCounter now() const
+    {
+        return _now;
+    }
+
+};
+
+#endif
@@ -1,5 +1,7 @@
 #include "WallObject.hpp"
 
+#include "Level.hpp"
+
 static const CellStamp squarewall_object_stamp(
     {
         true, true, true, true, true,
@@ -1,5 +1,8 @@
 #include "Weapon.hpp"
 
+#include "Level.hpp"
+#include "LevelState.hpp"
+
 /* Flamethrower */
 
 Flamethrower::Flamethrower():
@@ -9,6 +12,18 @@ Flamethrower::Flamethrower():
 
 }
 
+void Flamethrower::restore_state(StateReader &reader)
+{
+    reader.read(fuel);
+    reader.read(subticks);
+}
+
+void Flamethrower::save_state(StateWriter &writer) const
+{
+    writer.write(fuel);
+    writer.write(subticks);
+}
+
 bool Flamethrower::empty() const
 {
     return fuel > 0;
@@ -30,16 +45,30 @@ void Flamethrower::fire(Level *level,
 
     fuel -= 1;
 
-    PhysicsParticle *const part = level->particles().spawn();
-    part->type = ParticleType::FIRE;
-    part->x = user.x + 0.5 + direction.x * 0.6;
-    part->y = user.y + 0.5 + direction.y * 0.6;
-    part->vx = 8. * direction.x + ((float)random() / RAND_MAX)*0.6 - 0.3;
-    part->vy = 8. * direction.y + ((float)random() / RAND_MAX)*0.6 - 0.3;
-    part->ax = 0;
-    part->ay = 1.1;
-    part->phi = ((float)random() / RAND_MAX)*2*3.14159;
-    part->vphi = (((float)random() / RAND_MAX)-0.5)*3.14159/5.0;
-    part->aphi = 0;
-    part->lifetime = 1;
+    // the engine and the particles are shared by all objects of the level
+    level->run_shared([level, user, direction]() {
+        float r[4];
+        level->rng().fill_uniform(r, 4);
+
+        PhysicsParticle part;
+        part.type = ParticleType::FIRE;
+        part.age = 0;
+        part.ctr = 0;
+        part.x = user.x + 0.5 + direction.x * 0.6;
+        part.y = user.y + 0.5 + direction.y * 0.6;
+        part.vx = 8. * direction.x + r[0]*0.6 - 0.3;
+        part.vy = 8. * direction.y + r[1]*0.6 - 0.3;
+        part.ax = 0;
+        part.ay = 1.1;
+        part.phi = r[2]*2*3.14159;
+        part.vphi = (r[3]-0.5)*3.14159/5.0;
+        part.aphi = 0;
+        part.lifetime = 1;
+        level->particles().spawn(part);
+
+        const CoordInt nozzle_x = user.x + direction.x;
+        const CoordInt nozzle_y = user.y + direction.y;
+        level->add_impulse(nozzle_x, nozzle_y, nozzle_x, nozzle_y,
+                           0, FLAMETHROWER_TEMPERATURE_RISE);
+    });
 }
@@ -31,6 +31,9 @@ public:
               const CoordPair &user,
               const CoordPair &direction) override;
 
+    /* see GameObject::save_state() */
+    void restore_state(StateReader &reader);
+    void save_state(StateWriter &writer) const;
 
 };
 
@@ -0,0 +1,85 @@
+#include "WorkerPool.hpp"
+
+/* WorkerPool */
+
+WorkerPool::WorkerPool(unsigned int thread_count):
+    _thread_count(thread_count > 0
+                  ? thread_count
+                  : PyEngine::get_hardware_thread_count()),
+    _finished_signal(),
+    _resume_signals(_thread_count - 1),
+    _terminated(false),
+    _job(nullptr),
+    _job_count(0),
+    _next_index(0),
+    _threads()
+{
+    // worker 0 is the thread calling parallel_for()
+    for (unsigned int i = 1; i < _thread_count; i++) {
+        _threads.emplace_back(&WorkerPool::execute, this, i);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    _terminated = true;
+    for (auto &sem: _resume_signals) {
+        sem.post();
+    }
+    for (auto &thread: _threads) {
+        thread.join();
+    }
+}
+
+void WorkerPool::run_jobs(unsigned int worker)
+{
+    while (true) {
+        const size_t index = _next_index.fetch_add(1);
+        if (index >= _job_count) {
+            return;
+        }
+        (*_job)(index, worker);
+    }
+}
+
+void WorkerPool::execute(unsigned int worker)
+{
+    PyEngine::Semaphore &resume_signal = _resume_signals[worker-1];
+    while (true) {
+        resume_signal.wait();
+        if (_terminated) {
+            return;
+        }
+        run_jobs(worker);
+        _finished_signal.post();
+    }
+}
+
+void WorkerPool::parallel_for(size_t count, const Job &job)
+{
+    if (count == 0) {
+        return;
+    }
+
+    if (_threads.empty() || count == 1) {
+        for (size_t i = 0; i < count; i++) {
+            job(i, 0);
+        }
+        return;
+    }
+
+    _job = &job;
+    _job_count = count;
+    _next_index = 0;
+
+    for (auto &sem: _resume_signals) {
+        sem.post();
+    }
+    run_jobs(0);
+    for (unsigned int i = 1; i < _thread_count; i++) {
+        _finished_signal.wait();
+    }
+
+    _job = nullptr;
+    _job_count = 0;
+}
@@ -0,0 +1,67 @@
+#ifndef _ML_WORKER_POOL_H
+#define _ML_WORKER_POOL_H
+
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <CEngine/IO/Thread.hpp>
+
+/**
+ * A small pool of worker threads to run data-parallel jobs on.
+ *
+ * The pool executes one batch of jobs at a time. The calling thread
+ * participates in the work, so a pool with a thread count of one does not
+ * spawn any threads at all and runs everything serially.
+ *
+ * Jobs are identified by their index. Which worker processes which index
+ * is not deterministic; jobs which need per-thread scratch space can use
+ * the worker number passed to them, which is always less than
+ * thread_count().
+ */
+class WorkerPool
+{
+public:
+    typedef std::function<void(size_t index, unsigned int worker)> Job;
+
+public:
+    /**
+     * Create a pool with the given amount of threads, including the
+     * calling thread. If *thread_count* is zero, the amount of hardware
+     * threads is used.
+     */
+    explicit WorkerPool(unsigned int thread_count = 0);
+    WorkerPool(const WorkerPool &ref) = delete;
+    WorkerPool &operator=(const WorkerPool &ref) = delete;
+    ~WorkerPool();
+
+private:
+    const unsigned int _thread_count;
+    PyEngine::Semaphore _finished_signal;
+    std::vector<PyEngine::Semaphore> _resume_signals;
+    std::atomic_bool _terminated;
+    const Job *_job;
+    size_t _job_count;
+    std::atomic<size_t> _next_index;
+    std::vector<std::thread> _threads;
+
+private:
+    void run_jobs(unsigned int worker);
+    void execute(unsigned int worker);
+
+public:
+    /**
+     * Call *job* for each index in [0, count) and return when all calls
+     * have finished. Must not be called recursively from within a job.
+     */
+    void parallel_for(size_t count, const Job &job);
+
+    inline unsigned int thread_count() const
+    {
+        return _thread_count;
+    }
+
+};
+
+#endif
@@ -0,0 +1,672 @@
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include <CEngine/IO/FileStream.hpp>
+#include <CEngine/Misc/Exception.hpp>
+
+#include "io/Data.hpp"
+#include "io/LevelData.hpp"
+
+#include "logic/InputRecording.hpp"
+#include "logic/Level.hpp"
+#include "logic/LevelLoader.hpp"
+#include "logic/PlayerObject.hpp"
+#include "logic/WorkerPool.hpp"
+
+using namespace PyEngine;
+
+typedef std::chrono::steady_clock Clock;
+
+struct SimOptions
+{
+    SimOptions():
+        tileset_dir("data/tilesets"),
+        ticks(1000),
+        until_settled(false),
+        jobs(0),
+        object_threads(0),
+        physics_mp(false),
+        particle_budget(ParticleSystem::default_budget),
+        check_objects(false),
+        repeat(1),
+        levels(),
+        replay()
+    {
+
+    }
+
+    std::string tileset_dir;
+    TickCounter ticks;
+    bool until_settled;
+    unsigned int jobs;
+    unsigned int object_threads;
+    bool physics_mp;
+    size_t particle_budget;
+    bool check_objects;
+    unsigned int repeat;
+
+    /* indices of the levels to run; all levels if empty */
+    std::vector<size_t> levels;
+
+    /* input to replay on each level, see --replay */
+    std::unique_ptr<InputRecording> replay;
+};
+
+struct SimRun
+{
+    std::string collection;
+    size_t index;
+    const LevelData *data;
+};
+
+struct SimResult
+{
+    TickCounter ticks;
+    bool settled;
+    double load_time;
+    double logic_time;
+    double physics_time;
+    size_t objects;
+    size_t awake;
+    size_t particles;
+    size_t peak_particles;
+    uint64_t culled_particles;
+    size_t peak_particle_memory;
+    uint64_t digest;
+
+    /* only set when replaying: whether the run ended in the digest stored
+     * in the recording */
+    bool replay_matched;
+};
+
+/**
+ * Outcome of --check-objects for a level. The ticks are counted from one;
+ * zero means that the digests matched for all ticks.
+ */
+struct CheckResult
+{
+    TickCounter ticks;
+    TickCounter diverged_at;
+};
+
+/**
+ * Loads tilesets by name from a directory on demand, for resolving the
+ * tiles referenced by a level collection.
+ */
+class TilesetCache
+{
+public:
+    explicit TilesetCache(const std::string &dir):
+        _dir(dir),
+        _tilesets()
+    {
+
+    }
+
+private:
+    std::string _dir;
+    std::unordered_map<std::string, SharedTileset> _tilesets;
+
+private:
+    SharedTileset load(const std::string &name)
+    {
+        const std::string path = _dir + "/" + name;
+        StreamHandle stream(new FileStream(path, OM_READ));
+
+        StructStream::ContainerHandle header;
+        FileType type;
+        std::tie(header, type) = load_header_from_stream(stream);
+        if (type != FT_TILESET) {
+            std::fprintf(stderr, "ml-sim: %s is not a tileset\n",
+                         path.c_str());
+            return nullptr;
+        }
+
+        return SharedTileset(complete_tileset_from_stream(header, stream));
+    }
+
+public:
+    LevelData::TileBinding lookup(const std::string &tileset_name,
+                                  const UUID &uuid)
+    {
+        auto it = _tilesets.find(tileset_name);
+        if (it == _tilesets.end()) {
+            // a missing tileset is only reported once
+            it = _tilesets.emplace(tileset_name, load(tileset_name)).first;
+        }
+
+        const SharedTileset &tileset = (*it).second;
+        if (!tileset) {
+            return std::make_pair(nullptr, nullptr);
+        }
+
+        for (const SharedTile &tile: tileset->body.tiles) {
+            if (tile->uuid == uuid) {
+                return std::make_pair(tileset, tile);
+            }
+        }
+        return std::make_pair(tileset, nullptr);
+    }
+
+};
+
+static double seconds_between(const Clock::time_point &t0,
+                              const Clock::time_point &t1)
+{
+    return std::chrono::duration<double>(t1 - t0).count();
+}
+
+static std::unique_ptr<LevelCollection> load_collection(
+    const std::string &filename,
+    TilesetCache &tilesets)
+{
+    StreamHandle stream(new FileStream(filename, OM_READ));
+
+    StructStream::ContainerHandle header;
+    FileType type;
+    std::tie(header, type) = load_header_from_stream(stream);
+    if (type != FT_LEVEL_COLLECTION) {
+        throw std::runtime_error(filename + " is not a level collection");
+    }
+
+    std::unique_ptr<LevelCollection> collection;
+    IOQuality quality;
+    std::tie(collection, quality) = complete_level_collection_from_stream(
+        header,
+        stream,
+        [&tilesets](const std::string &tileset_name, const UUID &uuid) {
+            return tilesets.lookup(tileset_name, uuid);
+        });
+
+    if (quality == IOQ_ERRORNOUS || !collection) {
+        throw std::runtime_error(filename + " could not be loaded");
+    } else if (quality == IOQ_DEGRADED) {
+        std::fprintf(stderr, "ml-sim: %s: some data was ignored\n",
+                     filename.c_str());
+    }
+
+    return collection;
+}
+
+/**
+ * Let *replay* drive the player of *level*, placing one if the level has
+ * none. Return false if the player cannot be placed.
+ */
+static bool start_replay(Level &level, const LevelData &data,
+                         const InputRecording *replay)
+{
+    const CoordInt x = replay->player_x(), y = replay->player_y();
+    if (!level.player() && x >= 0) {
+        if (x >= level.get_width() || y >= level.get_height()
+                || !level.is_cell_free(x, y))
+        {
+            std::fprintf(stderr,
+                         "ml-sim: %s: cannot place the player at %d, %d\n",
+                         data.get_display_name().c_str(), x, y);
+            return false;
+        }
+        level.place_player(level.create_object<PlayerObject>(), x, y);
+    }
+    level.replay_input(replay);
+    return true;
+}
+
+/**
+ * Run a single level and collect the statistics.
+ *
+ * The automaton is waited for right after each tick, so that the time
+ * spent on the physics and on the game logic can be told apart. This
+ * removes the overlap of the two which the game has, so the sum of both
+ * is an upper bound of the time per tick in the game.
+ */
+static SimResult run_level(const LevelData &data, const SimOptions &options)
+{
+    SimResult result = SimResult();
+
+    const Clock::time_point load_start = Clock::now();
+    std::unique_ptr<Level> level = instantiate_level(data, options.physics_mp);
+    std::unique_ptr<WorkerPool> object_workers;
+    if (options.object_threads > 0) {
+        object_workers = std::unique_ptr<WorkerPool>(
+            new WorkerPool(options.object_threads));
+        level->set_parallel_objects(object_workers.get());
+        level->set_parallel_particles(object_workers.get());
+    }
+    level->particles().set_budget(options.particle_budget);
+    result.load_time = seconds_between(load_start, Clock::now());
+
+    TickCounter ticks = options.ticks;
+    bool until_settled = options.until_settled;
+    const InputRecording *const replay = options.replay.get();
+    if (replay) {
+        if (!start_replay(*level, data, replay)) {
+            // counts as diverged
+            return result;
+        }
+        ticks = replay->length();
+        until_settled = false;
+    }
+
+    for (TickCounter tick = 0; tick < ticks; tick++) {
+        const Clock::time_point t0 = Clock::now();
+        level->update();
+        const Clock::time_point t1 = Clock::now();
+        level->physics().wait_for();
+        const Clock::time_point t2 = Clock::now();
+
+        result.logic_time += seconds_between(t0, t1);
+        result.physics_time += seconds_between(t1, t2);
+        result.ticks += 1;
+
+        const size_t particles = level->particles().active_size();
+        if (particles > result.peak_particles) {
+            result.peak_particles = particles;
+        }
+
+        if (until_settled
+                && level->awake_objects() == 0
+                && level->pending_timers() == 0
+                && particles == 0)
+        {
+            result.settled = true;
+            break;
+        }
+    }
+
+    result.objects = level->live_objects();
+    result.awake = level->awake_objects();
+    result.particles = level->particles().active_size();
+    result.culled_particles = level->particles().culled();
+    result.peak_particle_memory = level->particles().peak_footprint();
+    result.digest = level->state_digest();
+    result.replay_matched = (replay && result.digest == replay->final_digest());
+    return result;
+}
+
+/**
+ * Run a level twice in lockstep, with the serial and with the parallel
+ * object update, and compare the state digests after each tick. The
+ * parallel update runs on --object-threads threads (or one per hardware
+ * thread), but on at least two, as it falls back to the serial update
+ * otherwise.
+ */
+static CheckResult check_level(const LevelData &data,
+                               const SimOptions &options)
+{
+    CheckResult result = CheckResult();
+
+    WorkerPool workers(std::max(
+        (options.object_threads
+         ? options.object_threads
+         : std::thread::hardware_concurrency()),
+        2u));
+    std::unique_ptr<Level> levels[2];
+    for (unsigned int i = 0; i < 2; i++) {
+        levels[i] = instantiate_level(data, options.physics_mp);
+        levels[i]->particles().set_budget(options.particle_budget);
+        if (options.replay
+                && !start_replay(*levels[i], data, options.replay.get()))
+        {
+            return result;
+        }
+    }
+    levels[1]->set_parallel_objects(&workers);
+    levels[1]->set_parallel_particles(&workers);
+
+    const TickCounter ticks = (options.replay
+                               ? options.replay->length()
+                               : options.ticks);
+    for (TickCounter tick = 1; tick <= ticks; tick++) {
+        uint64_t digests[2];
+        for (unsigned int i = 0; i < 2; i++) {
+            levels[i]->update();
+            levels[i]->physics().wait_for();
+            digests[i] = levels[i]->state_digest();
+        }
+        result.ticks = tick;
+
+        if (digests[1] != digests[0]) {
+            result.diverged_at = tick;
+            break;
+        }
+    }
+    return result;
+}
+
+static void print_check(const SimRun &run, const CheckResult &result)
+{
+    std::printf(
+        "%s:%zu %-24.24s ticks %6u  ",
+        run.collection.c_str(),
+        run.index,
+        run.data->get_display_name().c_str(),
+        result.ticks);
+    if (result.diverged_at) {
+        std::printf("DIVERGED at tick %u\n", result.diverged_at);
+    } else {
+        std::printf("ok\n");
+    }
+}
+
+static void print_result(const SimRun &run, const SimResult &result,
+                         const SimOptions &options)
+{
+    const double total = result.logic_time + result.physics_time;
+    std::printf(
+        "%s:%zu %-24.24s ticks %6u%s  %8.0f ticks/s  "
+        "load %7.2f ms  logic %7.1f us/tick  physics %7.1f us/tick  "
+        "objects %5zu (awake %4zu)  "
+        "particles %5zu (peak %5zu, culled %llu, %zu KiB)  "
+        "digest %016llx%s\n",
+        run.collection.c_str(),
+        run.index,
+        run.data->get_display_name().c_str(),
+        result.ticks,
+        result.settled ? "*" : " ",
+        total > 0 ? result.ticks / total : 0.,
+        result.load_time * 1e3,
+        result.ticks ? result.logic_time / result.ticks * 1e6 : 0.,
+        result.ticks ? result.physics_time / result.ticks * 1e6 : 0.,
+        result.objects,
+        result.awake,
+        result.particles,
+        result.peak_particles,
+        (unsigned long long)result.culled_particles,
+        result.peak_particle_memory / 1024,
+        (unsigned long long)result.digest,
+        !options.replay ? ""
+        : result.replay_matched ? "  replay ok" : "  replay DIVERGED");
+}
+
+static void usage(const char *argv0)
+{
+    std::fprintf(
+        stderr,
+        "usage: %s [options] COLLECTION...\n"
+        "\n"
+        "Run the levels of the given level collections without a window\n"
+        "and report timings and statistics for each of them.\n"
+        "\n"
+        "  -t, --ticks N           run each level for at most N ticks\n"
+        "                          (default: 1000)\n"
+        "  -s, --until-settled     stop a level early once no object is\n"
+        "                          awake and no timer or particle is left\n"
+        "  -l, --level INDEX       only run the level with the given index;\n"
+        "                          may be given multiple times\n"
+        "  -r, --repeat N          run each level N times (default: 1)\n"
+        "  -j, --jobs N            run up to N levels at the same time\n"
+        "                          (default: one per hardware thread)\n"
+        "  -o, --object-threads N  update the objects and particles of each\n"
+        "                          level in parallel on N threads (default:\n"
+        "                          serial)\n"
+        "  -p, --physics-threads   use multiple threads for the physics of\n"
+        "                          each level\n"
+        "  -b, --particle-budget N limit the particles of each level to N\n"
+        "                          (default: %zu)\n"
+        "  -c, --check-objects     instead of timing the levels, check that\n"
+        "                          the parallel object update on\n"
+        "                          --object-threads threads (default: one\n"
+        "                          per hardware thread, at least two) gives\n"
+        "                          the same state as the serial update in\n"
+        "                          every tick\n"
+        "  -T, --tilesets DIR      load tilesets from DIR\n"
+        "                          (default: data/tilesets)\n"
+        "  -R, --replay FILE       drive the player of each level with the\n"
+        "                          input recorded in FILE, for as many ticks\n"
+        "                          as were recorded; a player is placed if\n"
+        "                          the level has none\n"
+        "\n"
+        "Levels which settled before reaching the tick limit are marked\n"
+        "with an asterisk. When replaying, each run is checked against the\n"
+        "state digest stored in the recording; the exit status is 1 if any\n"
+        "run diverged. Replays only match recordings made with the same\n"
+        "--particle-budget, as particles are culled once it is reached. The\n"
+        "parallel object update gives the same result as the serial one, so\n"
+        "--object-threads does not matter. With --check-objects, the exit\n"
+        "status is 1 if any level diverged.\n",
+        argv0,
+        ParticleSystem::default_budget);
+}
+
+static unsigned long parse_number(const char *arg, const char *option)
+{
+    char *end = nullptr;
+    const unsigned long result = std::strtoul(arg, &end, 10);
+    if (!*arg || *end) {
+        throw std::invalid_argument(
+            std::string("invalid number for ") + option + ": " + arg);
+    }
+    return result;
+}
+
+static bool parse_options(int argc, char **argv,
+                          SimOptions &options,
+                          std::vector<std::string> &collections)
+{
+    static const struct option long_options[] = {
+        {"ticks", required_argument, nullptr, 't'},
+        {"until-settled", no_argument, nullptr, 's'},
+        {"level", required_argument, nullptr, 'l'},
+        {"repeat", required_argument, nullptr, 'r'},
+        {"jobs", required_argument, nullptr, 'j'},
+        {"object-threads", required_argument, nullptr, 'o'},
+        {"physics-threads", no_argument, nullptr, 'p'},
+        {"particle-budget", required_argument, nullptr, 'b'},
+        {"check-objects", no_argument, nullptr, 'c'},
+        {"tilesets", required_argument, nullptr, 'T'},
+        {"replay", required_argument, nullptr, 'R'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:sl:r:j:o:pb:cT:R:h",
+                              long_options, nullptr)) != -1)
+    {
+        switch (opt) {
+        case 't':
+        {
+            options.ticks = parse_number(optarg, "--ticks");
+            break;
+        }
+        case 's':
+        {
+            options.until_settled = true;
+            break;
+        }
+        case 'l':
+        {
+            options.levels.push_back(parse_number(optarg, "--level"));
+            break;
+        }
+        case 'r':
+        {
+            options.repeat = parse_number(optarg, "--repeat");
+            break;
+        }
+        case 'j':
+        {
+            options.jobs = parse_number(optarg, "--jobs");
+            break;
+        }
+        case 'o':
+        {
+            options.object_threads = parse_number(optarg, "--object-threads");
+            break;
+        }
+        case 'p':
+        {
+            options.physics_mp = true;
+            break;
+        }
+        case 'b':
+        {
+            options.particle_budget = parse_number(optarg, "--particle-budget");
+            break;
+        }
+        case 'c':
+        {
+            options.check_objects = true;
+            break;
+        }
+        case 'T':
+        {
+            options.tileset_dir = optarg;
+            break;
+        }
+        case 'R':
+        {
+            StreamHandle stream(new FileStream(optarg, OM_READ));
+            options.replay = std::unique_ptr<InputRecording>(
+                new InputRecording());
+            options.replay->load(*stream);
+            break;
+        }
+        default:
+        {
+            usage(argv[0]);
+            return false;
+        }
+        }
+    }
+
+    for (int i = optind; i < argc; i++) {
+        collections.push_back(argv[i]);
+    }
+    if (collections.empty()) {
+        usage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+static int run(int argc, char **argv)
+{
+    SimOptions options;
+    std::vector<std::string> filenames;
+    if (!parse_options(argc, argv, options, filenames)) {
+        return 2;
+    }
+
+    TilesetCache tilesets(options.tileset_dir);
+    std::vector<std::unique_ptr<LevelCollection>> collections;
+    std::vector<SimRun> runs;
+    for (const std::string &filename: filenames) {
+        collections.push_back(load_collection(filename, tilesets));
+        const LevelCollection &collection = *collections.back();
+
+        std::vector<size_t> indices = options.levels;
+        if (indices.empty()) {
+            for (size_t i = 0; i < collection.levels.size(); i++) {
+                indices.push_back(i);
+            }
+        }
+
+        for (const size_t index: indices) {
+            if (index >= collection.levels.size()) {
+                std::fprintf(stderr, "ml-sim: %s has no level %zu\n",
+                             filename.c_str(), index);
+                continue;
+            }
+            for (unsigned int i = 0; i < options.repeat; i++) {
+                runs.push_back(SimRun{filename, index,
+                                      collection.levels[index].get()});
+            }
+        }
+    }
+
+    std::mutex output_mutex;
+    WorkerPool pool(options.jobs);
+
+    if (options.check_objects) {
+        std::vector<CheckResult> checks(runs.size());
+        pool.parallel_for(
+            runs.size(),
+            [&](size_t index, unsigned int) {
+                checks[index] = check_level(*runs[index].data, options);
+                std::lock_guard<std::mutex> lock(output_mutex);
+                print_check(runs[index], checks[index]);
+                std::fflush(stdout);
+            });
+
+        size_t diverged = 0;
+        for (const CheckResult &check: checks) {
+            if (check.diverged_at) {
+                diverged += 1;
+            }
+        }
+        if (diverged > 0) {
+            std::printf("%zu of %zu levels diverged with parallel objects\n",
+                        diverged, runs.size());
+            return 1;
+        }
+        return 0;
+    }
+
+    std::vector<SimResult> results(runs.size());
+
+    const Clock::time_point start = Clock::now();
+    pool.parallel_for(
+        runs.size(),
+        [&](size_t index, unsigned int) {
+            results[index] = run_level(*runs[index].data, options);
+            std::lock_guard<std::mutex> lock(output_mutex);
+            print_result(runs[index], results[index], options);
+            std::fflush(stdout);
+        });
+    const double wall_time = seconds_between(start, Clock::now());
+
+    uint64_t total_ticks = 0;
+    double logic_time = 0, physics_time = 0;
+    size_t diverged = 0;
+    for (const SimResult &result: results) {
+        if (options.replay && !result.replay_matched) {
+            diverged += 1;
+        }
+        total_ticks += result.ticks;
+        logic_time += result.logic_time;
+        physics_time += result.physics_time;
+    }
+
+    std::printf(
+        "%zu runs on %u threads: %llu ticks in %.2f s (%.0f ticks/s), "
+        "logic %.1f s, physics %.1f s\n",
+        runs.size(),
+        pool.thread_count(),
+        (unsigned long long)total_ticks,
+        wall_time,
+        wall_time > 0 ? total_ticks / wall_time : 0.,
+        logic_time,
+        physics_time);
+
+    if (diverged > 0) {
+        std::printf("%zu of %zu replays diverged\n", diverged, runs.size());
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    try {
+        return run(argc, argv);
+    } catch (const Exception &err) {
+        std::fprintf(stderr, "ml-sim: %s\n", err.what());
+        return 1;
+    } catch (const std::exception &err) {
+        std::fprintf(stderr, "ml-sim: %s\n", err.what());
+        return 1;
+    }
+}